@@ -0,0 +1,397 @@
+#include <stdio.h>        // printf, fdopen
+#include <stdlib.h>       // malloc, free, calloc, realloc, setenv
+#include <string.h>       // strcmp, memset
+#include <time.h>         // clock_gettime
+#include <stdint.h>       // uint64_t
+#include <unistd.h>       // fork, execl, pipe
+#include <pthread.h>      // pthread_create, pthread_join
+#include <sched.h>        // sched_yield
+#include <limits.h>       // PATH_MAX
+#include <sys/resource.h> // struct rusage
+#include <sys/wait.h>     // wait4
+
+/** @brief Number of pointers in flight between a producer and its consumer. */
+#define QUEUE_CAPACITY 1024
+
+/**
+ * @struct benchmark_t
+ * @brief Represents a benchmark of the suite.
+ */
+typedef struct benchmark_t
+{
+    const char *name;       // Name printed in the results
+    unsigned int threads;   // Number of threads calling the allocator
+    size_t (*run)(void);    // Runs the benchmark, returns the number of allocator calls
+} benchmark_t;
+
+/**
+ * @struct queue_t
+ * @brief Represents a single-producer single-consumer queue of pointers.
+ */
+typedef struct queue_t
+{
+    void *items[QUEUE_CAPACITY]; // Pointers in flight
+    size_t head;                 // Next item written by the producer
+    size_t tail;                 // Next item read by the consumer
+    size_t count;                // Number of items the producer sends
+} queue_t;
+
+/**
+ * @brief Draws a random number with xorshift64.
+ *
+ * @param state The state of the generator, not 0.
+ * @return A random number.
+ */
+static uint64_t next_random(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+
+    return *state;
+}
+
+/**
+ * @brief Keeps the compiler from removing an allocation it can see is never read.
+ *
+ * @param ptr The allocation.
+ */
+static void keep(void *ptr)
+{
+    __asm__ volatile("" : : "g"(ptr) : "memory");
+}
+
+/**
+ * @brief Draws a size between @min and @max: the power of two is drawn first, so small
+ * sizes are as common as in real programs.
+ */
+static size_t random_size(uint64_t *state, size_t min, size_t max)
+{
+    unsigned int low = 63 - __builtin_clzll(min);
+    unsigned int high = 63 - __builtin_clzll(max);
+    size_t base = (size_t)1 << (low + next_random(state) % (high - low + 1));
+    size_t size = base + next_random(state) % base;
+
+    return size < min ? min : (size > max ? max : size);
+}
+
+/**
+ * @brief Replaces random allocations of a window of live allocations.
+ * Each allocation is written so that its pages are really used.
+ *
+ * @param min The smallest size.
+ * @param max The biggest size.
+ * @param window The number of live allocations.
+ * @param operations The number of replacements.
+ * @return The number of allocator calls.
+ */
+static size_t run_churn(size_t min, size_t max, size_t window, size_t operations)
+{
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    void **ptrs = calloc(window, sizeof(void *));
+
+    for (size_t i = 0; i < operations; i++)
+    {
+        size_t slot = next_random(&state) % window;
+        free(ptrs[slot]);
+
+        size_t size = random_size(&state, min, max);
+        ptrs[slot] = malloc(size);
+        memset(ptrs[slot], (int)i, size < 64 ? size : 64);
+        keep(ptrs[slot]);
+    }
+
+    for (size_t slot = 0; slot < window; slot++)
+        free(ptrs[slot]);
+    free(ptrs);
+
+    return 2 * operations + window;
+}
+
+static size_t run_small(void)
+{
+    return run_churn(16, 512, 64, 4000000);
+}
+
+static size_t run_medium(void)
+{
+    return run_churn(1024, 64 * 1024, 64, 1000000);
+}
+
+static size_t run_large(void)
+{
+    return run_churn(256 * 1024, 4 * 1024 * 1024, 8, 50000);
+}
+
+static size_t run_fragmentation(void)
+{
+    return run_churn(16, 16 * 1024, 20000, 1000000);
+}
+
+/**
+ * @brief Grows buffers by small appends, like a string builder.
+ */
+static size_t run_realloc_append(void)
+{
+    size_t calls = 0;
+
+    for (int buffer = 0; buffer < 64; buffer++)
+    {
+        char *data = NULL;
+        for (size_t size = 16; size <= 1024 * 1024; size += 64)
+        {
+            data = realloc(data, size);
+            data[size - 1] = 1;
+            keep(data);
+            calls++;
+        }
+        free(data);
+        calls++;
+    }
+
+    return calls;
+}
+
+/**
+ * @brief Grows buffers by doubling their size, like a vector.
+ */
+static size_t run_realloc_double(void)
+{
+    size_t calls = 0;
+
+    for (int buffer = 0; buffer < 200; buffer++)
+    {
+        char *data = NULL;
+        for (size_t size = 16; size <= 64 * 1024 * 1024; size *= 2)
+        {
+            data = realloc(data, size);
+            data[size - 1] = 1;
+            keep(data);
+            calls++;
+        }
+        free(data);
+        calls++;
+    }
+
+    return calls;
+}
+
+/**
+ * @brief Allocates big zeroed blocks and touches one byte per page.
+ */
+static size_t run_calloc_large(void)
+{
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+
+    for (int i = 0; i < 500; i++)
+    {
+        size_t size = random_size(&state, 1024 * 1024, 16 * 1024 * 1024);
+        char *data = calloc(1, size);
+        for (size_t offset = 0; offset < size; offset += 4096)
+            data[offset]++;
+        keep(data);
+        free(data);
+    }
+
+    return 2 * 500;
+}
+
+/**
+ * @brief Allocates blocks and hands them over to the consumer of the queue.
+ */
+static void *produce(void *arg)
+{
+    queue_t *queue = arg;
+    uint64_t state = (uintptr_t)arg | 1;
+
+    for (size_t i = 0; i < queue->count; i++)
+    {
+        char *ptr = malloc(random_size(&state, 64, 1024));
+        ptr[0] = 1;
+        keep(ptr);
+
+        while (i - __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) >= QUEUE_CAPACITY)
+            sched_yield();
+        queue->items[i % QUEUE_CAPACITY] = ptr;
+        __atomic_store_n(&queue->head, i + 1, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Frees the blocks sent by the producer of the queue.
+ */
+static void *consume(void *arg)
+{
+    queue_t *queue = arg;
+
+    for (size_t i = 0; i < queue->count; i++)
+    {
+        while (__atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) == i)
+            sched_yield();
+        free(queue->items[i % QUEUE_CAPACITY]);
+        __atomic_store_n(&queue->tail, i + 1, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Runs two producer and consumer pairs: every block is freed by another thread.
+ */
+static size_t run_producer_consumer(void)
+{
+    static queue_t queues[2];
+    pthread_t threads[4];
+
+    for (int i = 0; i < 2; i++)
+    {
+        queues[i].count = 500000;
+        pthread_create(&threads[2 * i], NULL, produce, &queues[i]);
+        pthread_create(&threads[2 * i + 1], NULL, consume, &queues[i]);
+    }
+
+    for (int i = 0; i < 4; i++)
+        pthread_join(threads[i], NULL);
+
+    return 2 * 2 * 500000;
+}
+
+static const benchmark_t benchmarks[] = {
+    {"malloc_free_small", 1, run_small},
+    {"malloc_free_medium", 1, run_medium},
+    {"malloc_free_large", 1, run_large},
+    {"fragmentation_churn", 1, run_fragmentation},
+    {"realloc_append", 1, run_realloc_append},
+    {"realloc_double", 1, run_realloc_double},
+    {"calloc_large", 1, run_calloc_large},
+    {"producer_consumer", 4, run_producer_consumer},
+};
+
+/**
+ * @brief Returns a monotonic timestamp in seconds.
+ */
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Runs a benchmark in a child process, with @library preloaded or with the C library allocator.
+ *
+ * @param index The index of the benchmark.
+ * @param library The library to preload, NULL for the C library allocator.
+ * @param calls Set to the number of allocator calls.
+ * @param seconds Set to the duration of the benchmark.
+ * @param peak_rss Set to the peak resident size of the child in KiB.
+ * @return 0 on success, -1 if the child failed.
+ */
+static int run_child(size_t index, const char *library, size_t *calls, double *seconds, long *peak_rss)
+{
+    int fds[2];
+    if (pipe(fds) == -1)
+        return -1;
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        if (library != NULL)
+            setenv("LD_PRELOAD", library, 1);
+        else
+            unsetenv("LD_PRELOAD");
+
+        char arg[16];
+        snprintf(arg, sizeof(arg), "%zu", index);
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        execl("/proc/self/exe", "bench_alloc", "--run", arg, (char *)NULL);
+        _exit(127);
+    }
+    close(fds[1]);
+
+    FILE *output = fdopen(fds[0], "r");
+    int parsed = output != NULL && fscanf(output, "%zu %lf", calls, seconds) == 2;
+    if (output != NULL)
+        fclose(output);
+
+    int status = 0;
+    struct rusage usage;
+    if (pid == -1 || wait4(pid, &status, 0, &usage) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0 || !parsed)
+        return -1;
+
+    *peak_rss = usage.ru_maxrss;
+
+    return 0;
+}
+
+/**
+ * @brief Runs the benchmark suite against the C library allocator and a preloaded allocator.
+ * Every benchmark runs in its own process, and one CSV line is printed per benchmark and
+ * allocator. The relative column is the time of a call divided by the one of the C library.
+ *
+ * Usage: bench_alloc <library to preload>
+ */
+int main(int argc, char **argv)
+{
+    // Child side: run one benchmark and report its calls and duration
+    if (argc == 3 && strcmp(argv[1], "--run") == 0)
+    {
+        const benchmark_t *benchmark = &benchmarks[strtoul(argv[2], NULL, 10)];
+
+        double start = now();
+        size_t calls = benchmark->run();
+        printf("%zu %f\n", calls, now() - start);
+
+        return 0;
+    }
+
+    if (argc != 2)
+    {
+        fprintf(stderr, "usage: %s <library to preload>\n", argv[0]);
+        return 1;
+    }
+
+    char library[PATH_MAX];
+    if (realpath(argv[1], library) == NULL)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+
+    const char *allocators[] = {"glibc", "my_secmalloc"};
+    const char *libraries[] = {NULL, library};
+
+    printf("benchmark,allocator,threads,calls,seconds,ns_per_call,peak_rss_kib,relative\n");
+    for (size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++)
+    {
+        double baseline = 0;
+
+        for (int allocator = 0; allocator < 2; allocator++)
+        {
+            size_t calls = 0;
+            double seconds = 0;
+            long peak_rss = 0;
+
+            if (run_child(i, libraries[allocator], &calls, &seconds, &peak_rss) == -1)
+            {
+                printf("%s,%s,%u,,,,,\n", benchmarks[i].name, allocators[allocator], benchmarks[i].threads);
+                fflush(stdout);
+                continue;
+            }
+
+            double ns_per_call = seconds * 1e9 / calls;
+            if (allocator == 0)
+                baseline = ns_per_call;
+
+            printf("%s,%s,%u,%zu,%.6f,%.1f,%ld,%.2f\n", benchmarks[i].name, allocators[allocator], benchmarks[i].threads,
+                   calls, seconds, ns_per_call, peak_rss, baseline > 0 ? ns_per_call / baseline : 0);
+            fflush(stdout);
+        }
+    }
+
+    return 0;
+}
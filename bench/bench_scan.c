@@ -0,0 +1,104 @@
+#include <stdio.h>  // printf
+#include <stdlib.h> // malloc, rand_r, strtol
+#include <time.h>   // clock_gettime
+
+#include "my_secmalloc.private.h"
+#include "my_secmalloc.h"
+#include "utils.h"
+
+extern int log_fd;
+
+/**
+ * @brief Draws a chunk size spread over the size classes served by the chunks of an arena.
+ *
+ * @param seed The state of the random generator.
+ * @return A size between SLAB_MAX_SIZE and LARGE_CHUNK_THRESHOLD.
+ */
+static size_t random_size(unsigned int *seed)
+{
+    unsigned int shift = 10 + rand_r(seed) % 7; // 1 KiB to 64 KiB
+    size_t size = ((size_t)1 << shift) + rand_r(seed) % ((size_t)1 << shift);
+
+    return size > SLAB_MAX_SIZE ? size : SLAB_MAX_SIZE + 1;
+}
+
+/**
+ * @brief Returns a monotonic timestamp in nanoseconds.
+ */
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * @brief Measures the throughput of find_free_chunk on a fragmented arena.
+ * Free chunks of random sizes are kept apart by used guards so that they can't be merged,
+ * then the free lists are searched for random sizes.
+ *
+ * Usage: bench_scan [free chunks] [queries]
+ */
+int main(int argc, char **argv)
+{
+    size_t chunks = argc > 1 ? strtoul(argv[1], NULL, 10) : 100000;
+    size_t queries = argc > 2 ? strtoul(argv[2], NULL, 10) : 2000000;
+    unsigned int seed = 42;
+
+    init_heap();
+    log_fd = DEACTIVATE_LOGGING;
+    arena_t *arena = get_thread_arena();
+
+    void **victims = malloc(chunks * sizeof(void *));
+    for (size_t i = 0; i < chunks; i++)
+    {
+        victims[i] = my_malloc(random_size(&seed));
+        my_malloc(600); // Guard
+    }
+
+    // Free in random order so that neighbours in the free lists are far apart in memory
+    for (size_t i = chunks - 1; i > 0; i--)
+    {
+        size_t j = rand_r(&seed) % (i + 1);
+        void *tmp = victims[i];
+        victims[i] = victims[j];
+        victims[j] = tmp;
+    }
+    for (size_t i = 0; i < chunks; i++)
+        my_free(victims[i]);
+
+    // Random sizes, then the biggest size of the same classes: few chunks of the
+    // requested class fit those, so the class is scanned before a bigger one is taken
+    size_t *sizes = malloc(queries * sizeof(size_t));
+    size_t *class_max_sizes = malloc(queries * sizeof(size_t));
+    for (size_t i = 0; i < queries; i++)
+    {
+        sizes[i] = random_size(&seed);
+        unsigned int class = get_size_class(sizes[i] + sizeof(canary_t));
+        for (class_max_sizes[i] = sizes[i]; get_size_class(class_max_sizes[i] + 1 + sizeof(canary_t)) == class;)
+            class_max_sizes[i]++;
+    }
+
+    printf("descriptor size: %zu bytes\n", sizeof(chunk_list_t));
+    printf("free chunks:     %zu\n", chunks);
+    printf("queries:         %zu\n", queries);
+
+    const char *names[] = {"random sizes", "class max sizes"};
+    size_t *query_sizes[] = {sizes, class_max_sizes};
+    for (int pass = 0; pass < 2; pass++)
+    {
+        size_t found = 0;
+        double start = now_ns();
+        for (size_t i = 0; i < queries; i++)
+            found += find_free_chunk(arena, query_sizes[pass][i]) != NULL;
+        double elapsed = now_ns() - start;
+
+        printf("%-16s %.1f ns/query, %.2f Mqueries/s (%zu found)\n", names[pass], elapsed / queries, queries / elapsed * 1e3, found);
+    }
+
+    free(sizes);
+    free(class_max_sizes);
+    free(victims);
+    return 0;
+}
@@ -2,10 +2,24 @@
 #define _SECMALLOC_H
 
 #include <stddef.h>
+#include <stdio.h>
+#include <malloc.h>
 
 void    *malloc(size_t size);
 void    free(void *ptr);
+void    free_sized(void *ptr, size_t size);
+void    free_aligned_sized(void *ptr, size_t alignment, size_t size);
+size_t  malloc_usable_size(void *ptr);
 void    *calloc(size_t nmemb, size_t size);
 void    *realloc(void *ptr, size_t size);
+int     posix_memalign(void **memptr, size_t alignment, size_t size);
+void    *aligned_alloc(size_t alignment, size_t size);
+void    *memalign(size_t alignment, size_t size);
+void    *valloc(size_t size);
+void    *pvalloc(size_t size);
+int     malloc_trim(size_t pad);
+struct mallinfo2 mallinfo2(void);
+void    malloc_stats(void);
+int     malloc_info(int options, FILE *fp);
 
 #endif
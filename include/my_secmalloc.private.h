@@ -2,53 +2,571 @@
 #define _SECMALLOC_PRIVATE_H
 
 #include <stdint.h>
+#include <pthread.h>
 
 #include "my_secmalloc.h"
 #include "utils.h"
 
+/** @brief Number of segregated free lists, one per size class. */
+#define BIN_COUNT 64
+
+/** @brief Smallest size class boundary, as a power of two (16 bytes). */
+#define BIN_MIN_SHIFT 4
+
+/** @brief Each power of two is divided in 2^BIN_SUBDIVISION_BITS sub-bins. */
+#define BIN_SUBDIVISION_BITS 2
+#define BIN_SUBDIVISIONS (1 << BIN_SUBDIVISION_BITS)
+
+/** @brief Maximum number of chunks inspected in the bin of the requested size class. */
+#define BIN_SCAN_LIMIT 8
+
+/** @brief Number of free chunks held by a bin when it is first mapped, it doubles each time it is full. */
+#define FREE_BIN_MIN_CAPACITY ((uint32_t)1 << 10)
+
+/** @brief Slot of a chunk which is not in a bin. */
+#define FREE_BIN_NONE UINT32_MAX
+
+/** @brief Chunk sizes are rounded up to a multiple of CHUNK_ALIGNMENT bytes. */
+#define CHUNK_ALIGNMENT 16
+#define ALIGN_CHUNK_SIZE(size) ((size) % CHUNK_ALIGNMENT ? (size) + CHUNK_ALIGNMENT - ((size) % CHUNK_ALIGNMENT) : (size))
+
+/** @brief Biggest chunk size kept in the per-thread caches. */
+#define THREAD_CACHE_MAX_SIZE 1024
+
+/** @brief Number of per-thread cache bins, one per CHUNK_ALIGNMENT bytes. */
+#define THREAD_CACHE_BIN_COUNT (THREAD_CACHE_MAX_SIZE / CHUNK_ALIGNMENT)
+
+/** @brief Maximum number of chunks held in a per-thread cache bin. */
+#define THREAD_CACHE_BIN_CAPACITY 8
+
+/** @brief Maximum number of arenas, threads are spread over them round-robin. */
+#define ARENA_COUNT 8
+
+/** @brief Biggest allocation served from the slabs. */
+#define SLAB_MAX_SIZE 512
+
+/** @brief Size in bytes of a slab, slabs are aligned on their size. */
+#define SLAB_SHIFT 12
+#define SLAB_SIZE (1 << SLAB_SHIFT)
+
+/** @brief Smallest slot of a slab, canary included. Slot sizes are multiples of CHUNK_ALIGNMENT. */
+#define SLAB_MIN_SLOT_SIZE 32
+
+/** @brief Number of slab classes, one per slot size. */
+#define SLAB_CLASS_COUNT (ALIGN_CHUNK_SIZE(SLAB_MAX_SIZE + sizeof(canary_t)) / CHUNK_ALIGNMENT)
+
+/** @brief Number of 64-bit words in the bitmap of the free slots of a slab. */
+#define SLAB_BITMAP_WORDS (SLAB_SIZE / SLAB_MIN_SLOT_SIZE / 64)
+
+/** @brief Number of slabs committed at once by an arena. */
+#define SLAB_BATCH_COUNT 16
+
+/** @brief Part of the reserved range given to the slabs, as a power of two divisor. */
+#define SLAB_RESERVE_SHIFT 4
+
+/** @brief Size in bytes of the address range reserved for the data pools of all arenas. */
+#define HEAP_RESERVE_SIZE ((size_t)64 << 30)
+
+/** @brief Smallest reservation accepted when the address space is limited. */
+#define HEAP_RESERVE_MIN_SIZE ((size_t)256 << 20)
+
+/** @brief Size in bytes of the first data extent of an arena. */
+#define DATA_EXTENT_MIN_SIZE (1024 * 1024)
+
+/** @brief Biggest size in bytes of a data extent, extents double in size up to it. */
+#define DATA_EXTENT_MAX_SIZE (64 * 1024 * 1024)
+
+/** @brief Allocations of at least this size get their own mapping instead of a chunk of an arena. */
+#define LARGE_CHUNK_THRESHOLD (256 * 1024)
+
+/** @brief Size in bytes of the first metadata block of an arena. */
+#define METADATA_BLOCK_INITIAL_SIZE (64 * 1024)
+
+/** @brief Biggest size in bytes of a metadata block, blocks double in size up to it. */
+#define METADATA_BLOCK_MAX_SIZE (4 * 1024 * 1024)
+
+/** @brief Default time in milliseconds free pages stay committed before they are purged. */
+#define DECAY_DEFAULT_MS 10000
+
+/** @brief Number of descriptors whose canaries the heap scanner checks per batch. */
+#define SCAN_BATCH_SIZE 256
+
+/** @brief Number of slabs whose canaries the heap scanner checks per batch. */
+#define SCAN_SLAB_BATCH_COUNT 16
+
+/** @brief Shortest pause in milliseconds of the heap scanner between two passes over the heap. */
+#define SCAN_PASS_MIN_MS 100
+
+/** @brief Number of corrupted blocks remembered by a scan, so that each one is reported once. */
+#define SCAN_REPORTED_COUNT 64
+
+/** @brief Number of pages of the guarded pool, each of them followed by a guard page. */
+#define GUARD_SLOT_COUNT 64
+
+/** @brief Number of freed blocks a thread gathers before they enter the quarantine. */
+#define QUARANTINE_BATCH_SIZE 32
+
+/** @brief Default number of blocks held by the quarantine. */
+#define QUARANTINE_DEFAULT_COUNT 4096
+
+/** @brief Biggest number of blocks held by the quarantine. */
+#define QUARANTINE_MAX_COUNT ((size_t)1 << 20)
+
+/** @brief Byte quarantined blocks are filled with. */
+#define QUARANTINE_POISON 0xdb
+
+/** @brief Initial number of slots of the chunk index, must be a power of two. */
+#define CHUNK_INDEX_INITIAL_CAPACITY 1024
+
+/** @brief Biggest number of slots of the chunk index. */
+#define CHUNK_INDEX_MAX_CAPACITY ((size_t)1 << 24)
+
+/** @brief Key marking a deleted slot of the chunk index. */
+#define CHUNK_INDEX_TOMBSTONE ((void *)1)
+
+/** @brief The info word of a chunk holds its size in the low 48 bits, then its state and the index of its arena. */
+#define CHUNK_STATE_SHIFT 48
+#define CHUNK_ARENA_SHIFT 56
+#define CHUNK_SIZE_MASK (((size_t)1 << CHUNK_STATE_SHIFT) - 1)
+#define CHUNK_STATE_MASK ((size_t)0xff << CHUNK_STATE_SHIFT)
+
 /** @brief Represents the state of a memory chunk. */
 typedef enum
 {
     FREE,
-    USED
+    USED,
+    CACHED, // Freed, but held by a per-thread cache
+    PENDING,    // Freed by a thread of another arena, waiting in the remote free queue
+    QUARANTINED // Freed, held by the quarantine until it is recycled
 } chunk_state_t;
 
+struct arena_t;
+
 /**
  * @struct chunk_list_t
  * @brief Represents a node in the chunk list.
  *
  * This struct is used to store information about a chunk in the chunk list.
- * It contains a pointer to the actual chunk data and a pointer to the next chunk in the list.
+ * It contains a pointer to the actual chunk data and pointers to the neighbour chunks in the list.
+ * Chunks that are adjacent in memory are always neighbours in the list.
+ * The size, the state and the arena share one word, read through get_chunk_size, get_chunk_state
+ * and get_chunk_arena. The last word depends on the state: a used chunk needs its canary, a free
+ * chunk its bin slot and decay clock, and a cached or pending chunk its link.
  */
 typedef struct chunk_list_t
 {
     struct chunk_list_t *next; // Next element in the list
-    size_t size;               // Size of the chunk
+    struct chunk_list_t *prev; // Previous element in the list
     void *data;                // Address of chunk data
-    chunk_state_t state;       // State of the chunk
-    canary_t canary;           // Canary protection
+    size_t info;               // Size, state and arena index of the chunk
+    union
+    {
+        canary_t canary; // Canary protection, while used or quarantined
+        struct
+        {
+            uint32_t bin_slot;    // Position in the bin of its size class, FREE_BIN_NONE if not binned
+            uint32_t dirty_since; // Decay clock when the chunk was freed, 0 while its pages are zero
+        };
+        struct chunk_list_t *next_free; // Next chunk in a cache, a remote free queue or the free descriptors
+    };
 } chunk_list_t;
 
+/**
+ * @struct metadata_block_t
+ * @brief Represents a mapping holding chunk descriptors.
+ *
+ * Blocks are chained and never moved, so descriptors keep their address
+ * until the heap is cleaned.
+ */
+typedef struct metadata_block_t
+{
+    struct metadata_block_t *next; // Previously mapped block
+    size_t size;                   // Size of the mapping in bytes
+    size_t capacity;               // Number of descriptors in the block
+    chunk_list_t chunks[];         // Descriptors
+} metadata_block_t;
+
+/**
+ * @struct slab_t
+ * @brief Represents the header of a slab.
+ *
+ * A slab is a page split in slots of the same size, each of them ending with a canary.
+ * Headers are kept out of the slabs, in an array indexed by the slab address.
+ */
+typedef struct slab_t
+{
+    struct slab_t *next;                        // Next slab of the same class with free slots
+    struct slab_t *prev;                        // Previous slab of the same class with free slots
+    struct arena_t *arena;                      // Arena owning the slab, NULL until it is committed
+    uint64_t free_map[SLAB_BITMAP_WORDS];       // Bit i is set when slot i is free
+    uint64_t quarantine_map[SLAB_BITMAP_WORDS]; // Bit i is set when slot i is freed but held by the quarantine
+    unsigned int slot_size;                     // Size of a slot, canary included, 0 if the slab is empty
+    unsigned int slot_count;                    // Number of slots
+    unsigned int free_count;                    // Number of free slots
+    canary_t canary;                            // Secret the canaries of the slots are derived from
+    uint32_t dirty_since;                       // Decay clock when the slab became empty, 0 once it is purged
+} slab_t;
+
+/**
+ * @struct arena_t
+ * @brief Represents an independent heap.
+ *
+ * Each arena has its own lock, metadata pool, data pool and free lists.
+ * The free lists are dense arrays: the sizes of the free chunks of a class are
+ * contiguous, so searching them doesn't touch the descriptors.
+ * Chunks freed by threads assigned to another arena are pushed on a lock-free
+ * multiple-producer single-consumer stack that the arena drains in batches.
+ * Pages of free chunks and empty slabs are given back to the system once they
+ * have been free for the decay time.
+ */
+typedef struct arena_t
+{
+    pthread_mutex_t lock;                  // Protects everything in the arena but remote_frees
+    metadata_block_t *metadata;            // Metadata blocks, the newest first
+    size_t metadata_size;                  // Number of descriptors taken from the newest block
+    chunk_list_t *free_metadata;           // Descriptors released by merges, linked through next_free
+    uint8_t *data_start;                   // Start of the slice of the reserved range given to the arena
+    uint8_t *data_end;                     // End of the committed part of the slice
+    uint8_t *data_limit;                   // End of the slice
+    size_t extent_size;                    // Size of the next data extent
+    chunk_list_t *head;                    // First chunk of the list
+    chunk_list_t *tail;                    // Last chunk of the list
+    uint32_t *free_sizes[BIN_COUNT];       // Sizes of the free chunks per size class
+    chunk_list_t **free_chunks[BIN_COUNT]; // Free chunks, in the same order as free_sizes
+    uint32_t free_capacities[BIN_COUNT];   // Number of chunks the bins can hold before they are grown
+    uint32_t free_counts[BIN_COUNT];       // Number of free chunks per size class
+    uint64_t free_bins_map;                // Bit i is set when free_counts[i] is not 0
+    chunk_list_t *remote_frees;            // Chunks freed by other arenas' threads, linked through next_free
+    chunk_list_t *large_chunks;            // Chunks with their own mapping, linked through next and prev
+    slab_t *slabs[SLAB_CLASS_COUNT];       // Slabs with free slots, by slot size
+    slab_t *empty_slabs;                   // Slabs without slot in use, linked through next
+    uint8_t *slab_batch;                   // Next committed slab not given to a class yet
+    uint8_t *slab_batch_end;               // End of the committed slabs
+    uint32_t last_purge;                   // Decay clock of the last purge of free pages
+    size_t slabs_size;                     // Bytes of the slabs committed for the arena
+    size_t slots_size;                     // Bytes of the slots in use, canaries included
+    size_t large_count;                    // Number of chunks with their own mapping
+    size_t large_size;                     // Bytes mapped for the chunks with their own mapping
+} arena_t;
+
+/** @brief Independent heaps, the info word of a chunk holds the index of its arena. */
+extern arena_t arenas[ARENA_COUNT];
+
+/**
+ * @brief Gets the size of a chunk from its info word.
+ *
+ * @param chunk The chunk.
+ * @return The size of the chunk data, its canary excluded.
+ */
+static inline size_t get_chunk_size(const chunk_list_t *chunk)
+{
+    return __atomic_load_n(&chunk->info, __ATOMIC_RELAXED) & CHUNK_SIZE_MASK;
+}
+
+/**
+ * @brief Sets the size of a chunk, its state and its arena are kept.
+ * Only the owner of a chunk changes its size: other threads only swap the state of a used chunk,
+ * which is never resized behind the back of the caller holding it.
+ *
+ * @param chunk The chunk.
+ * @param size The new size, smaller than 2^CHUNK_STATE_SHIFT.
+ */
+static inline void set_chunk_size(chunk_list_t *chunk, size_t size)
+{
+    size_t info = __atomic_load_n(&chunk->info, __ATOMIC_RELAXED);
+    __atomic_store_n(&chunk->info, (info & ~CHUNK_SIZE_MASK) | size, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Gets the state of a chunk from its info word.
+ *
+ * @param chunk The chunk.
+ * @return The state of the chunk.
+ */
+static inline chunk_state_t get_chunk_state(const chunk_list_t *chunk)
+{
+    return (chunk_state_t)((__atomic_load_n(&chunk->info, __ATOMIC_ACQUIRE) & CHUNK_STATE_MASK) >> CHUNK_STATE_SHIFT);
+}
+
+/**
+ * @brief Sets the state of a chunk which is not in use.
+ * A used chunk may be freed by any thread, its state must go through swap_chunk_state.
+ *
+ * @param chunk The chunk.
+ * @param state The new state.
+ */
+static inline void set_chunk_state(chunk_list_t *chunk, chunk_state_t state)
+{
+    size_t info = __atomic_load_n(&chunk->info, __ATOMIC_RELAXED);
+    __atomic_store_n(&chunk->info, (info & ~CHUNK_STATE_MASK) | ((size_t)state << CHUNK_STATE_SHIFT), __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Changes the state of a chunk only if it is still @expected.
+ * Only one of two threads racing to free the same chunk can win.
+ *
+ * @param chunk The chunk.
+ * @param expected The state the chunk must be in.
+ * @param desired The new state.
+ * @return 1 if the state was changed, 0 otherwise.
+ */
+static inline int swap_chunk_state(chunk_list_t *chunk, chunk_state_t expected, chunk_state_t desired)
+{
+    size_t info = __atomic_load_n(&chunk->info, __ATOMIC_RELAXED);
+    do
+    {
+        if ((info & CHUNK_STATE_MASK) != (size_t)expected << CHUNK_STATE_SHIFT)
+            return 0;
+    } while (!__atomic_compare_exchange_n(&chunk->info, &info, (info & ~CHUNK_STATE_MASK) | ((size_t)desired << CHUNK_STATE_SHIFT), 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    return 1;
+}
+
+/**
+ * @brief Gets the arena owning a chunk from its info word.
+ *
+ * @param chunk The chunk.
+ * @return The arena of the chunk.
+ */
+static inline arena_t *get_chunk_arena(const chunk_list_t *chunk)
+{
+    return &arenas[__atomic_load_n(&chunk->info, __ATOMIC_RELAXED) >> CHUNK_ARENA_SHIFT];
+}
+
+/**
+ * @struct heap_counters_t
+ * @brief Represents the counters of the events which are not tied to an arena.
+ * They are updated with atomic increments, out of the hot paths.
+ */
+typedef struct heap_counters_t
+{
+    size_t mmap_calls;      // Mappings created
+    size_t munmap_calls;    // Mappings removed
+    size_t mremap_calls;    // Chunks with their own mapping resized
+    size_t canary_failures; // Corrupted canaries found on free or realloc
+    size_t poison_failures; // Quarantined blocks written after they were freed
+} heap_counters_t;
+
+/**
+ * @struct arena_stats_t
+ * @brief Represents a snapshot of the counters of an arena.
+ */
+typedef struct arena_stats_t
+{
+    size_t data_size;              // Committed bytes of the data pool
+    size_t free_count;             // Number of free chunks
+    size_t free_size;              // Bytes of the free chunks, canaries included
+    size_t free_counts[BIN_COUNT]; // Number of free chunks per size class
+    size_t free_sizes[BIN_COUNT];  // Bytes of the free chunks per size class, canaries included
+    size_t slabs_size;             // Committed bytes of the slabs
+    size_t slots_size;             // Bytes of the slots in use
+    size_t large_count;            // Number of chunks with their own mapping
+    size_t large_size;             // Bytes mapped for the chunks with their own mapping
+    size_t metadata_size;          // Bytes mapped for the descriptors
+    size_t keep_size;              // Bytes of the free chunk ending the data pool
+} arena_stats_t;
+
+/**
+ * @struct heap_stats_t
+ * @brief Represents a snapshot of the counters of the heap.
+ */
+typedef struct heap_stats_t
+{
+    unsigned int arena_count;          // Number of arenas in use
+    arena_stats_t arenas[ARENA_COUNT]; // Counters of each arena
+    heap_counters_t counters;          // Counters of the whole heap
+} heap_stats_t;
+
+/** @brief Counts an event of the heap. */
+#define COUNT_HEAP_EVENT(counter) __atomic_fetch_add(&heap_counters.counter, 1, __ATOMIC_RELAXED)
+
+/** @brief Option of malloc_info writing JSON instead of XML. */
+#define MALLOC_INFO_JSON 1
+
+/**
+ * @struct scan_cursor_t
+ * @brief Represents the position of a scan of the canaries of the heap.
+ *
+ * The descriptors of each arena are walked in the order of their metadata blocks,
+ * which never move, then the slabs in the order of their addresses.
+ */
+typedef struct scan_cursor_t
+{
+    unsigned int arena;                     // Arena whose descriptors are scanned, arena_count once the slabs are
+    metadata_block_t *block;                // Metadata block being scanned, NULL to start the arena
+    size_t index;                           // Next descriptor of the block
+    size_t slab;                            // Next slab
+    void *reported[SCAN_REPORTED_COUNT];    // Blocks whose corruption was reported the most recently
+    unsigned int reported_next;             // Next entry of reported to replace
+    size_t corrupted;                       // Corrupted blocks found by the current pass
+} scan_cursor_t;
+
+/** @brief Represents the state of a page of the guarded pool. */
+typedef enum
+{
+    GUARD_SLOT_EMPTY, // Never used
+    GUARD_SLOT_USED,
+    GUARD_SLOT_FREED // Protected since its block was freed, until the page is reused
+} guard_slot_state_t;
+
+/**
+ * @struct guard_slot_t
+ * @brief Represents a page of the guarded pool holding a sampled allocation.
+ *
+ * The block ends at the end of the page, right against the next guard page.
+ * The page is only readable and writable while the block is in use.
+ */
+typedef struct guard_slot_t
+{
+    void *data;               // Address of the block
+    size_t size;              // Requested size of the block
+    guard_slot_state_t state; // State of the page
+} guard_slot_t;
+
+/**
+ * @struct chunk_index_slot_t
+ * @brief Represents a slot of the chunk index.
+ *
+ * The chunk index is an open-addressing hash table (linear probing) mapping the
+ * data address of every chunk to its descriptor.
+ */
+typedef struct chunk_index_slot_t
+{
+    void *key;           // Address of chunk data, NULL if empty or CHUNK_INDEX_TOMBSTONE if deleted
+    chunk_list_t *chunk; // Descriptor of the chunk
+} chunk_index_slot_t;
+
+/**
+ * @struct quarantine_entry_t
+ * @brief Represents a freed block held by the quarantine.
+ */
+typedef struct quarantine_entry_t
+{
+    void *data;  // Address of the block
+    size_t size; // Number of poisoned bytes, from the start of the block
+} quarantine_entry_t;
+
+/**
+ * @struct thread_cache_t
+ * @brief Represents the cache of recently freed small chunks of a thread.
+ *
+ * Chunks are binned by exact size and linked through their next_free field.
+ * They keep the CACHED state so the rest of the heap neither merges nor reuses them.
+ * Blocks freed while the quarantine is on are gathered here before they enter it.
+ */
+typedef struct thread_cache_t
+{
+    chunk_list_t *bins[THREAD_CACHE_BIN_COUNT];           // Cached chunks, by size
+    unsigned int counts[THREAD_CACHE_BIN_COUNT];          // Number of chunks in each bin
+    quarantine_entry_t quarantine[QUARANTINE_BATCH_SIZE]; // Freed blocks waiting to enter the quarantine
+    unsigned int quarantine_count;                        // Number of blocks in quarantine
+    int registered;                                       // Set once the thread exit destructor is armed
+} thread_cache_t;
+
 // Heap initialization
 void *init_pool(void *addr, size_t size);
 chunk_list_t *init_heap(void);
+int init_arena(arena_t *arena);
+arena_t *get_thread_arena(void);
+int in_heap_range(const void *ptr);
+
+// Size classes
+unsigned int get_size_class(size_t size);
+int grow_free_bin(arena_t *arena, unsigned int class);
+void insert_free_chunk(chunk_list_t *chunk);
+void remove_free_chunk(chunk_list_t *chunk);
+
+// Chunk index
+int init_chunk_index(void);
+int resize_chunk_index(size_t capacity);
+int index_chunk(chunk_list_t *chunk);
+void unindex_chunk(chunk_list_t *chunk);
+chunk_list_t *get_chunk(void *ptr);
+chunk_list_t *lookup_chunk(void *ptr);
 
 // Chunks
-void merge_consecutive_chunks(void);
-void *allocate_chunk(size_t size);
+int grow_metadata_pool(arena_t *arena);
+chunk_list_t *new_chunk_metadata(arena_t *arena);
+void release_chunk_metadata(chunk_list_t *chunk);
+chunk_list_t *merge_chunk_neighbours(chunk_list_t *chunk);
+chunk_list_t *grow_data_pool(arena_t *arena, size_t size);
 void *split_chunk(chunk_list_t *chunk, size_t size);
-void *get_free_chunk(size_t size);
-chunk_list_t *find_free_chunk(size_t size);
+void trim_chunk(chunk_list_t *chunk, size_t size);
+void *get_free_chunk(arena_t *arena, size_t size, uint8_t **zero_start, uint8_t **zero_end);
+chunk_list_t *find_free_chunk(arena_t *arena, size_t size);
+void *get_aligned_free_chunk(arena_t *arena, size_t size, size_t alignment);
+void release_chunk(chunk_list_t *chunk);
 void clean(void);
 
+// Decay of free pages
+uint32_t get_decay_clock(void);
+size_t purge_arena(arena_t *arena, int force, size_t pad);
+
+// Remote frees
+int push_remote_free(chunk_list_t *chunk);
+void drain_remote_frees(arena_t *arena);
+int in_slab_range(const void *ptr);
+slab_t *get_slab(const void *ptr);
+slab_t *new_slab(arena_t *arena, unsigned int slot_size);
+void *allocate_slot(arena_t *arena, size_t size);
+void free_slot(void *ptr, size_t size);
+void *reallocate_slot(void *ptr, size_t size);
+void *allocate_large_chunk(size_t size, size_t alignment);
+void free_large_chunk(chunk_list_t *chunk);
+void *reallocate_large_chunk(chunk_list_t *chunk, size_t size);
+
+// Per-thread caches
+void *get_cached_chunk(size_t size);
+int put_cached_chunk(chunk_list_t *chunk);
+void flush_thread_cache(void *cache);
+
 // Security features
 void check_memory_leaks(void);
 int set_chunk_canary(chunk_list_t *chunk);
+void check_canary_integrity(chunk_list_t *chunk);
+
+// Heap scanner
+size_t compare_canaries(const canary_t *expected, const canary_t *found, size_t count);
+int scan_heap_batch(scan_cursor_t *cursor);
+size_t scan_heap(scan_cursor_t *cursor);
+int start_heap_scanner(unsigned int budget);
+void stop_heap_scanner(void);
+
+// Guarded allocations
+int init_guard_pool(unsigned int sample);
+int in_guard_range(const void *ptr);
+void *allocate_guarded(size_t size);
+void free_guarded(void *ptr, size_t size);
+size_t get_guarded_size(void *ptr);
+void *reallocate_guarded(void *ptr, size_t size);
+
+// Quarantine
+int init_quarantine(size_t max_size, size_t max_count);
+size_t check_poison(const uint8_t *data, size_t size);
+int quarantine_block(void *ptr, size_t size);
+void flush_quarantine_batch(thread_cache_t *cache);
+void drain_quarantine(void);
+
+// Statistics
+void get_heap_stats(heap_stats_t *stats);
+size_t get_arena_used_size(const arena_stats_t *stats);
 
 // Secure memory allocation
 void my_free(void *ptr);
+void my_free_sized(void *ptr, size_t size);
+void my_free_aligned_sized(void *ptr, size_t alignment, size_t size);
+size_t my_malloc_usable_size(void *ptr);
 void *my_malloc(size_t size);
 void *my_calloc(size_t nmemb, size_t size);
 void *my_realloc(void *ptr, size_t size);
+void *my_memalign(size_t alignment, size_t size);
+int my_posix_memalign(void **memptr, size_t alignment, size_t size);
+void *my_aligned_alloc(size_t alignment, size_t size);
+void *my_valloc(size_t size);
+void *my_pvalloc(size_t size);
+int my_malloc_trim(size_t pad);
+struct mallinfo2 my_mallinfo2(void);
+void my_malloc_stats(void);
+int my_malloc_info(int options, FILE *fp);
 
 #endif
@@ -2,6 +2,7 @@
 #define _UTILS_H
 
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #define LOG_TYPE_INFO "INFO"
@@ -15,16 +16,92 @@
 #define LOG_WARN(format, ...) LOG_GENERAL(LOG_TYPE_WARN, format, __VA_ARGS__)
 #define LOG_ERROR(format, ...) LOG_GENERAL(LOG_TYPE_ERROR, format, __VA_ARGS__)
 
+/** @brief Number of records of the log ring buffer, must be a power of two. */
+#define LOG_RING_RECORDS 4096
+
+/** @brief Size in bytes of a log record, longer messages are truncated. */
+#define LOG_RECORD_SIZE 256
+
+/** @brief Number of records of the trace ring buffer, must be a power of two. */
+#define TRACE_RING_RECORDS 16384
+
+/** @brief Size in bytes of the buffer the records of a ring are written out with. */
+#define RING_BATCH_SIZE (64 * 1024)
+
+/** @brief First bytes of a trace file. */
+#define TRACE_MAGIC "MSMTRACE"
+
+/** @brief Version of the trace format, changed whenever trace_record_t changes. */
+#define TRACE_VERSION 2
+
+/** @brief Number of ChaCha20 blocks generated each time the canary buffer is refilled. */
+#define CANARY_BUFFER_BLOCKS 4
+
+/** @brief Number of 32-bit words in the canary buffer. */
+#define CANARY_BUFFER_WORDS (CANARY_BUFFER_BLOCKS * 16)
+
+/** @brief Number of refills after which the canary generator is reseeded with getrandom(). */
+#define CANARY_RESEED_INTERVAL 16384
+
 /** @brief Represents a canary value. */
 typedef uint32_t canary_t;
 
+/** @brief Represents the operation of a trace record. */
+typedef enum
+{
+    TRACE_MALLOC = 1,
+    TRACE_FREE,   // Size is the one given to free_sized, 0 otherwise
+    TRACE_CALLOC, // Size is nmemb * size, 0 if it overflows
+    TRACE_REALLOC,
+    TRACE_MEMALIGN, // Ptr is the alignment
+    TRACE_DROPPED // Size is the number of records dropped before this one
+} trace_op_t;
+
+/**
+ * @struct trace_header_t
+ * @brief Represents the header of a trace file.
+ */
+typedef struct trace_header_t
+{
+    char magic[8];        // TRACE_MAGIC, without null terminator
+    uint32_t version;     // TRACE_VERSION
+    uint32_t record_size; // Size of a trace_record_t
+} trace_header_t;
+
+/**
+ * @struct trace_record_t
+ * @brief Represents an allocation event of the binary trace.
+ *
+ * Records are fixed-size and written in the byte order of the traced machine.
+ */
+typedef struct trace_record_t
+{
+    uint64_t timestamp; // Monotonic time of the event in nanoseconds
+    uint64_t address;   // Pointer returned by the call, 0 for free
+    uint64_t ptr;       // Pointer given to free and realloc, alignment of memalign, 0 otherwise
+    uint64_t size;      // Requested size
+    uint32_t thread;    // Kernel identifier of the calling thread
+    uint32_t op;        // A trace_op_t
+} trace_record_t;
+
 struct tm *get_current_time(void);
 
 void log_general(const int fd, const char *log_name, const char *format, ...);
+void log_signal_safe(const char *log_name, const char *format, ...);
 int create_log_file(const char *filename);
 void init_logging(void);
+void flush_logging(void);
 void close_logging(void);
+void prepare_fork_logging(void);
+void parent_fork_logging(void);
+void child_fork_logging(void);
+void init_trace(void);
+void trace_event(trace_op_t op, const void *ptr, const void *address, size_t size);
+void close_trace(void);
 
+int get_random_bytes(void *buffer, size_t size);
 canary_t get_random_canary(void);
+canary_t get_keyed_canary(const uint64_t key[2], uint64_t first, uint64_t second);
+void reset_canary_rng(void);
 
 #endif
@@ -3,6 +3,11 @@
 #include <stdarg.h>   // va_list, va_start, va_end
 #include <string.h>   // memset, memcpy
 #include <stdlib.h>   // atexit
+#include <pthread.h>  // pthread_mutex_lock, pthread_key_create, pthread_atfork
+#include <unistd.h>   // sysconf
+#include <time.h>     // clock_gettime
+#include <errno.h>    // errno, EINVAL, ENOMEM
+#include <signal.h>   // sigaction, SIGSEGV
 
 #include "my_secmalloc.private.h"
 
@@ -10,10 +15,59 @@
 
 extern int log_fd; // Defined in utils.c, used for logging
 
-chunk_list_t *cl_metadata_head = NULL;
+pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER; // Protects the initialization and the cleaning of the heap
+int heap_initialized = 0;                              // Set once the arenas and the chunk index are ready
+int exit_handlers_registered = 0;                      // Set once logging and atexit handlers are set up
 
-const size_t metadata_offset = 1e4; // 10 000 pages
-unsigned int metadata_size = 0;
+
+uint8_t *heap_start = NULL;   // Address range reserved for the data pools, sliced between the arenas
+size_t heap_reserve_size = 0; // Size of the reserved range
+size_t slab_reserve_size = 0; // Size of the start of the reserved range given to the slabs
+size_t slab_next = 0;         // Offset of the first slab never committed
+slab_t *slab_headers = NULL;  // Headers of the slabs, indexed by slab address
+uint64_t slot_canary_key[2];  // Secret key the canaries of the slots are derived with
+
+heap_counters_t heap_counters; // Counters of the syscalls and canary failures of the heap
+
+long decay_ms = DECAY_DEFAULT_MS; // Time free pages stay committed, 0 to purge them on free, negative to never purge them
+
+arena_t arenas[ARENA_COUNT]; // Independent heaps, threads are spread over them
+unsigned int arena_count = 0; // Number of arenas in use, at most ARENA_COUNT
+unsigned int next_arena = 0;  // Round-robin counter assigning arenas to threads
+static __thread arena_t *thread_arena __attribute__((tls_model("initial-exec")));
+
+pthread_mutex_t chunk_index_lock = PTHREAD_MUTEX_INITIALIZER; // Serializes the writers of the chunk index
+chunk_index_slot_t *chunk_index_area = NULL;                  // Reserved area holding the two tables of the index
+chunk_index_slot_t *chunk_index = NULL;                       // Data address to descriptor hash table
+size_t chunk_index_capacity = 0;                              // Number of slots, always a power of two
+size_t chunk_index_used = 0;                                  // Number of live and deleted slots
+size_t chunk_index_count = 0;                                 // Number of live slots
+
+pthread_mutex_t scanner_lock = PTHREAD_MUTEX_INITIALIZER; // Protects the state of the heap scanner
+pthread_cond_t scanner_wakeup;                            // Wakes the heap scanner up when it is stopped
+pthread_t scanner_thread;                                 // Thread checking the canaries in the background
+int scanner_running = 0;                                  // Set while the heap scanner runs
+unsigned int scanner_budget = 0;                          // Percentage of a CPU the heap scanner may use
+
+pthread_mutex_t guard_lock = PTHREAD_MUTEX_INITIALIZER; // Protects the slots of the guarded pool
+uint8_t *guard_pool = NULL;                             // Pages of the sampled allocations, each one between two guard pages
+guard_slot_t guard_slots[GUARD_SLOT_COUNT];             // Pages of the guarded pool
+unsigned int guard_next = 0;                            // Next page to try, pages are reused round-robin
+unsigned int guard_sample = 0;                          // One allocation in guard_sample is guarded, 0 to disable sampling
+struct sigaction guard_previous_action;                 // Fault handler replaced by the one of the guarded pool
+static __thread unsigned int guard_counter __attribute__((tls_model("initial-exec")));
+
+pthread_mutex_t quarantine_lock = PTHREAD_MUTEX_INITIALIZER; // Protects the quarantine
+quarantine_entry_t *quarantine_ring = NULL;                   // Quarantined blocks, the oldest at quarantine_head
+size_t quarantine_head = 0;                                   // Position of the oldest block in the ring
+size_t quarantine_count = 0;                                  // Number of blocks in the quarantine
+size_t quarantine_size = 0;                                   // Bytes of the blocks in the quarantine
+size_t quarantine_max_count = 0;                              // Number of blocks the quarantine holds at most, 0 when it is off
+size_t quarantine_max_size = 0;                               // Bytes the quarantine holds at most
+
+static __thread thread_cache_t thread_cache __attribute__((tls_model("initial-exec")));
+pthread_key_t thread_cache_key;                       // Flushes the cache of exiting threads
+pthread_once_t thread_cache_once = PTHREAD_ONCE_INIT; // Creates thread_cache_key once
 
 /**
  * @brief Initializes a memory pool for secure memory allocation.
@@ -41,501 +95,3965 @@ void *init_pool(void *addr, size_t size)
         LOG_ERROR("init_pool - Failed to allocate pool of size %zu", size);
         return NULL;
     }
+    COUNT_HEAP_EVENT(mmap_calls);
 
     return pool;
 }
 
 /**
- * @brief Initializes the heaps for secure memory allocation.
- *
- * Tnitializes two pools of memory by allocating chunks of memory using mmap.
- * It sets their initial state, size, and availability.
- * The metadata heap is used to store metadata about the allocated chunks, while the data heap
- * is used to store the actual data.
- *
- * @return A pointer to the initialized metadata heap.
+ * @brief Creates the key whose destructor flushes the cache of an exiting thread.
  */
-chunk_list_t *init_heap()
+static void create_thread_cache_key(void)
 {
-    // Don't relaunch if already initialized
-    if (cl_metadata_head != NULL)
-        return cl_metadata_head;
+    if (pthread_key_create(&thread_cache_key, flush_thread_cache) != 0)
+        LOG_ERROR("create_thread_cache_key - can't create thread cache key");
+}
+
+/**
+ * @brief Takes every lock of the heap before the process forks, so that the child gets
+ * the heap between two operations. Locks are taken in the order the allocator nests them.
+ */
+static void prepare_fork(void)
+{
+    pthread_mutex_lock(&scanner_lock);
+    pthread_mutex_lock(&heap_lock);
+    pthread_mutex_lock(&guard_lock);
+    for (unsigned int i = 0; i < arena_count; i++)
+        pthread_mutex_lock(&arenas[i].lock);
+    pthread_mutex_lock(&chunk_index_lock);
+    pthread_mutex_lock(&quarantine_lock);
 
-    // Initialize logging
-    init_logging();
-    atexit(close_logging);
-    atexit(check_memory_leaks);
-    atexit(clean);
+    prepare_fork_logging();
+}
 
-    LOG_INFO("init_heap - Initializing pools of memory");
+/**
+ * @brief Releases the locks taken by prepare_fork in the parent once the process forked.
+ */
+static void parent_fork(void)
+{
+    parent_fork_logging();
 
-    // Allocate our metadata pool
-    size_t meta_size = sizeof(chunk_list_t) * metadata_offset;
-    void *ptr = init_pool(NULL, meta_size);
-    if (ptr == NULL)
-    {
-        LOG_ERROR("init_heap - Failed to allocate metadata pool");
-        munmap(NULL, meta_size);
-        return NULL;
-    }
+    pthread_mutex_unlock(&quarantine_lock);
+    pthread_mutex_unlock(&chunk_index_lock);
+    for (unsigned int i = arena_count; i > 0; i--)
+        pthread_mutex_unlock(&arenas[i - 1].lock);
+    pthread_mutex_unlock(&guard_lock);
+    pthread_mutex_unlock(&heap_lock);
+    pthread_mutex_unlock(&scanner_lock);
+}
 
-    // Allocate a page for our data pool
-    void *data_pool = (chunk_list_t *)((chunk_list_t *)ptr + (sizeof(chunk_list_t) * metadata_offset));
-    void *ptr_data = init_pool(data_pool, PAGE_SIZE);
-    if (ptr_data == NULL)
-    {
-        LOG_ERROR("init_heap - Failed to allocate data pool");
-        munmap(ptr, meta_size);
-        return NULL;
-    }
+/**
+ * @brief Releases the locks taken by prepare_fork in the child once the process forked.
+ * Only the forking thread is copied: the heap scanner is stopped in the child, its canary
+ * generator is reseeded, and the chunks cached by the other threads stay out of use.
+ * Everything else is used as it was in the parent.
+ */
+static void child_fork(void)
+{
+    child_fork_logging();
 
-    // Set our global variables to our newly created pool
-    chunk_list_t *cl_metadata = (chunk_list_t *)ptr;
-    metadata_size++;
-    cl_metadata->data = ptr_data;
-    cl_metadata->size = PAGE_SIZE - sizeof(canary_t);
-    cl_metadata->state = FREE;
-    cl_metadata->next = NULL;
-    set_chunk_canary(cl_metadata);
+    // The child must not draw the canaries its parent will draw
+    reset_canary_rng();
 
-    cl_metadata_head = cl_metadata;
+    scanner_running = 0;
 
-    return ptr;
+    pthread_mutex_unlock(&quarantine_lock);
+    pthread_mutex_unlock(&chunk_index_lock);
+    for (unsigned int i = arena_count; i > 0; i--)
+        pthread_mutex_unlock(&arenas[i - 1].lock);
+    pthread_mutex_unlock(&guard_lock);
+    pthread_mutex_unlock(&heap_lock);
+    pthread_mutex_unlock(&scanner_lock);
 }
 
 /**
- * @brief Finds the first free chunk containg at least @size in the metadata list.
+ * @brief Reserves the address range of the data pools without committing it.
+ * The start of the range holds the slabs, the rest is sliced between the arenas.
+ * The reservation is halved until it fits the address space limit, down to HEAP_RESERVE_MIN_SIZE.
  *
- * @param size The size of the chunk to find.
- * @return A pointer to the last chunk in the metadata list or NULL if no free chunk is found.
+ * @return 0 on success, -1 if no range can be reserved.
  */
-chunk_list_t *find_free_chunk(size_t size)
+static int reserve_heap(void)
 {
-    chunk_list_t *current = cl_metadata_head;
-    while (current != NULL)
+    for (size_t size = HEAP_RESERVE_SIZE; size >= HEAP_RESERVE_MIN_SIZE; size /= 2)
     {
-        if (current->state == FREE && current->size >= size + sizeof(canary_t))
+        void *range = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+        if (range == MAP_FAILED)
+            continue;
+        COUNT_HEAP_EVENT(mmap_calls);
+
+        // Slab headers are only backed by memory once they are written
+        size_t slab_size = size >> SLAB_RESERVE_SHIFT;
+        void *headers = mmap(NULL, (slab_size >> SLAB_SHIFT) * sizeof(slab_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+        if (headers == MAP_FAILED)
         {
-            LOG_INFO("find_free_chunk - Found free chunk of size %zu at address %p", size, current->data);
-            return current;
+            munmap(range, size);
+            COUNT_HEAP_EVENT(munmap_calls);
+            continue;
         }
-        current = current->next;
+        COUNT_HEAP_EVENT(mmap_calls);
+
+        slab_headers = headers;
+        slab_reserve_size = slab_size;
+        slab_next = 0;
+        heap_reserve_size = size;
+        __atomic_store_n(&heap_start, (uint8_t *)range, __ATOMIC_RELEASE);
+        return 0;
     }
 
-    return NULL;
+    return -1;
 }
 
 /**
- * @brief Allocates a new chunk of memory with the specified size.
- * This function is used when no free block is found in the memory pool.
+ * @brief Initializes the heaps for secure memory allocation.
  *
- * @param size The size of the memory block to allocate.
- * @return A pointer to the allocated memory block.
+ * Sets up logging, the chunk index and the arenas, then initializes the arena
+ * of the calling thread.
+ *
+ * @return A pointer to the first chunk of the arena of the calling thread.
  */
-void *allocate_chunk(size_t size)
+chunk_list_t *init_heap()
 {
-    LOG_INFO("allocate_chunk - Allocating chunk of size %zu", size);
+    long scan_budget = 0;
 
-    // Create a new metadata entry at the end of the list
-    chunk_list_t *new_metadata = (chunk_list_t *)(cl_metadata_head + (sizeof(chunk_list_t) * metadata_size++));
+    pthread_mutex_lock(&heap_lock);
 
-    // Allocate a new chunk of memory
-    void *data = init_pool(cl_metadata_head + (sizeof(chunk_list_t) * metadata_offset), size + sizeof(canary_t));
-    new_metadata->data = (uint8_t *)(data);
-    new_metadata->size = size;
-    new_metadata->state = USED;
-    new_metadata->next = NULL;
-    set_chunk_canary(new_metadata);
+    if (!exit_handlers_registered)
+    {
+        // Initialize logging
+        init_logging();
+        atexit(close_logging);
+#ifdef DYNAMIC
+        // Only the calls of the application are traced, they all go through the wrappers and my_realloc
+        init_trace();
+        atexit(close_trace);
+#endif
+        atexit(check_memory_leaks);
+#ifndef DYNAMIC
+        // When preloaded, the dynamic linker still reads memory it allocated after the atexit handlers
+        atexit(clean);
+#endif
+        // Quarantined blocks are checked before the heap is checked and cleaned
+        atexit(drain_quarantine);
+        // Registered last, so the scanner stops before the heap is checked and cleaned
+        atexit(stop_heap_scanner);
+        // A child forked in the middle of an operation must not inherit a held lock
+        pthread_atfork(prepare_fork, parent_fork, child_fork);
+        exit_handlers_registered = 1;
+    }
 
-    // Split the remaining free space into a new chunk
-    // if the size of the allocated block is not a multiple of the page size
-    if (size + sizeof(canary_t) % PAGE_SIZE != 0)
+    // Don't relaunch if already initialized
+    if (!heap_initialized)
     {
-        chunk_list_t *empty_next = (chunk_list_t *)(cl_metadata_head + (sizeof(chunk_list_t) * metadata_size++));
-        empty_next->data = (uint8_t *)(data) + size + sizeof(canary_t); // + sizeof(canary_t) to avoid canary overwrite
-        empty_next->size = PAGE_SIZE - (((size + sizeof(canary_t)) % PAGE_SIZE) + sizeof(canary_t));
-        empty_next->state = FREE;
-        empty_next->next = NULL;
-        set_chunk_canary(empty_next);
+        LOG_INFO("init_heap - Initializing pools of memory");
+
+        pthread_once(&thread_cache_once, create_thread_cache_key);
+
+        // Allocate the index of our chunks
+        if (init_chunk_index() == -1)
+        {
+            pthread_mutex_unlock(&heap_lock);
+            LOG_ERROR("init_heap - Failed to allocate chunk index");
+            return NULL;
+        }
+
+        // One arena per CPU unless MSM_ARENAS says otherwise, their pools are allocated on first use
+        const char *env_arenas = getenv("MSM_ARENAS");
+        long count = env_arenas != NULL ? strtol(env_arenas, NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+        arena_count = (count < 1) ? 1 : (count > ARENA_COUNT ? ARENA_COUNT : (unsigned int)count);
+
+        // Free pages are given back to the system once they have been free for MSM_DECAY_MS milliseconds
+        const char *env_decay = getenv("MSM_DECAY_MS");
+        decay_ms = env_decay != NULL ? strtol(env_decay, NULL, 10) : DECAY_DEFAULT_MS;
+
+        // Canaries are checked in the background when MSM_SCAN_BUDGET gives a percentage of a CPU
+        const char *env_scan = getenv("MSM_SCAN_BUDGET");
+        scan_budget = env_scan != NULL ? strtol(env_scan, NULL, 10) : 0;
+
+        // One allocation in MSM_GUARD_SAMPLE gets its own page, right before a guard page
+        const char *env_guard = getenv("MSM_GUARD_SAMPLE");
+        long guard = env_guard != NULL ? strtol(env_guard, NULL, 10) : 0;
+        if (guard > 0 && init_guard_pool(guard > UINT32_MAX ? UINT32_MAX : (unsigned int)guard) == -1)
+            LOG_ERROR("init_heap - Failed to reserve the guarded pool");
+
+        // Freed blocks are held back when MSM_QUARANTINE_SIZE gives the bytes the quarantine may hold
+        const char *env_quarantine_size = getenv("MSM_QUARANTINE_SIZE");
+        const char *env_quarantine_count = getenv("MSM_QUARANTINE_COUNT");
+        long quarantine_bytes = env_quarantine_size != NULL ? strtol(env_quarantine_size, NULL, 10) : 0;
+        long quarantine_blocks = env_quarantine_count != NULL ? strtol(env_quarantine_count, NULL, 10) : QUARANTINE_DEFAULT_COUNT;
+        if (quarantine_bytes > 0 && quarantine_blocks > 0 && init_quarantine(quarantine_bytes, quarantine_blocks) == -1)
+            LOG_ERROR("init_heap - Failed to map the quarantine");
+
+        for (unsigned int i = 0; i < arena_count; i++)
+        {
+            memset(&arenas[i], 0, sizeof(arena_t));
+            pthread_mutex_init(&arenas[i].lock, NULL);
+        }
+
+        // Slots of the heap keep their canaries in a forked child, the key is only drawn here
+        if (get_random_bytes(slot_canary_key, sizeof(slot_canary_key)) == -1)
+            LOG_ERROR("init_heap - Failed to draw the key of the slot canaries");
+
+        // Reserve the address range of the data pools, nothing is committed until an arena grows
+        if (reserve_heap() == -1)
+        {
+            pthread_mutex_unlock(&heap_lock);
+            LOG_ERROR("init_heap - Failed to reserve the data pools");
+            return NULL;
+        }
 
-        new_metadata->next = empty_next;
+        __atomic_store_n(&heap_initialized, 1, __ATOMIC_RELEASE);
     }
 
-    // Append the new metadata entry to the end of the list
-    chunk_list_t *current = cl_metadata_head;
-    while (current->next != NULL)
-        current = current->next;
-    current->next = new_metadata;
+    pthread_mutex_unlock(&heap_lock);
+
+    // Creating a thread allocates, the heap must be ready and unlocked
+    if (scan_budget > 0)
+        start_heap_scanner(scan_budget > 100 ? 100 : (unsigned int)scan_budget);
+
+    arena_t *arena = get_thread_arena();
 
-    return new_metadata->data;
+    pthread_mutex_lock(&arena->lock);
+    if (arena->head == NULL && init_arena(arena) == -1)
+    {
+        pthread_mutex_unlock(&arena->lock);
+        return NULL;
+    }
+    chunk_list_t *head = arena->head;
+    pthread_mutex_unlock(&arena->lock);
+
+    return head;
 }
 
 /**
- * Split a chunk into two chunks, one for the allocated data and one for the remaining free space.
- * This function is used when the allocated block is empty.
+ * @brief Returns the arena of the calling thread.
+ * Threads are assigned an arena round-robin the first time they need one.
+ * The heap must be initialized.
  *
- * @param chunk A pointer to the metadata of the free block.
- * @param size The size of the memory block to allocate.
- * @return A pointer to the allocated memory block.
+ * @return A pointer to the arena of the calling thread.
  */
-void *split_chunk(chunk_list_t *chunk, size_t size)
+arena_t *get_thread_arena()
 {
-    // If the size is too large, we can't split the chunk, so we use it directly
-    if (chunk->size + (sizeof(canary_t) * 2) <= size)
-    {
-        LOG_INFO("split_chunk - chunk size is smaller than the requested size");
-        chunk->state = USED;
-        return chunk->data;
-    }
+    if (thread_arena == NULL)
+        thread_arena = &arenas[__atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED) % arena_count];
 
-    // If the size of the free chunk is exactly the same as the requested size, we can use it directly
-    chunk_list_t *empty = (chunk_list_t *)(cl_metadata_head + (sizeof(chunk_list_t) * metadata_size++));
-    empty->data = (uint8_t *)(chunk->data) + size + sizeof(canary_t); // + sizeof(canary_t) to avoid precedent canary overwrite
-    empty->size = chunk->size - (size + sizeof(canary_t));
-    empty->state = FREE;
-    empty->next = chunk->next;
-    set_chunk_canary(empty);
+    return thread_arena;
+}
 
-    // Update the metadata of the free chunk
-    chunk->size = size;
-    chunk->state = USED;
-    chunk->next = empty;
-    set_chunk_canary(chunk);
+/**
+ * @brief Tells whether an address is in the range reserved for the data pools.
+ * Every chunk of the arenas is in this range, so anything else can be rejected
+ * without looking at the chunk index.
+ *
+ * @param ptr The address to check.
+ * @return 1 if the address is in the reserved range, 0 otherwise.
+ */
+int in_heap_range(const void *ptr)
+{
+    const uint8_t *start = __atomic_load_n(&heap_start, __ATOMIC_ACQUIRE);
 
-    return chunk->data;
+    return start != NULL && (const uint8_t *)ptr >= start && (const uint8_t *)ptr < start + heap_reserve_size;
 }
 
 /**
- * @brief Allocates a chunk of memory with the specified size.
+ * @brief Initializes the pools of an arena.
  *
- * @param size The size of the chunk to allocate.
- * @return A pointer to the allocated chunk, or NULL if allocation fails.
+ * The metadata pool is used to store metadata about the allocated chunks, while the data pool
+ * is used to store the actual data. The data pool of an arena is its slice of the reserved
+ * range, its first extent is committed here.
+ * The arena lock must be held.
+ *
+ * @param arena The arena to initialize.
+ * @return 0 on success, -1 if a pool can't be allocated.
  */
-void *get_free_chunk(size_t size)
+int init_arena(arena_t *arena)
 {
-    size = (size % 16 ? size + 16 - (size % 16) : size); // Align the size to 16 bytes
-
-    LOG_INFO("get_free_chunk - Allocating chunk of size %zu", size);
+    // Allocate the first block of our metadata pool
+    if (arena->metadata == NULL && grow_metadata_pool(arena) == -1)
+    {
+        LOG_ERROR("init_arena - Failed to allocate metadata pool");
+        return -1;
+    }
 
-    void *data = NULL;
-    chunk_list_t *free_chunk = find_free_chunk(size);
+    // Take our slice of the reserved range, after the slabs
+    size_t slice_size = ((heap_reserve_size - slab_reserve_size) / arena_count) & ~((size_t)PAGE_SIZE - 1);
+    arena->data_start = heap_start + slab_reserve_size + (size_t)(arena - arenas) * slice_size;
+    arena->data_end = arena->data_start;
+    arena->data_limit = arena->data_start + slice_size;
+    arena->extent_size = DATA_EXTENT_MIN_SIZE;
 
-    if (free_chunk == NULL)
-        // If no free chunk is found, we need to allocate a new chunk
-        data = allocate_chunk(size);
-    else
-        // Divide the free chunk into two chunks, one for the allocated data and one for the remaining free space
-        data = split_chunk(free_chunk, size);
+    // Commit the first extent of our data pool
+    if (grow_data_pool(arena, 0) == NULL)
+    {
+        LOG_ERROR("init_arena - Failed to allocate data pool");
+        return -1;
+    }
 
-    return data;
+    return 0;
 }
 
 /**
- * @brief Merges consecutive free memory chunks in the memory pool.
- * This function iterates through the memory chunks and merges any adjacent chunks that are both free.
- * It updates the size of the current chunk by adding the size of the next chunk and
- * removes the next chunk from the linked list.
- * This process continues until there are no more adjacent free chunks to merge.
+ * @brief Maps a new block of descriptors for the metadata pool of an arena.
+ * Each block is twice as big as the previous one, up to METADATA_BLOCK_MAX_SIZE.
+ * Blocks are chained rather than remapped so that descriptors never move.
+ * The arena lock must be held.
+ *
+ * @param arena The arena whose metadata pool grows.
+ * @return 0 on success, -1 if the block can't be allocated.
  */
-void merge_consecutive_chunks()
+int grow_metadata_pool(arena_t *arena)
 {
-    chunk_list_t *current = cl_metadata_head;
-    while (current != NULL)
+    size_t size = arena->metadata == NULL ? METADATA_BLOCK_INITIAL_SIZE : arena->metadata->size * 2;
+    if (size > METADATA_BLOCK_MAX_SIZE)
+        size = METADATA_BLOCK_MAX_SIZE;
+
+    metadata_block_t *block = init_pool(NULL, size);
+    if (block == NULL)
     {
-        // Current chunk is free, not null and its next chunk is free
-        // Ensure the next chunk is on the same page
-        chunk_list_t *tmp = current;
-        size_t size = tmp->size;
+        LOG_ERROR("grow_metadata_pool - Failed to allocate metadata block of size %zu", size);
+        return -1;
+    }
 
-        // Merge consecutive free chunks
-        while (tmp->state == FREE && tmp->next != NULL && tmp->next->state == FREE && (uint8_t *)tmp->data + tmp->size + sizeof(canary_t) == tmp->next->data)
-        {
-            size += tmp->next->size + sizeof(canary_t);
-            tmp->canary = tmp->next->canary;
-            tmp = tmp->next;
-        }
+    block->next = arena->metadata;
+    block->size = size;
+    block->capacity = (size - sizeof(metadata_block_t)) / sizeof(chunk_list_t);
 
-        // Update the current chunk
-        current->next = tmp->next;
-        current->size = size;
-        current->canary = tmp->canary;
+    arena->metadata = block;
+    arena->metadata_size = 0;
 
-        current = current->next;
-    }
+    return 0;
 }
 
 /**
- * @brief Retrieves the metadata structure associated with a given pointer.
+ * @brief Gets a new descriptor from the metadata pool of an arena.
+ * Descriptors released by merges are reused first, then the newest block is bumped
+ * and a new block is mapped when it is full.
+ * The arena lock must be held.
  *
- * @param ptr The pointer whose metadata structure needs to be retrieved.
- * @return A pointer to the metadata structure if found, otherwise NULL.
+ * @param arena The arena the descriptor belongs to.
+ * @return A pointer to the new descriptor, or NULL if the metadata pool can't grow.
  */
-chunk_list_t *get_chunk(void *ptr)
+chunk_list_t *new_chunk_metadata(arena_t *arena)
 {
-    chunk_list_t *current = cl_metadata_head;
-    while (current != NULL)
+    chunk_list_t *chunk = arena->free_metadata;
+
+    if (chunk != NULL)
+        arena->free_metadata = chunk->next_free;
+    else
     {
-        if (current->data == ptr)
-            return current;
+        if ((arena->metadata == NULL || arena->metadata_size >= arena->metadata->capacity) && grow_metadata_pool(arena) == -1)
+            return NULL;
 
-        current = current->next;
+        chunk = &arena->metadata->chunks[arena->metadata_size++];
     }
 
-    return NULL;
+    memset(chunk, 0, sizeof(chunk_list_t));
+    chunk->info = (size_t)(arena - arenas) << CHUNK_ARENA_SHIFT;
+    chunk->bin_slot = FREE_BIN_NONE;
+
+    return chunk;
 }
 
 /**
- * @brief Set a random canary value to a chunk.
- * The canary value is used to detect heap overflows, it is placed at the end of the data block.
- * Is it a random value to make it harder to predict.
+ * @brief Gives the descriptor of a chunk that disappeared back to the metadata pool of its arena.
+ * The chunk must already be out of the list, the free lists and the index.
+ * The arena lock must be held.
  *
- * @return 0 if the canary was set, -1 otherwise.
+ * @param chunk The descriptor to release.
  */
-int set_chunk_canary(chunk_list_t *chunk)
+void release_chunk_metadata(chunk_list_t *chunk)
 {
-    if (chunk == NULL)
-        return -1;
-
-    canary_t canary = get_random_canary();
-    if (canary == 0)
-    {
-        LOG_ERROR("set_chunk_canary - can't get a canary");
-        return -1;
-    }
-
-    chunk->canary = canary;
+    arena_t *arena = get_chunk_arena(chunk);
 
-    memcpy(
-        (uint8_t *)(chunk->data) + chunk->size,
-        &chunk->canary,
-        sizeof(canary_t));
+    // A lookup racing with an invalid free must not match a released descriptor
+    __atomic_store_n(&chunk->data, NULL, __ATOMIC_RELAXED);
+    chunk->next = NULL;
+    chunk->prev = NULL;
 
-    return 0;
+    chunk->next_free = arena->free_metadata;
+    arena->free_metadata = chunk;
 }
 
 /**
- * @brief Check the integrity of the canary value of a chunk.
- * The canary value is used to detect heap overflows, it is placed at the end of the data block.
+ * @brief Computes the size class of a chunk.
+ * Sizes are split in powers of two, each of them divided in BIN_SUBDIVISIONS sub-bins.
+ * Class 0 holds chunks smaller than 2^BIN_MIN_SHIFT bytes and the last class holds every
+ * chunk too big for the others.
  *
- * @param chunk The chunk to check the canary value.
+ * @param size The size of the chunk.
+ * @return The index of the free list matching this size.
  */
-void check_canary_integrity(chunk_list_t *chunk)
+unsigned int get_size_class(size_t size)
 {
-    canary_t canary = 0;
-    memcpy(
-        &canary,
-        (uint8_t *)(chunk->data) + chunk->size,
-        sizeof(canary_t));
+    if (size < ((size_t)1 << BIN_MIN_SHIFT))
+        return 0;
 
-    if (canary != chunk->canary)
-        LOG_ERROR("check_canary_integrity - canary corrupted");
+    unsigned int msb = (sizeof(size_t) * 8 - 1) - __builtin_clzl(size);
+    unsigned int sub = (size >> (msb - BIN_SUBDIVISION_BITS)) & (BIN_SUBDIVISIONS - 1);
+    unsigned int class = 1 + (msb - BIN_MIN_SHIFT) * BIN_SUBDIVISIONS + sub;
 
-    return;
+    return class < BIN_COUNT ? class : BIN_COUNT - 1;
 }
 
 /**
- * @brief Frees a previously allocated memory block.
- *
- * This function marks the memory block pointed to by `ptr` as free. If the block is already free,
- * an error message is logged. After marking the block as free, the function may perform block merging
- * to optimize memory usage.
+ * @brief Maps the arrays of a bin, or doubles their capacity with mremap once they are full.
+ * The kernel moves their pages, so a bin never has to be copied.
  *
- * @param ptr A pointer to the memory block to be freed.
+ * @param arena The arena of the bin.
+ * @param class The size class of the bin.
+ * @return 0 on success, -1 if the arrays can't be mapped.
  */
-void my_free(void *ptr)
+int grow_free_bin(arena_t *arena, unsigned int class)
 {
-    if (ptr == NULL)
+    uint32_t capacity = arena->free_capacities[class];
+    if (capacity > UINT32_MAX / 2)
     {
-        LOG_WARN("my_free - null pointer given");
-        return;
+        LOG_ERROR("grow_free_bin - bin %u can't hold more chunks", class);
+        return -1;
     }
 
-    chunk_list_t *chunk = get_chunk(ptr);
-    if (chunk == NULL)
-    {
-        LOG_WARN("my_free - chunk not found");
-        return;
-    }
+    uint32_t new_capacity = capacity == 0 ? FREE_BIN_MIN_CAPACITY : capacity * 2;
+    void *sizes;
+    void *chunks;
 
-    // Check double free
-    if (chunk->state == FREE)
+    if (capacity == 0)
     {
-        LOG_WARN("my_free - double free");
-        return;
+        sizes = mmap(NULL, new_capacity * sizeof(uint32_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+        if (sizes == MAP_FAILED)
+        {
+            LOG_ERROR("grow_free_bin - Failed to map the sizes of bin %u", class);
+            return -1;
+        }
+        COUNT_HEAP_EVENT(mmap_calls);
+
+        chunks = mmap(NULL, new_capacity * sizeof(chunk_list_t *), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+        if (chunks == MAP_FAILED)
+        {
+            LOG_ERROR("grow_free_bin - Failed to map the chunks of bin %u", class);
+            munmap(sizes, new_capacity * sizeof(uint32_t));
+            COUNT_HEAP_EVENT(munmap_calls);
+            return -1;
+        }
+        COUNT_HEAP_EVENT(mmap_calls);
     }
+    else
+    {
+        sizes = mremap(arena->free_sizes[class], capacity * sizeof(uint32_t), new_capacity * sizeof(uint32_t), MREMAP_MAYMOVE);
+        if (sizes == MAP_FAILED)
+        {
+            LOG_ERROR("grow_free_bin - Failed to grow the sizes of bin %u", class);
+            return -1;
+        }
+        COUNT_HEAP_EVENT(mremap_calls);
 
-    // Check canary integrity
-    check_canary_integrity(chunk);
+        chunks = mremap(arena->free_chunks[class], capacity * sizeof(chunk_list_t *), new_capacity * sizeof(chunk_list_t *), MREMAP_MAYMOVE);
+        if (chunks == MAP_FAILED)
+        {
+            LOG_ERROR("grow_free_bin - Failed to grow the chunks of bin %u", class);
+            // Shrinking in place can't fail, the sizes get back the capacity of the chunks
+            arena->free_sizes[class] = mremap(sizes, new_capacity * sizeof(uint32_t), capacity * sizeof(uint32_t), 0);
+            return -1;
+        }
+        COUNT_HEAP_EVENT(mremap_calls);
+    }
 
-    // Free the chunk
-    if (chunk->state == USED)
-        chunk->state = FREE;
+    arena->free_sizes[class] = sizes;
+    arena->free_chunks[class] = chunks;
+    arena->free_capacities[class] = new_capacity;
 
-    merge_consecutive_chunks();
+    return 0;
 }
 
 /**
- * @brief Allocates a block of memory of the given size using a secure memory allocation mechanism.
+ * @brief Appends a free chunk to the bin of its size class.
+ * Its size is copied to the dense array searched by find_free_chunk.
  *
- * @param size The size of the memory block to allocate.
- * @return A pointer to the allocated memory block, or NULL if the
- * allocation fails.
+ * @param chunk The free chunk to insert.
  */
-void *my_malloc(size_t size)
+void insert_free_chunk(chunk_list_t *chunk)
 {
-    // If the metadata pointer is NULL, we must initialize our heap
-    if (cl_metadata_head == NULL)
-    {
-        void *ptr = init_heap();
-        if (ptr == NULL)
-        {
-            LOG_ERROR("my_malloc - can't initialize heap");
-            return NULL;
-        }
-    }
-
-    // Check if the size is less than or equal to 0
-    if (size <= 0)
-        return NULL; // FIXME: should return a freeable chunk
+    arena_t *arena = get_chunk_arena(chunk);
+    size_t size = get_chunk_size(chunk);
+    unsigned int class = get_size_class(size);
 
-    // Allocate data block
-    void *ptr_data = get_free_chunk(size);
-    if (ptr_data == NULL)
+    uint32_t slot = arena->free_counts[class];
+    if (slot == arena->free_capacities[class] && grow_free_bin(arena, class) == -1)
     {
-        LOG_ERROR("my_malloc - can't allocate chunk of size %zu", size);
-        return NULL;
+        // Out of memory: the chunk will only be reused once it is merged with a neighbour
+        chunk->bin_slot = FREE_BIN_NONE;
+        return;
     }
 
-    return ptr_data;
+    arena->free_sizes[class][slot] = size > UINT32_MAX ? UINT32_MAX : (uint32_t)size;
+    arena->free_chunks[class][slot] = chunk;
+    arena->free_counts[class] = slot + 1;
+    arena->free_bins_map |= (uint64_t)1 << class;
+
+    chunk->bin_slot = slot;
 }
 
 /**
- * @brief Reallocates a memory block with a new size.
+ * @brief Removes a chunk from the bin of its size class.
+ * The last chunk of the bin takes its slot.
+ * Must be called before the size of a free chunk changes or before it gets used.
  *
- * @param ptr   Pointer to the memory block to be reallocated.
- * @param size  New size for the memory block.
- * @return      Pointer to the reallocated memory block, or NULL if the reallocation failed.
+ * @param chunk The free chunk to remove.
  */
-void *my_realloc(void *ptr, size_t size)
+void remove_free_chunk(chunk_list_t *chunk)
 {
-    // If size is 0, equals to my_free(ptr) and returning NULL
-    if (size == 0)
-    {
-        LOG_INFO("my_realloc - null size given, freeing chunk at %p", ptr);
+    if (chunk->bin_slot == FREE_BIN_NONE)
+        return;
 
-        my_free(ptr);
-        return NULL;
-    }
+    arena_t *arena = get_chunk_arena(chunk);
+    unsigned int class = get_size_class(get_chunk_size(chunk));
+    uint32_t *sizes = arena->free_sizes[class];
+    chunk_list_t **chunks = arena->free_chunks[class];
 
-    // If ptr is NULL, equals to my_malloc(size)
-    if (ptr == NULL)
+    uint32_t last = --arena->free_counts[class];
+    if (chunk->bin_slot != last)
     {
-        LOG_INFO("my_realloc - null pointer given, allocating a new chunk");
-        return my_malloc(size);
+        chunk_list_t *moved = chunks[last];
+        sizes[chunk->bin_slot] = sizes[last];
+        chunks[chunk->bin_slot] = moved;
+        moved->bin_slot = chunk->bin_slot;
     }
 
-    // Retrieve the associated chunk from its address
-    chunk_list_t *chunk = get_chunk(ptr);
+    if (last == 0)
+        arena->free_bins_map &= ~((uint64_t)1 << class);
 
-    // If the chunk is not found, return NULL
-    if (chunk == NULL)
-        return NULL;
+    chunk->bin_slot = FREE_BIN_NONE;
+}
 
-    // If the current size of the memory block is already greater or equal to the new size,
-    // return the original pointer
-    if (chunk->size >= size)
-        return ptr;
+/**
+ * @brief Hashes a chunk data address to a slot of the chunk index.
+ *
+ * @param ptr The data address.
+ * @param capacity The number of slots of the table, a power of two.
+ * @return The first slot to probe for this address.
+ */
+static size_t hash_chunk_address(const void *ptr, size_t capacity)
+{
+    // Fibonacci hashing, chunk addresses are at least 4 bytes aligned
+    return (size_t)(((uintptr_t)ptr >> 2) * 0x9E3779B97F4A7C15ULL) & (capacity - 1);
+}
+
+/**
+ * @brief Reserves the area of the chunk index and sets up an empty table.
+ * The area holds two tables of CHUNK_INDEX_MAX_CAPACITY slots: the index is rehashed
+ * from one to the other, so a table never gets unmapped under a lock-free reader.
+ * Pages are only backed by memory once written.
+ *
+ * @return 0 on success, -1 if the area can't be reserved.
+ */
+int init_chunk_index()
+{
+    void *area = mmap(
+        NULL,
+        2 * CHUNK_INDEX_MAX_CAPACITY * sizeof(chunk_index_slot_t),
+        PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANON | MAP_NORESERVE,
+        -1,
+        0);
 
-    // Check if the next chunk is free and has enough space to fit the new size
-    if (chunk->next != NULL && chunk->next->state == FREE && chunk->size + chunk->next->size >= size)
+    if (area == MAP_FAILED)
     {
-        // Merge the two chunks
-        chunk->size += chunk->next->size;
-        chunk->next = chunk->next->next;
-        chunk->state = USED;
+        LOG_ERROR("init_chunk_index - Failed to reserve chunk index");
+        return -1;
+    }
+    COUNT_HEAP_EVENT(mmap_calls);
 
-        set_chunk_canary(chunk);
+    chunk_index_area = area;
+    chunk_index_capacity = CHUNK_INDEX_INITIAL_CAPACITY;
+    chunk_index_used = 0;
+    chunk_index_count = 0;
+    __atomic_store_n(&chunk_index, chunk_index_area, __ATOMIC_RELEASE);
 
-        // If the merged chunk is still smaller than the new size, split it
-        if (chunk->size < size)
-        {
-            chunk_list_t *empty_next = (chunk_list_t *)(cl_metadata_head + (sizeof(chunk_list_t) * metadata_size++));
-            empty_next->data = (uint8_t *)(chunk->data) + size + sizeof(canary_t); // + sizeof(canary_t) to avoid canary overwrite
-            empty_next->size = chunk->size - size;
-            empty_next->state = FREE;
-            empty_next->next = chunk->next;
-            set_chunk_canary(empty_next);
-
-            chunk->size = size;
-            chunk->next = empty_next;
-            chunk->state = USED;
+    return 0;
+}
+
+/**
+ * @brief Rehashes the live entries of the chunk index in the other half of its area.
+ * Tombstones are dropped in the process. The previous table is then released with
+ * MADV_DONTNEED: readers still probing it see empty slots and fall back to a locked lookup.
+ * The chunk index lock must be held.
+ *
+ * @param capacity The new number of slots, must be a power of two.
+ * @return 0 on success, -1 if the capacity is too big.
+ */
+int resize_chunk_index(size_t capacity)
+{
+    if (capacity > CHUNK_INDEX_MAX_CAPACITY)
+        return -1;
+
+    chunk_index_slot_t *old_index = chunk_index;
+    size_t old_capacity = chunk_index_capacity;
+
+    // The other half is zeroed: either never written or released on the previous resize
+    chunk_index_slot_t *new_index = chunk_index_area;
+    if (old_index == chunk_index_area)
+        new_index += CHUNK_INDEX_MAX_CAPACITY;
+
+    size_t count = 0;
+    for (size_t i = 0; i < old_capacity; i++)
+    {
+        if (old_index[i].key == NULL || old_index[i].key == CHUNK_INDEX_TOMBSTONE)
+            continue;
+
+        size_t slot = hash_chunk_address(old_index[i].key, capacity);
+        while (new_index[slot].key != NULL)
+            slot = (slot + 1) & (capacity - 1);
+
+        // A slow reader may still probe this half from before the previous resize
+        __atomic_store_n(&new_index[slot].chunk, old_index[i].chunk, __ATOMIC_RELAXED);
+        __atomic_store_n(&new_index[slot].key, old_index[i].key, __ATOMIC_RELEASE);
+        count++;
+    }
+
+    // Publish the new table, a reader may see a mismatched capacity but still probes mapped slots
+    __atomic_store_n(&chunk_index_capacity, capacity, __ATOMIC_RELEASE);
+    __atomic_store_n(&chunk_index, new_index, __ATOMIC_RELEASE);
+    chunk_index_used = count;
+    chunk_index_count = count;
+
+    madvise(old_index, old_capacity * sizeof(chunk_index_slot_t), MADV_DONTNEED);
+
+    return 0;
+}
+
+/**
+ * @brief Adds a chunk to the chunk index, keyed by its data address.
+ * The index is grown (or cleaned from its tombstones) when half of its slots are taken.
+ *
+ * @param chunk The chunk to index.
+ * @return 0 on success, -1 if the index is full.
+ */
+int index_chunk(chunk_list_t *chunk)
+{
+    pthread_mutex_lock(&chunk_index_lock);
+
+    if ((chunk_index_used + 1) * 2 > chunk_index_capacity)
+    {
+        // Double the capacity only if the live entries need it
+        size_t capacity = chunk_index_capacity;
+        if ((chunk_index_count + 1) * 4 > capacity)
+            capacity *= 2;
+
+        if (resize_chunk_index(capacity) == -1)
+            LOG_ERROR("index_chunk - Failed to grow chunk index to %zu slots", capacity);
+    }
+
+    if (chunk_index_used + 1 >= chunk_index_capacity)
+    {
+        pthread_mutex_unlock(&chunk_index_lock);
+        LOG_ERROR("index_chunk - chunk index is full");
+        return -1;
+    }
+
+    size_t slot = hash_chunk_address(chunk->data, chunk_index_capacity);
+    while (chunk_index[slot].key != NULL && chunk_index[slot].key != CHUNK_INDEX_TOMBSTONE)
+        slot = (slot + 1) & (chunk_index_capacity - 1);
+
+    if (chunk_index[slot].key == NULL)
+        chunk_index_used++;
+    chunk_index_count++;
+
+    // The descriptor must be visible before the key for lock-free readers
+    __atomic_store_n(&chunk_index[slot].chunk, chunk, __ATOMIC_RELAXED);
+    __atomic_store_n(&chunk_index[slot].key, chunk->data, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&chunk_index_lock);
+
+    return 0;
+}
+
+/**
+ * @brief Finds the slot of the chunk index holding a data address.
+ * The chunk index lock must be held.
+ *
+ * @param ptr The data address to look for.
+ * @param chunk If not NULL, only the slot of this descriptor matches.
+ * @return A pointer to the slot, or NULL if the address is not a chunk.
+ */
+static chunk_index_slot_t *find_index_slot(const void *ptr, const chunk_list_t *chunk)
+{
+    if (chunk_index == NULL || ptr == NULL || ptr == CHUNK_INDEX_TOMBSTONE)
+        return NULL;
+
+    size_t slot = hash_chunk_address(ptr, chunk_index_capacity);
+    while (chunk_index[slot].key != NULL)
+    {
+        if (chunk_index[slot].key == ptr && (chunk == NULL || chunk_index[slot].chunk == chunk))
+            return &chunk_index[slot];
+
+        slot = (slot + 1) & (chunk_index_capacity - 1);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Removes a chunk from the chunk index.
+ * Called when the chunk disappears, e.g. when it is merged into its predecessor.
+ * Only the entry of this descriptor is removed, never another one with the same address.
+ *
+ * @param chunk The chunk to remove.
+ */
+void unindex_chunk(chunk_list_t *chunk)
+{
+    pthread_mutex_lock(&chunk_index_lock);
+
+    chunk_index_slot_t *slot = find_index_slot(chunk->data, chunk);
+    if (slot != NULL)
+    {
+        __atomic_store_n(&slot->key, CHUNK_INDEX_TOMBSTONE, __ATOMIC_RELEASE);
+        __atomic_store_n(&slot->chunk, NULL, __ATOMIC_RELAXED);
+        chunk_index_count--;
+    }
+
+    pthread_mutex_unlock(&chunk_index_lock);
+}
+
+/**
+ * @brief Retrieves the descriptor of a chunk without holding the chunk index lock.
+ * A concurrent resize of the index can make this lookup miss, so a miss must be
+ * confirmed with get_chunk. A hit is always a live descriptor
+ * whose data address is @ptr.
+ *
+ * @param ptr The data address to look for.
+ * @return A pointer to the descriptor, or NULL if it was not found.
+ */
+chunk_list_t *lookup_chunk(void *ptr)
+{
+    chunk_index_slot_t *index = __atomic_load_n(&chunk_index, __ATOMIC_ACQUIRE);
+    size_t capacity = __atomic_load_n(&chunk_index_capacity, __ATOMIC_ACQUIRE);
+
+    if (index == NULL || ptr == NULL || ptr == CHUNK_INDEX_TOMBSTONE)
+        return NULL;
+
+    size_t slot = hash_chunk_address(ptr, capacity);
+    for (size_t probes = 0; probes < capacity; probes++)
+    {
+        void *key = __atomic_load_n(&index[slot].key, __ATOMIC_ACQUIRE);
+        if (key == NULL)
+            return NULL;
+
+        if (key == ptr)
+        {
+            chunk_list_t *chunk = __atomic_load_n(&index[slot].chunk, __ATOMIC_RELAXED);
+            if (chunk != NULL && __atomic_load_n(&chunk->data, __ATOMIC_RELAXED) == ptr)
+                return chunk;
+
+            return NULL;
+        }
+
+        slot = (slot + 1) & (capacity - 1);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Searches the sizes of a bin, from the end, for a chunk of at least @needed bytes.
+ * Sizes are compared by blocks of 8 without branches, so the compiler can vectorize them.
+ *
+ * @param sizes The sizes of the free chunks of the bin.
+ * @param first The first slot to look at.
+ * @param end The slot after the last one to look at.
+ * @param needed The size to look for.
+ * @return The last slot holding a big enough size, or FREE_BIN_NONE.
+ */
+static uint32_t scan_free_sizes(const uint32_t *sizes, uint32_t first, uint32_t end, uint32_t needed)
+{
+    while (end - first >= 8)
+    {
+        unsigned int mask = 0;
+        for (unsigned int i = 0; i < 8; i++)
+            mask |= (unsigned int)(sizes[end - 8 + i] >= needed) << i;
+
+        if (mask != 0)
+            return end - 8 + (31 - __builtin_clz(mask));
+
+        end -= 8;
+    }
+
+    while (end > first)
+    {
+        end--;
+        if (sizes[end] >= needed)
+            return end;
+    }
+
+    return FREE_BIN_NONE;
+}
+
+/**
+ * @brief Finds a free chunk containg at least @size in the free lists.
+ * The bin of the requested size class is scanned first (at most BIN_SCAN_LIMIT chunks),
+ * then the first non-empty bigger class is taken from the bins bitmap: every chunk
+ * in it is big enough by construction.
+ *
+ * @param arena The arena to search.
+ * @param size The size of the chunk to find.
+ * @return A pointer to a free chunk or NULL if no free chunk is found.
+ */
+chunk_list_t *find_free_chunk(arena_t *arena, size_t size)
+{
+    size_t needed = size + sizeof(canary_t);
+    unsigned int class = get_size_class(needed);
+    const uint32_t *sizes = arena->free_sizes[class];
+    chunk_list_t **chunks = arena->free_chunks[class];
+
+    // The most recently freed chunks are at the end of the bin
+    // The last class is unbounded, so it must be scanned entirely
+    uint32_t count = arena->free_counts[class];
+    uint32_t first = (class == BIN_COUNT - 1 || count <= BIN_SCAN_LIMIT) ? 0 : count - BIN_SCAN_LIMIT;
+    uint32_t slot = scan_free_sizes(sizes, first, count, needed > UINT32_MAX ? UINT32_MAX : (uint32_t)needed);
+
+    // Sizes are saturated in the bins, the descriptor has the last word
+    while (slot != FREE_BIN_NONE && sizes[slot] == UINT32_MAX && get_chunk_size(chunks[slot]) < needed)
+        slot = scan_free_sizes(sizes, first, slot, UINT32_MAX);
+
+    if (slot != FREE_BIN_NONE)
+    {
+        chunk_list_t *current = chunks[slot];
+        LOG_INFO("find_free_chunk - Found free chunk of size %zu at address %p", size, current->data);
+        return current;
+    }
+
+    if (class == BIN_COUNT - 1)
+        return NULL;
+
+    uint64_t bigger = arena->free_bins_map & (~(uint64_t)0 << (class + 1));
+    if (bigger == 0)
+        return NULL;
+
+    class = __builtin_ctzll(bigger);
+    chunk_list_t *current = arena->free_chunks[class][arena->free_counts[class] - 1];
+    LOG_INFO("find_free_chunk - Found free chunk of size %zu at address %p", size, current->data);
+
+    return current;
+}
+
+/**
+ * @brief Commits the next extent of the slice of an arena to its data pool.
+ * This function is used when no free block is found in the memory pool.
+ * Extents double in size up to DATA_EXTENT_MAX_SIZE, and are only bigger when @size
+ * doesn't fit in them. Extents are contiguous: the new one extends the last chunk if it
+ * is free, otherwise it becomes a new free chunk.
+ * The arena lock must be held.
+ *
+ * @param arena The arena to grow.
+ * @param size The size of the chunk that must fit in the new space.
+ * @return The free chunk at the end of the data pool, or NULL if the slice is exhausted.
+ */
+chunk_list_t *grow_data_pool(arena_t *arena, size_t size)
+{
+    LOG_INFO("grow_data_pool - Growing data pool for a chunk of size %zu", size);
+
+    if (size > SIZE_MAX - PAGE_SIZE - 2 * sizeof(canary_t))
+    {
+        LOG_ERROR("grow_data_pool - size %zu is too big", size);
+        return NULL;
+    }
+
+    // Round the extent to pages when the chunk doesn't fit in the next one
+    size_t extent_size = arena->extent_size;
+    if (size + 2 * sizeof(canary_t) > extent_size)
+        extent_size = (size + 2 * sizeof(canary_t) + PAGE_SIZE - 1) & ~((size_t)PAGE_SIZE - 1);
+
+    if (extent_size > (size_t)(arena->data_limit - arena->data_end))
+    {
+        LOG_ERROR("grow_data_pool - reserved range of the arena is exhausted");
+        return NULL;
+    }
+
+    // The extent becomes a new chunk unless the last chunk is free and can take it
+    chunk_list_t *tail = arena->tail;
+    uint8_t *extent = arena->data_end;
+    int extend_tail = tail != NULL && get_chunk_state(tail) == FREE && (uint8_t *)tail->data + get_chunk_size(tail) + sizeof(canary_t) == extent;
+
+    chunk_list_t *chunk = extend_tail ? tail : new_chunk_metadata(arena);
+    if (chunk == NULL)
+        return NULL;
+
+    if (mprotect(extent, extent_size, PROT_READ | PROT_WRITE) == -1)
+    {
+        LOG_ERROR("grow_data_pool - Failed to commit extent of size %zu", extent_size);
+        if (!extend_tail)
+            release_chunk_metadata(chunk);
+        return NULL;
+    }
+
+    arena->data_end += extent_size;
+    if (arena->extent_size < DATA_EXTENT_MAX_SIZE)
+        arena->extent_size *= 2;
+
+    if (extend_tail)
+    {
+        // The old canary ends up inside the chunk, a clean chunk must stay zero
+        remove_free_chunk(chunk);
+        memset((uint8_t *)chunk->data + get_chunk_size(chunk), 0, sizeof(canary_t));
+        set_chunk_size(chunk, get_chunk_size(chunk) + extent_size);
+    }
+    else
+    {
+        chunk->data = extent;
+        set_chunk_size(chunk, extent_size - sizeof(canary_t));
+        set_chunk_state(chunk, FREE);
+        chunk->next = NULL;
+        chunk->prev = tail;
+        index_chunk(chunk);
+
+        if (tail != NULL)
+            tail->next = chunk;
+        else
+            arena->head = chunk;
+        arena->tail = chunk;
+    }
+
+    set_chunk_canary(chunk);
+    insert_free_chunk(chunk);
+
+    return chunk;
+}
+
+/**
+ * @brief Returns the clock used to age free pages, in milliseconds.
+ * The clock wraps around and never returns 0, which marks purged chunks.
+ *
+ * @return The current time in milliseconds.
+ */
+uint32_t get_decay_clock(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+
+    uint32_t clock = (uint32_t)((uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000);
+
+    return clock != 0 ? clock : 1;
+}
+
+/**
+ * @brief Gives the whole pages of a free range back to the system.
+ * MADV_DONTNEED is used rather than MADV_FREE so that the resident size drops right
+ * away and freed data doesn't linger: the pages stay committed and are filled with
+ * zeros the next time they are touched.
+ *
+ * @param start The start of the range.
+ * @param size The size of the range.
+ * @return The number of bytes given back.
+ */
+static size_t purge_pages(void *start, size_t size)
+{
+    uintptr_t first = ((uintptr_t)start + PAGE_SIZE - 1) & ~((uintptr_t)PAGE_SIZE - 1);
+    uintptr_t last = ((uintptr_t)start + size) & ~((uintptr_t)PAGE_SIZE - 1);
+    if (last <= first)
+        return 0;
+
+    if (madvise((void *)first, last - first, MADV_DONTNEED) == -1)
+    {
+        LOG_WARN("purge_pages - Failed to purge %zu bytes at %p", (size_t)(last - first), (void *)first);
+        return 0;
+    }
+
+    return last - first;
+}
+
+/**
+ * @brief Starts the decay of a freed chunk, or purges it right away when the decay time is 0.
+ * The arena lock must be held.
+ *
+ * @param chunk The freed chunk, merged with its neighbours.
+ */
+static void mark_chunk_dirty(chunk_list_t *chunk)
+{
+    if (decay_ms == 0)
+    {
+        purge_pages(chunk->data, get_chunk_size(chunk));
+        chunk->dirty_since = 0;
+    }
+    else
+        chunk->dirty_since = get_decay_clock();
+}
+
+/**
+ * Split a chunk into two chunks, one for the allocated data and one for the remaining free space.
+ * This function is used when the allocated block is empty.
+ *
+ * @param chunk A pointer to the metadata of the free block.
+ * @param size The size of the memory block to allocate.
+ * @return A pointer to the allocated memory block.
+ */
+void *split_chunk(chunk_list_t *chunk, size_t size)
+{
+    remove_free_chunk(chunk);
+
+    // If the remaining space is too small for another chunk, we use the chunk directly
+    // A free chunk has no canary in its descriptor, it gets a new one
+    if (get_chunk_size(chunk) < size + sizeof(canary_t) + CHUNK_ALIGNMENT)
+    {
+        LOG_INFO("split_chunk - chunk is too small to be split");
+        set_chunk_state(chunk, USED);
+        set_chunk_canary(chunk);
+        return chunk->data;
+    }
+
+    // If no descriptor is left for the remaining space, the whole chunk is used
+    arena_t *arena = get_chunk_arena(chunk);
+    chunk_list_t *empty = new_chunk_metadata(arena);
+    if (empty == NULL)
+    {
+        set_chunk_state(chunk, USED);
+        set_chunk_canary(chunk);
+        return chunk->data;
+    }
+
+    empty->data = (uint8_t *)(chunk->data) + size + sizeof(canary_t); // + sizeof(canary_t) to avoid precedent canary overwrite
+    set_chunk_size(empty, get_chunk_size(chunk) - (size + sizeof(canary_t)));
+    set_chunk_state(empty, FREE);
+    empty->dirty_since = chunk->dirty_since;
+    empty->next = chunk->next;
+    empty->prev = chunk;
+    if (chunk->next != NULL)
+        chunk->next->prev = empty;
+    set_chunk_canary(empty);
+    insert_free_chunk(empty);
+    index_chunk(empty);
+
+    if (arena->tail == chunk)
+        arena->tail = empty;
+
+    // Update the metadata of the free chunk
+    set_chunk_size(chunk, size);
+    set_chunk_state(chunk, USED);
+    chunk->next = empty;
+    set_chunk_canary(chunk);
+
+    return chunk->data;
+}
+
+/**
+ * @brief Gives the tail of a used chunk back to the free lists of its arena.
+ * The tail is merged with the next chunk if it is free. Nothing is done when the tail
+ * is too small to be a chunk. The canary of @chunk is not re-written.
+ * The arena lock must be held.
+ *
+ * @param chunk The used chunk to shrink.
+ * @param size The new size of the chunk, a multiple of CHUNK_ALIGNMENT.
+ */
+void trim_chunk(chunk_list_t *chunk, size_t size)
+{
+    if (get_chunk_size(chunk) < size + sizeof(canary_t) + CHUNK_ALIGNMENT)
+        return;
+
+    arena_t *arena = get_chunk_arena(chunk);
+    chunk_list_t *tail = new_chunk_metadata(arena);
+    if (tail == NULL)
+        return;
+
+    tail->data = (uint8_t *)(chunk->data) + size + sizeof(canary_t); // + sizeof(canary_t) to avoid canary overwrite
+    set_chunk_size(tail, get_chunk_size(chunk) - (size + sizeof(canary_t)));
+    set_chunk_state(tail, FREE);
+    tail->next = chunk->next;
+    tail->prev = chunk;
+    if (chunk->next != NULL)
+        chunk->next->prev = tail;
+    set_chunk_canary(tail);
+    insert_free_chunk(tail);
+    index_chunk(tail);
+
+    if (arena->tail == chunk)
+        arena->tail = tail;
+
+    set_chunk_size(chunk, size);
+    chunk->next = tail;
+
+    mark_chunk_dirty(merge_chunk_neighbours(tail));
+}
+
+/**
+ * @brief Allocates a chunk of memory with the specified size.
+ * Free chunks whose pages were never written or were purged have zero pages: the range of
+ * these pages is given to the caller, so that calloc only zeroes the rest of the chunk.
+ *
+ * @param arena The arena to allocate in, its lock must be held.
+ * @param size The size of the chunk to allocate.
+ * @param zero_start If not NULL, set to the start of the zero pages of the chunk found.
+ * @param zero_end If not NULL, set to the end of the zero pages of the chunk found, not after @zero_start if there are none.
+ * @return A pointer to the allocated chunk, or NULL if allocation fails.
+ */
+void *get_free_chunk(arena_t *arena, size_t size, uint8_t **zero_start, uint8_t **zero_end)
+{
+    size = ALIGN_CHUNK_SIZE(size); // Align the size to 16 bytes
+
+    LOG_INFO("get_free_chunk - Allocating chunk of size %zu", size);
+
+    chunk_list_t *free_chunk = find_free_chunk(arena, size);
+
+    // If no free chunk is found, we need to grow the data pool
+    if (free_chunk == NULL && (free_chunk = grow_data_pool(arena, size)) == NULL)
+        return NULL;
+
+    // A clean free chunk has zero pages, only its canary and its partial pages may not be zero
+    if (zero_start != NULL && zero_end != NULL)
+    {
+        uintptr_t data = (uintptr_t)free_chunk->data;
+        int clean = free_chunk->dirty_since == 0;
+        *zero_start = clean ? (uint8_t *)((data + PAGE_SIZE - 1) & ~((uintptr_t)PAGE_SIZE - 1)) : NULL;
+        *zero_end = clean ? (uint8_t *)((data + get_chunk_size(free_chunk)) & ~((uintptr_t)PAGE_SIZE - 1)) : NULL;
+    }
+
+    // Divide the free chunk into two chunks, one for the allocated data and one for the remaining free space
+    return split_chunk(free_chunk, size);
+}
+
+/**
+ * @brief Splits the start of a free chunk off into its own free chunk.
+ * Both chunks stay in the bins. The arena lock must be held.
+ *
+ * @param chunk The free chunk to split.
+ * @param offset The offset of the second chunk, the first one keeps its canary before it.
+ * @return The descriptor of the second chunk, or NULL if no descriptor is left.
+ */
+static chunk_list_t *split_chunk_front(chunk_list_t *chunk, size_t offset)
+{
+    arena_t *arena = get_chunk_arena(chunk);
+    chunk_list_t *rest = new_chunk_metadata(arena);
+    if (rest == NULL)
+        return NULL;
+
+    remove_free_chunk(chunk);
+
+    rest->data = (uint8_t *)(chunk->data) + offset;
+    set_chunk_size(rest, get_chunk_size(chunk) - offset);
+    set_chunk_state(rest, FREE);
+    rest->dirty_since = chunk->dirty_since;
+    rest->next = chunk->next;
+    rest->prev = chunk;
+    if (chunk->next != NULL)
+        chunk->next->prev = rest;
+    set_chunk_canary(rest);
+    insert_free_chunk(rest);
+    index_chunk(rest);
+
+    if (arena->tail == chunk)
+        arena->tail = rest;
+
+    set_chunk_size(chunk, offset - sizeof(canary_t));
+    chunk->next = rest;
+    set_chunk_canary(chunk);
+    insert_free_chunk(chunk);
+
+    return rest;
+}
+
+/**
+ * @brief Allocates a chunk whose data is aligned, from the free chunks of an arena.
+ * The chunk found is cut at the aligned address: the space before it stays a free chunk
+ * and the space after the allocation is split off as usual, so nothing is over-allocated
+ * or copied. The arena lock must be held.
+ *
+ * @param arena The arena to allocate in.
+ * @param size The size to allocate.
+ * @param alignment The alignment of the data, a power of two.
+ * @return A pointer to the aligned data, or NULL if allocation fails.
+ */
+void *get_aligned_free_chunk(arena_t *arena, size_t size, size_t alignment)
+{
+    size = ALIGN_CHUNK_SIZE(size);
+
+    // The space before the aligned address must hold a free chunk and its canary
+    size_t min_offset = sizeof(canary_t) + CHUNK_ALIGNMENT;
+    size_t needed = size + alignment + min_offset;
+
+    LOG_INFO("get_aligned_free_chunk - Allocating chunk of size %zu aligned on %zu", size, alignment);
+
+    chunk_list_t *free_chunk = find_free_chunk(arena, needed);
+    if (free_chunk == NULL && (free_chunk = grow_data_pool(arena, needed)) == NULL)
+        return NULL;
+
+    uintptr_t data = (uintptr_t)free_chunk->data;
+    size_t offset = ((data + alignment - 1) & ~(uintptr_t)(alignment - 1)) - data;
+    if (offset != 0 && offset < min_offset)
+        offset += alignment;
+
+    if (offset != 0 && (free_chunk = split_chunk_front(free_chunk, offset)) == NULL)
+        return NULL;
+
+    return split_chunk(free_chunk, size);
+}
+
+/**
+ * @brief Tells whether two chunks of the list can be merged.
+ * Both chunks must be free and @second must start right after the canary of @first.
+ * States are read atomically: other threads may cache or queue a used chunk without the
+ * arena lock, but only the arena lock holder makes a chunk FREE.
+ *
+ * @param first The first chunk.
+ * @param second The chunk following @first in the list.
+ * @return 1 if the chunks can be merged, 0 otherwise.
+ */
+static int can_merge_chunks(const chunk_list_t *first, const chunk_list_t *second)
+{
+    return first != NULL && second != NULL && get_chunk_state(first) == FREE && get_chunk_state(second) == FREE && (uint8_t *)first->data + get_chunk_size(first) + sizeof(canary_t) == second->data;
+}
+
+/**
+ * @brief Merges a free chunk with the free chunk following it in the list.
+ * The second descriptor is unlinked from the list, the free lists and the index.
+ *
+ * @param first The chunk that absorbs @first->next.
+ */
+static void absorb_next_chunk(chunk_list_t *first)
+{
+    chunk_list_t *second = first->next;
+
+    remove_free_chunk(first);
+    remove_free_chunk(second);
+    unindex_chunk(second);
+
+    set_chunk_size(first, get_chunk_size(first) + get_chunk_size(second) + sizeof(canary_t));
+    first->next = second->next;
+    if (second->next != NULL)
+        second->next->prev = first;
+
+    arena_t *arena = get_chunk_arena(first);
+    if (arena->tail == second)
+        arena->tail = first;
+
+    release_chunk_metadata(second);
+    insert_free_chunk(first);
+}
+
+/**
+ * @brief Merges a newly freed chunk with its free neighbours in memory.
+ * Only the previous and the next chunks are looked at, so the cost does not depend
+ * on the size of the heap.
+ *
+ * @param chunk The freed chunk.
+ * @return The descriptor of the merged chunk.
+ */
+chunk_list_t *merge_chunk_neighbours(chunk_list_t *chunk)
+{
+    if (can_merge_chunks(chunk, chunk->next))
+        absorb_next_chunk(chunk);
+
+    if (can_merge_chunks(chunk->prev, chunk))
+    {
+        chunk = chunk->prev;
+        absorb_next_chunk(chunk);
+    }
+
+    return chunk;
+}
+
+/**
+ * @brief Gives a freed chunk back to the free lists of its arena and merges it with its neighbours.
+ * The arena lock must be held.
+ *
+ * @param chunk The freed chunk.
+ */
+void release_chunk(chunk_list_t *chunk)
+{
+    set_chunk_state(chunk, FREE);
+    insert_free_chunk(chunk);
+    mark_chunk_dirty(merge_chunk_neighbours(chunk));
+}
+
+/**
+ * @brief Links a pending chunk on the remote free queue of its arena, without any lock.
+ * The link takes the place of the canary, which must have been checked before.
+ *
+ * @param chunk The pending chunk.
+ */
+static void queue_remote_free(chunk_list_t *chunk)
+{
+    arena_t *arena = get_chunk_arena(chunk);
+    chunk_list_t *head = __atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED);
+    do
+        chunk->next_free = head;
+    while (!__atomic_compare_exchange_n(&arena->remote_frees, &head, chunk, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/**
+ * @brief Pushes a chunk freed by a thread of another arena on the remote free queue of its arena.
+ * The chunk is checked the same way as on the locked path, then linked without any lock:
+ * the owner of the arena gives it back to the free lists in drain_remote_frees.
+ *
+ * @param chunk The chunk being freed.
+ * @return 0 if the chunk was queued, -1 if it was not in use.
+ */
+int push_remote_free(chunk_list_t *chunk)
+{
+    if (!swap_chunk_state(chunk, USED, PENDING))
+        return -1;
+
+    check_canary_integrity(chunk);
+    queue_remote_free(chunk);
+
+    return 0;
+}
+
+/**
+ * @brief Gives every chunk of the remote free queue of an arena back to its free lists.
+ * The whole queue is taken at once, so producers never wait for the owner.
+ * The arena lock must be held.
+ *
+ * @param arena The arena to drain.
+ */
+void drain_remote_frees(arena_t *arena)
+{
+    if (__atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED) == NULL)
+        return;
+
+    chunk_list_t *chunk = __atomic_exchange_n(&arena->remote_frees, NULL, __ATOMIC_ACQUIRE);
+    while (chunk != NULL)
+    {
+        chunk_list_t *next = chunk->next_free;
+
+        chunk->next_free = NULL;
+        release_chunk(chunk);
+
+        chunk = next;
+    }
+}
+
+/**
+ * @brief Tells whether an address is in the part of the reserved range holding the slabs.
+ *
+ * @param ptr The address to check.
+ * @return 1 if the address is in a slab, 0 otherwise.
+ */
+int in_slab_range(const void *ptr)
+{
+    const uint8_t *start = __atomic_load_n(&heap_start, __ATOMIC_ACQUIRE);
+
+    return start != NULL && (const uint8_t *)ptr >= start && (const uint8_t *)ptr < start + slab_reserve_size;
+}
+
+/**
+ * @brief Returns the header of the slab holding an address of the slab range.
+ *
+ * @param ptr The address, it must be in the slab range.
+ * @return A pointer to the header of the slab.
+ */
+slab_t *get_slab(const void *ptr)
+{
+    return &slab_headers[((const uint8_t *)ptr - heap_start) >> SLAB_SHIFT];
+}
+
+/**
+ * @brief Returns the address of the first slot of a slab.
+ *
+ * @param slab The header of the slab.
+ * @return The address of the slab.
+ */
+static uint8_t *get_slab_data(const slab_t *slab)
+{
+    return heap_start + ((size_t)(slab - slab_headers) << SLAB_SHIFT);
+}
+
+/**
+ * @brief Computes the canary of a slot.
+ * Canaries are derived from the secret of the slab with a keyed pseudorandom function,
+ * so none of them is stored and a leaked canary doesn't give away the others.
+ *
+ * @param slab The header of the slab.
+ * @param slot The index of the slot.
+ * @return The canary of the slot.
+ */
+static canary_t get_slot_canary(const slab_t *slab, unsigned int slot)
+{
+    return get_keyed_canary(slot_canary_key, (uint64_t)(slab - slab_headers), ((uint64_t)slab->canary << 32) | slot);
+}
+
+/**
+ * @brief Unlinks a slab from the list of slabs with free slots of its class.
+ *
+ * @param arena The arena owning the slab.
+ * @param slab The slab to unlink.
+ */
+static void unlink_slab(arena_t *arena, slab_t *slab)
+{
+    if (slab->prev != NULL)
+        slab->prev->next = slab->next;
+    else
+        arena->slabs[slab->slot_size / CHUNK_ALIGNMENT - 1] = slab->next;
+
+    if (slab->next != NULL)
+        slab->next->prev = slab->prev;
+
+    slab->next = NULL;
+    slab->prev = NULL;
+}
+
+/**
+ * @brief Commits the next SLAB_BATCH_COUNT slabs of the slab range for an arena.
+ * The arena lock must be held.
+ *
+ * @param arena The arena taking the slabs.
+ * @return 0 on success, -1 if the slab range is exhausted.
+ */
+static int commit_slab_batch(arena_t *arena)
+{
+    size_t batch_size = (size_t)SLAB_BATCH_COUNT * SLAB_SIZE;
+    size_t offset = __atomic_fetch_add(&slab_next, batch_size, __ATOMIC_RELAXED);
+    if (offset + batch_size > slab_reserve_size)
+    {
+        LOG_WARN("commit_slab_batch - slab range is exhausted");
+        return -1;
+    }
+
+    if (mprotect(heap_start + offset, batch_size, PROT_READ | PROT_WRITE) == -1)
+    {
+        LOG_ERROR("commit_slab_batch - Failed to commit slabs");
+        return -1;
+    }
+
+    arena->slab_batch = heap_start + offset;
+    arena->slab_batch_end = arena->slab_batch + batch_size;
+    arena->slabs_size += batch_size;
+
+    return 0;
+}
+
+/**
+ * @brief Gives a slab to a class of an arena.
+ * Empty slabs of the arena are reused first, then slabs are committed by batches.
+ * The arena lock must be held.
+ *
+ * @param arena The arena taking the slab.
+ * @param slot_size The size of the slots, canary included.
+ * @return The header of the slab, or NULL if no slab is left.
+ */
+slab_t *new_slab(arena_t *arena, unsigned int slot_size)
+{
+    slab_t *slab = arena->empty_slabs;
+
+    if (slab != NULL)
+        arena->empty_slabs = slab->next;
+    else
+    {
+        if (arena->slab_batch == arena->slab_batch_end && commit_slab_batch(arena) == -1)
+            return NULL;
+
+        slab = get_slab(arena->slab_batch);
+        arena->slab_batch += SLAB_SIZE;
+        __atomic_store_n(&slab->arena, arena, __ATOMIC_RELEASE);
+    }
+
+    slab->slot_size = slot_size;
+    slab->slot_count = SLAB_SIZE / slot_size;
+    slab->free_count = slab->slot_count;
+    slab->canary = get_random_canary();
+
+    memset(slab->free_map, 0, sizeof(slab->free_map));
+    for (unsigned int slot = 0; slot < slab->slot_count; slot += 64)
+        slab->free_map[slot / 64] = slab->slot_count - slot >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << (slab->slot_count - slot)) - 1;
+
+    slab->prev = NULL;
+    slab->next = arena->slabs[slot_size / CHUNK_ALIGNMENT - 1];
+    if (slab->next != NULL)
+        slab->next->prev = slab;
+    arena->slabs[slot_size / CHUNK_ALIGNMENT - 1] = slab;
+
+    return slab;
+}
+
+/**
+ * @brief Allocates a slot of a slab.
+ * The first free slot is found with a bit scan of the bitmap of the slab.
+ * The arena lock must be held.
+ *
+ * @param arena The arena to allocate in.
+ * @param size The size to allocate, at most SLAB_MAX_SIZE.
+ * @return A pointer to the slot, or NULL if no slab is left.
+ */
+void *allocate_slot(arena_t *arena, size_t size)
+{
+    unsigned int slot_size = ALIGN_CHUNK_SIZE(size + sizeof(canary_t));
+    if (slot_size < SLAB_MIN_SLOT_SIZE)
+        slot_size = SLAB_MIN_SLOT_SIZE;
+
+    slab_t *slab = arena->slabs[slot_size / CHUNK_ALIGNMENT - 1];
+    if (slab == NULL && (slab = new_slab(arena, slot_size)) == NULL)
+        return NULL;
+
+    unsigned int word = 0;
+    while (slab->free_map[word] == 0)
+        word++;
+
+    unsigned int bit = __builtin_ctzll(slab->free_map[word]);
+    unsigned int slot = word * 64 + bit;
+    slab->free_map[word] &= ~((uint64_t)1 << bit);
+
+    // Full slabs leave the list until one of their slots is freed
+    if (--slab->free_count == 0)
+        unlink_slab(arena, slab);
+
+    uint8_t *data = get_slab_data(slab) + (size_t)slot * slot_size;
+    canary_t canary = get_slot_canary(slab, slot);
+    memcpy(data + slot_size - sizeof(canary_t), &canary, sizeof(canary_t));
+    arena->slots_size += slot_size;
+
+    return data;
+}
+
+/**
+ * @brief Finds the slot of an address of the slab range and locks the arena owning it.
+ * Interior pointers, free slots and slabs not in use are rejected.
+ *
+ * @param ptr The address of the slot.
+ * @param slot Set to the index of the slot.
+ * @return The header of the slab with its arena locked, or NULL if @ptr is not a slot in use.
+ */
+static slab_t *lock_slot(void *ptr, unsigned int *slot)
+{
+    slab_t *slab = get_slab(ptr);
+    arena_t *arena = slab->arena;
+    if (arena == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&arena->lock);
+
+    size_t offset = (uint8_t *)ptr - get_slab_data(slab);
+    if (slab->slot_size == 0 || offset % slab->slot_size != 0 || offset / slab->slot_size >= slab->slot_count)
+    {
+        pthread_mutex_unlock(&arena->lock);
+        return NULL;
+    }
+
+    *slot = offset / slab->slot_size;
+    if ((slab->free_map[*slot / 64] | slab->quarantine_map[*slot / 64]) & ((uint64_t)1 << (*slot % 64)))
+    {
+        pthread_mutex_unlock(&arena->lock);
+        LOG_WARN("lock_slot - slot at %p is not in use", ptr);
+        return NULL;
+    }
+
+    return slab;
+}
+
+/**
+ * @brief Checks the canary at the end of a slot in use.
+ * The arena lock must be held.
+ *
+ * @param slab The slab of the slot.
+ * @param slot The index of the slot.
+ */
+static void check_slot_canary(const slab_t *slab, unsigned int slot)
+{
+    canary_t canary = 0;
+    memcpy(&canary, get_slab_data(slab) + (size_t)(slot + 1) * slab->slot_size - sizeof(canary_t), sizeof(canary_t));
+    if (canary != get_slot_canary(slab, slot))
+    {
+        COUNT_HEAP_EVENT(canary_failures);
+        LOG_ERROR("check_slot_canary - canary corrupted");
+    }
+}
+
+/**
+ * @brief Gives a freed slot back to its slab.
+ * A slab that gets empty is given back to its arena unless it is the last one of its class
+ * with free slots. The arena lock must be held.
+ *
+ * @param slab The slab of the slot.
+ * @param slot The index of the slot.
+ */
+static void release_slot(slab_t *slab, unsigned int slot)
+{
+    arena_t *arena = slab->arena;
+
+    slab->free_map[slot / 64] |= (uint64_t)1 << (slot % 64);
+    slab->free_count++;
+    arena->slots_size -= slab->slot_size;
+
+    if (slab->free_count == 1)
+    {
+        // The slab was full, it can serve its class again
+        slab->prev = NULL;
+        slab->next = arena->slabs[slab->slot_size / CHUNK_ALIGNMENT - 1];
+        if (slab->next != NULL)
+            slab->next->prev = slab;
+        arena->slabs[slab->slot_size / CHUNK_ALIGNMENT - 1] = slab;
+    }
+    else if (slab->free_count == slab->slot_count && (slab->prev != NULL || slab->next != NULL))
+    {
+        unlink_slab(arena, slab);
+        slab->slot_size = 0;
+        slab->next = arena->empty_slabs;
+        arena->empty_slabs = slab;
+
+        if (decay_ms == 0)
+        {
+            purge_pages(get_slab_data(slab), SLAB_SIZE);
+            slab->dirty_since = 0;
+        }
+        else
+            slab->dirty_since = get_decay_clock();
+
+        purge_arena(arena, 0, 0);
+    }
+}
+
+/**
+ * @brief Frees a slot of a slab.
+ * The canary of the slot is checked, and so is the size given by the caller when it is known.
+ *
+ * @param ptr The address of the slot.
+ * @param size The size of the allocation given by the caller, 0 if it is unknown.
+ */
+void free_slot(void *ptr, size_t size)
+{
+    unsigned int slot;
+    slab_t *slab = lock_slot(ptr, &slot);
+    if (slab == NULL)
+    {
+        LOG_WARN("free_slot - invalid or double free of %p", ptr);
+        return;
+    }
+
+    arena_t *arena = slab->arena;
+
+    // Check canary integrity
+    check_slot_canary(slab, slot);
+
+    if (size > slab->slot_size - sizeof(canary_t))
+        LOG_ERROR("free_slot - size %zu is bigger than the slot at %p", size, ptr);
+
+    release_slot(slab, slot);
+
+    pthread_mutex_unlock(&arena->lock);
+}
+
+/**
+ * @brief Reallocates a slot of a slab.
+ * The slot is kept when the new size fits in it, otherwise its content is moved.
+ *
+ * @param ptr The address of the slot.
+ * @param size The new size, not 0.
+ * @return A pointer to the reallocated memory, or NULL if the reallocation failed.
+ */
+void *reallocate_slot(void *ptr, size_t size)
+{
+    unsigned int slot;
+    slab_t *slab = lock_slot(ptr, &slot);
+    if (slab == NULL)
+    {
+        trace_event(TRACE_REALLOC, ptr, NULL, size);
+        LOG_WARN("reallocate_slot - %p is not a slot in use", ptr);
+        return NULL;
+    }
+
+    size_t usable_size = slab->slot_size - sizeof(canary_t);
+    pthread_mutex_unlock(&slab->arena->lock);
+
+    if (size <= usable_size)
+    {
+        trace_event(TRACE_REALLOC, ptr, ptr, size);
+        return ptr;
+    }
+
+    void *new = my_malloc(size);
+    trace_event(TRACE_REALLOC, ptr, new, size);
+    if (new == NULL)
+        return NULL;
+
+    memcpy(new, ptr, usable_size);
+    my_free(ptr);
+
+    return new;
+}
+
+/**
+ * @brief Gives the pages of the free chunks and of the empty slabs of an arena back to the system.
+ * Unless @force is set, the arena is purged at most once per decay time, and only pages
+ * free for the decay time are purged. With @force, every free page is purged but the
+ * first @pad bytes of the last chunk of the arena.
+ * The arena lock must be held.
+ *
+ * @param arena The arena to purge.
+ * @param force 1 to purge every free page now, 0 to follow the decay time.
+ * @param pad The number of bytes kept at the end of the data pool when @force is set.
+ * @return The number of bytes given back to the system.
+ */
+size_t purge_arena(arena_t *arena, int force, size_t pad)
+{
+    uint32_t now = get_decay_clock();
+    if (!force && (decay_ms <= 0 || now - arena->last_purge < (uint32_t)decay_ms))
+        return 0;
+
+    arena->last_purge = now;
+    size_t purged = 0;
+
+    // Chunks of the classes below the page size can't hold a whole page
+    uint64_t bins = arena->free_bins_map & (~(uint64_t)0 << get_size_class(PAGE_SIZE));
+    for (; bins != 0; bins &= bins - 1)
+    {
+        unsigned int class = __builtin_ctzll(bins);
+        chunk_list_t **chunks = arena->free_chunks[class];
+        for (uint32_t slot = 0; slot < arena->free_counts[class]; slot++)
+        {
+            chunk_list_t *chunk = chunks[slot];
+            if (!force && (chunk->dirty_since == 0 || now - chunk->dirty_since < (uint32_t)decay_ms))
+                continue;
+
+            size_t size = get_chunk_size(chunk);
+            size_t keep = (force && chunk == arena->tail) ? (pad < size ? pad : size) : 0;
+            purged += purge_pages((uint8_t *)chunk->data + keep, size - keep);
+
+            // Only a chunk purged entirely is known to have zero pages
+            if (keep == 0)
+                chunk->dirty_since = 0;
+        }
+    }
+
+    for (slab_t *slab = arena->empty_slabs; slab != NULL; slab = slab->next)
+    {
+        if (!force && (slab->dirty_since == 0 || now - slab->dirty_since < (uint32_t)decay_ms))
+            continue;
+
+        purged += purge_pages(get_slab_data(slab), SLAB_SIZE);
+        slab->dirty_since = 0;
+    }
+
+    if (purged > 0)
+        LOG_INFO("purge_arena - %zu bytes given back to the system", purged);
+
+    return purged;
+}
+
+/**
+ * @brief Computes the size of the mapping of a large chunk, its canary included.
+ *
+ * @param size The size of the chunk.
+ * @return The size of the mapping, or 0 if it overflows.
+ */
+static size_t get_large_mapping_size(size_t size)
+{
+    if (size > SIZE_MAX - PAGE_SIZE - sizeof(canary_t))
+        return 0;
+
+    return (size + sizeof(canary_t) + PAGE_SIZE - 1) & ~((size_t)PAGE_SIZE - 1);
+}
+
+/**
+ * @brief Maps memory aligned beyond the page size.
+ * A bigger range is mapped and the pages before and after the aligned part are unmapped.
+ *
+ * @param size The size of the mapping, a multiple of the page size.
+ * @param alignment The alignment of the mapping, a power of two bigger than the page size.
+ * @return The aligned mapping, or NULL if it can't be mapped.
+ */
+static void *map_aligned_pool(size_t size, size_t alignment)
+{
+    if (size > SIZE_MAX - alignment)
+        return NULL;
+
+    size_t reserve_size = size + alignment - PAGE_SIZE;
+    uint8_t *reserve = init_pool(NULL, reserve_size);
+    if (reserve == NULL)
+        return NULL;
+
+    uint8_t *data = (uint8_t *)(((uintptr_t)reserve + alignment - 1) & ~(uintptr_t)(alignment - 1));
+    if (data != reserve)
+    {
+        munmap(reserve, data - reserve);
+        COUNT_HEAP_EVENT(munmap_calls);
+    }
+    if (data + size != reserve + reserve_size)
+    {
+        munmap(data + size, reserve + reserve_size - (data + size));
+        COUNT_HEAP_EVENT(munmap_calls);
+    }
+
+    return data;
+}
+
+/**
+ * @brief Allocates a chunk in its own mapping, with the canary at its end.
+ * The descriptor comes from the arena of the calling thread and the chunk is indexed like
+ * the others, but it is out of the reserved range and of the chunk list.
+ * The heap must be initialized.
+ *
+ * @param size The size of the chunk to allocate.
+ * @param alignment The alignment of the chunk, a power of two. Mappings are always page aligned.
+ * @return A pointer to the allocated chunk, or NULL if allocation fails.
+ */
+void *allocate_large_chunk(size_t size, size_t alignment)
+{
+    size = ALIGN_CHUNK_SIZE(size);
+    size_t mapping_size = get_large_mapping_size(size);
+    if (mapping_size == 0)
+    {
+        LOG_ERROR("allocate_large_chunk - size %zu is too big", size);
+        return NULL;
+    }
+
+    LOG_INFO("allocate_large_chunk - Mapping chunk of size %zu", size);
+
+    void *data = alignment > PAGE_SIZE ? map_aligned_pool(mapping_size, alignment) : init_pool(NULL, mapping_size);
+    if (data == NULL)
+        return NULL;
+
+    arena_t *arena = get_thread_arena();
+    pthread_mutex_lock(&arena->lock);
+
+    chunk_list_t *chunk = new_chunk_metadata(arena);
+    if (chunk == NULL)
+    {
+        pthread_mutex_unlock(&arena->lock);
+        munmap(data, mapping_size);
+        COUNT_HEAP_EVENT(munmap_calls);
+        return NULL;
+    }
+
+    chunk->data = data;
+    set_chunk_size(chunk, size);
+    set_chunk_state(chunk, USED);
+    chunk->prev = NULL;
+    chunk->next = arena->large_chunks;
+    if (arena->large_chunks != NULL)
+        arena->large_chunks->prev = chunk;
+    arena->large_chunks = chunk;
+    arena->large_count++;
+    arena->large_size += mapping_size;
+    set_chunk_canary(chunk);
+    index_chunk(chunk);
+
+    pthread_mutex_unlock(&arena->lock);
+
+    return data;
+}
+
+/**
+ * @brief Frees a large chunk and unmaps it.
+ *
+ * @param chunk The large chunk to free.
+ */
+void free_large_chunk(chunk_list_t *chunk)
+{
+    // Check double free
+    if (!swap_chunk_state(chunk, USED, FREE))
+    {
+        LOG_WARN("free_large_chunk - double free");
+        return;
+    }
+
+    // Check canary integrity
+    check_canary_integrity(chunk);
+
+    void *data = chunk->data;
+    size_t mapping_size = get_large_mapping_size(get_chunk_size(chunk));
+    unindex_chunk(chunk);
+
+    arena_t *arena = get_chunk_arena(chunk);
+    pthread_mutex_lock(&arena->lock);
+
+    if (chunk->prev != NULL)
+        chunk->prev->next = chunk->next;
+    else
+        arena->large_chunks = chunk->next;
+    if (chunk->next != NULL)
+        chunk->next->prev = chunk->prev;
+    arena->large_count--;
+    arena->large_size -= mapping_size;
+    release_chunk_metadata(chunk);
+
+    pthread_mutex_unlock(&arena->lock);
+
+    munmap(data, mapping_size);
+    COUNT_HEAP_EVENT(munmap_calls);
+}
+
+/**
+ * @brief Resizes a large chunk with mremap, the kernel moves its pages instead of copying them.
+ * The chunk is unchanged if the mapping can't be resized.
+ * The reallocation is traced before the old range can be mapped again.
+ *
+ * @param chunk The large chunk to resize.
+ * @param size The new size of the chunk.
+ * @return A pointer to the resized chunk, or NULL if the reallocation failed.
+ */
+void *reallocate_large_chunk(chunk_list_t *chunk, size_t size)
+{
+    size_t requested_size = size;
+    size = ALIGN_CHUNK_SIZE(size);
+    size_t old_mapping_size = get_large_mapping_size(get_chunk_size(chunk));
+    size_t mapping_size = get_large_mapping_size(size);
+    if (mapping_size == 0)
+    {
+        trace_event(TRACE_REALLOC, chunk->data, NULL, requested_size);
+        LOG_ERROR("reallocate_large_chunk - size %zu is too big", size);
+        return NULL;
+    }
+
+    // Check the canary before it is moved or overwritten
+    check_canary_integrity(chunk);
+
+    // The heap scanner reads the canary under the arena lock, the mapping must not move under it
+    arena_t *arena = get_chunk_arena(chunk);
+    pthread_mutex_lock(&arena->lock);
+
+    void *data = chunk->data;
+    if (mapping_size != old_mapping_size)
+    {
+        // Once moved, the old range can be mapped by any thread: it must leave the index first
+        unindex_chunk(chunk);
+
+        data = mremap(chunk->data, old_mapping_size, mapping_size, 0);
+        if (data == MAP_FAILED)
+        {
+            // The chunk is moved to a reserved range, so that the move is traced before the old range is released
+            void *target = init_pool(NULL, mapping_size);
+            if (target != NULL)
+            {
+                trace_event(TRACE_REALLOC, chunk->data, target, requested_size);
+                data = mremap(chunk->data, old_mapping_size, mapping_size, MREMAP_MAYMOVE | MREMAP_FIXED, target);
+                if (data == MAP_FAILED)
+                {
+                    munmap(target, mapping_size);
+                    COUNT_HEAP_EVENT(munmap_calls);
+                }
+            }
+            else
+                trace_event(TRACE_REALLOC, chunk->data, NULL, requested_size);
+
+            if (data == MAP_FAILED)
+            {
+                index_chunk(chunk);
+                pthread_mutex_unlock(&arena->lock);
+                LOG_ERROR("reallocate_large_chunk - Failed to remap chunk to size %zu", size);
+                return NULL;
+            }
+        }
+        else
+            trace_event(TRACE_REALLOC, data, data, requested_size);
+        COUNT_HEAP_EVENT(mremap_calls);
+
+        __atomic_store_n(&chunk->data, data, __ATOMIC_RELAXED);
+        index_chunk(chunk);
+    }
+    else
+        trace_event(TRACE_REALLOC, data, data, requested_size);
+    set_chunk_size(chunk, size);
+    arena->large_size += mapping_size - old_mapping_size;
+    set_chunk_canary(chunk);
+
+    pthread_mutex_unlock(&arena->lock);
+
+    return data;
+}
+
+/**
+ * @brief Retrieves the metadata structure associated with a given pointer.
+ * Only the exact data address of a chunk is found: foreign and interior pointers are rejected.
+ *
+ * @param ptr The pointer whose metadata structure needs to be retrieved.
+ * @return A pointer to the metadata structure if found, otherwise NULL.
+ */
+chunk_list_t *get_chunk(void *ptr)
+{
+    pthread_mutex_lock(&chunk_index_lock);
+
+    chunk_index_slot_t *slot = find_index_slot(ptr, NULL);
+    chunk_list_t *chunk = slot != NULL ? slot->chunk : NULL;
+
+    pthread_mutex_unlock(&chunk_index_lock);
+
+    return chunk;
+}
+
+/**
+ * @brief Set a random canary value to a chunk.
+ * The canary value is used to detect heap overflows, it is placed at the end of the data block.
+ * Is it a random value to make it harder to predict.
+ *
+ * @return 0 if the canary was set, -1 otherwise.
+ */
+int set_chunk_canary(chunk_list_t *chunk)
+{
+    if (chunk == NULL)
+        return -1;
+
+    canary_t canary = get_random_canary();
+    if (canary == 0)
+    {
+        LOG_ERROR("set_chunk_canary - can't get a canary");
+        return -1;
+    }
+
+    chunk->canary = canary;
+
+    memcpy(
+        (uint8_t *)(chunk->data) + get_chunk_size(chunk),
+        &chunk->canary,
+        sizeof(canary_t));
+
+    return 0;
+}
+
+/**
+ * @brief Check the integrity of the canary value of a chunk.
+ * The canary value is used to detect heap overflows, it is placed at the end of the data block.
+ *
+ * @param chunk The chunk to check the canary value.
+ */
+void check_canary_integrity(chunk_list_t *chunk)
+{
+    canary_t canary = 0;
+    memcpy(
+        &canary,
+        (uint8_t *)(chunk->data) + get_chunk_size(chunk),
+        sizeof(canary_t));
+
+    if (canary != chunk->canary)
+    {
+        COUNT_HEAP_EVENT(canary_failures);
+        LOG_ERROR("check_canary_integrity - canary corrupted");
+    }
+
+    return;
+}
+
+/**
+ * @brief Compares canaries with the values they should have.
+ * Blocks of 8 canaries are compared without branches, so that the compiler vectorizes
+ * the comparison, and only a block with a difference is searched.
+ *
+ * @param expected The values the canaries should have.
+ * @param found The values read in the heap.
+ * @param count The number of canaries.
+ * @return The index of the first canary which differs, or @count if they are all intact.
+ */
+size_t compare_canaries(const canary_t *expected, const canary_t *found, size_t count)
+{
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        canary_t diff = 0;
+        for (unsigned int j = 0; j < 8; j++)
+            diff |= expected[i + j] ^ found[i + j];
+
+        if (diff != 0)
+            break;
+    }
+
+    for (; i < count; i++)
+        if (expected[i] != found[i])
+            return i;
+
+    return count;
+}
+
+/**
+ * @brief Reports a block whose canary is corrupted, unless the scan reported it recently.
+ *
+ * @param cursor The scan which found the block.
+ * @param ptr The address of the block.
+ * @param size The size of the block.
+ */
+static void report_corrupted_block(scan_cursor_t *cursor, void *ptr, size_t size)
+{
+    cursor->corrupted++;
+
+    for (unsigned int i = 0; i < SCAN_REPORTED_COUNT; i++)
+        if (cursor->reported[i] == ptr)
+            return;
+
+    cursor->reported[cursor->reported_next] = ptr;
+    cursor->reported_next = (cursor->reported_next + 1) % SCAN_REPORTED_COUNT;
+
+    COUNT_HEAP_EVENT(canary_failures);
+    LOG_ERROR("scan_heap - canary corrupted after the block at %p of size %zu", ptr, size);
+}
+
+/**
+ * @brief Checks the canaries of a batch of descriptors of an arena.
+ * The canaries of the chunks in use are gathered, then compared at once.
+ * The arena lock is only held during the batch.
+ *
+ * @param cursor The scan, positioned in the arena.
+ * @param arena The arena to scan.
+ * @return 1 once the last descriptor of the arena is checked, 0 otherwise.
+ */
+static int scan_arena_batch(scan_cursor_t *cursor, arena_t *arena)
+{
+    canary_t expected[SCAN_BATCH_SIZE];
+    canary_t found[SCAN_BATCH_SIZE];
+    chunk_list_t *chunks[SCAN_BATCH_SIZE];
+    size_t count = 0;
+
+    pthread_mutex_lock(&arena->lock);
+
+    if (cursor->block == NULL)
+    {
+        cursor->block = arena->metadata;
+        cursor->index = 0;
+    }
+
+    for (size_t visited = 0; cursor->block != NULL && visited < SCAN_BATCH_SIZE;)
+    {
+        metadata_block_t *block = cursor->block;
+        size_t end = block == arena->metadata ? arena->metadata_size : block->capacity;
+        if (cursor->index >= end)
+        {
+            cursor->block = block->next;
+            cursor->index = 0;
+            continue;
+        }
+
+        chunk_list_t *chunk = &block->chunks[cursor->index++];
+        visited++;
+
+        // Released descriptors have no data, free and cached chunks are checked when they are reused
+        if (chunk->data == NULL || get_chunk_state(chunk) != USED)
+            continue;
+
+        expected[count] = chunk->canary;
+        memcpy(&found[count], (uint8_t *)(chunk->data) + get_chunk_size(chunk), sizeof(canary_t));
+        chunks[count++] = chunk;
+    }
+
+    for (size_t i = 0; (i += compare_canaries(expected + i, found + i, count - i)) < count; i++)
+    {
+        // A chunk of a thread cache may have been handed out again meanwhile, with a new canary
+        chunk_list_t *chunk = chunks[i];
+        canary_t canary = 0;
+        memcpy(&canary, (uint8_t *)(chunk->data) + get_chunk_size(chunk), sizeof(canary_t));
+        if (get_chunk_state(chunk) == USED && chunk->canary == expected[i] && canary != expected[i])
+            report_corrupted_block(cursor, chunk->data, get_chunk_size(chunk));
+    }
+
+    pthread_mutex_unlock(&arena->lock);
+
+    return cursor->block == NULL;
+}
+
+/**
+ * @brief Checks the canaries of the slots in use of a batch of slabs.
+ * The lock of the arena owning a slab is held while it is checked.
+ *
+ * @param cursor The scan, positioned in the slabs.
+ * @return 1 once the last slab is checked, 0 otherwise.
+ */
+static int scan_slab_batch(scan_cursor_t *cursor)
+{
+    canary_t expected[SLAB_SIZE / SLAB_MIN_SLOT_SIZE];
+    canary_t found[SLAB_SIZE / SLAB_MIN_SLOT_SIZE];
+    unsigned int slots[SLAB_SIZE / SLAB_MIN_SLOT_SIZE];
+
+    size_t slab_end = __atomic_load_n(&slab_next, __ATOMIC_RELAXED);
+    size_t slab_count = (slab_end < slab_reserve_size ? slab_end : slab_reserve_size) >> SLAB_SHIFT;
+
+    for (unsigned int n = 0; n < SCAN_SLAB_BATCH_COUNT && cursor->slab < slab_count; n++, cursor->slab++)
+    {
+        slab_t *slab = &slab_headers[cursor->slab];
+        arena_t *arena = __atomic_load_n(&slab->arena, __ATOMIC_ACQUIRE);
+        if (arena == NULL)
+            continue;
+
+        pthread_mutex_lock(&arena->lock);
+
+        uint8_t *data = get_slab_data(slab);
+        size_t count = 0;
+        for (unsigned int slot = 0; slab->slot_size != 0 && slot < slab->slot_count; slot++)
+        {
+            if (slab->free_map[slot / 64] & ((uint64_t)1 << (slot % 64)))
+                continue;
+
+            expected[count] = get_slot_canary(slab, slot);
+            memcpy(&found[count], data + (size_t)(slot + 1) * slab->slot_size - sizeof(canary_t), sizeof(canary_t));
+            slots[count++] = slot;
+        }
+
+        for (size_t i = 0; (i += compare_canaries(expected + i, found + i, count - i)) < count; i++)
+            report_corrupted_block(cursor, data + (size_t)slots[i] * slab->slot_size, slab->slot_size - sizeof(canary_t));
+
+        pthread_mutex_unlock(&arena->lock);
+    }
+
+    return cursor->slab >= slab_count;
+}
+
+/**
+ * @brief Checks the canaries of the next batch of blocks in use of the heap.
+ * The descriptors of every arena are checked first, then the slabs.
+ *
+ * @param cursor The scan, its position is moved to the next batch.
+ * @return 1 when the batch ends a pass over the heap, the scan then starts over, 0 otherwise.
+ */
+int scan_heap_batch(scan_cursor_t *cursor)
+{
+    if (!__atomic_load_n(&heap_initialized, __ATOMIC_ACQUIRE))
+        return 1;
+
+    if (cursor->arena < arena_count)
+    {
+        if (scan_arena_batch(cursor, &arenas[cursor->arena]))
+        {
+            cursor->arena++;
+            cursor->block = NULL;
+        }
+        return 0;
+    }
+
+    if (!scan_slab_batch(cursor))
+        return 0;
+
+    cursor->arena = 0;
+    cursor->block = NULL;
+    cursor->index = 0;
+    cursor->slab = 0;
+
+    return 1;
+}
+
+/**
+ * @brief Checks the canaries of every block in use of the heap, in batches.
+ *
+ * @param cursor The scan, it starts over from the beginning of the heap.
+ * @return The number of corrupted blocks found.
+ */
+size_t scan_heap(scan_cursor_t *cursor)
+{
+    cursor->arena = 0;
+    cursor->block = NULL;
+    cursor->index = 0;
+    cursor->slab = 0;
+    cursor->corrupted = 0;
+
+    while (!scan_heap_batch(cursor))
+        ;
+
+    return cursor->corrupted;
+}
+
+/**
+ * @brief Runs the heap scanner: batches of canaries are checked, with pauses keeping the CPU
+ * time of the thread within its budget, and at least SCAN_PASS_MIN_MS between two passes.
+ */
+static void *run_heap_scanner(void *arg)
+{
+    (void)arg;
+
+    scan_cursor_t cursor;
+    memset(&cursor, 0, sizeof(cursor));
+
+    pthread_mutex_lock(&scanner_lock);
+    while (scanner_running)
+    {
+        pthread_mutex_unlock(&scanner_lock);
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+        int done = scan_heap_batch(&cursor);
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+
+        uint64_t busy = (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000 + (uint64_t)end.tv_nsec - (uint64_t)start.tv_nsec;
+        uint64_t pause = busy * (100 - scanner_budget) / scanner_budget;
+        if (done)
+        {
+            cursor.corrupted = 0;
+            if (pause < (uint64_t)SCAN_PASS_MIN_MS * 1000000)
+                pause = (uint64_t)SCAN_PASS_MIN_MS * 1000000;
+        }
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        pause += (uint64_t)deadline.tv_nsec;
+        deadline.tv_sec += pause / 1000000000;
+        deadline.tv_nsec = pause % 1000000000;
+
+        pthread_mutex_lock(&scanner_lock);
+        while (scanner_running && pthread_cond_timedwait(&scanner_wakeup, &scanner_lock, &deadline) != ETIMEDOUT)
+            ;
+    }
+    pthread_mutex_unlock(&scanner_lock);
+
+    return NULL;
+}
+
+/**
+ * @brief Starts the thread checking the canaries of the blocks in use in the background.
+ * Nothing is done if it already runs.
+ *
+ * @param budget The percentage of a CPU the thread may use, from 1 to 100.
+ * @return 0 on success, -1 if the thread can't be created.
+ */
+int start_heap_scanner(unsigned int budget)
+{
+    if (budget == 0)
+        return -1;
+
+    pthread_mutex_lock(&scanner_lock);
+    if (scanner_running)
+    {
+        pthread_mutex_unlock(&scanner_lock);
+        return 0;
+    }
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&scanner_wakeup, &attr);
+    pthread_condattr_destroy(&attr);
+
+    scanner_budget = budget > 100 ? 100 : budget;
+    scanner_running = 1;
+    if (pthread_create(&scanner_thread, NULL, run_heap_scanner, NULL) != 0)
+    {
+        scanner_running = 0;
+        pthread_cond_destroy(&scanner_wakeup);
+        pthread_mutex_unlock(&scanner_lock);
+        LOG_ERROR("start_heap_scanner - can't create the scanner thread");
+        return -1;
+    }
+    pthread_mutex_unlock(&scanner_lock);
+
+    LOG_INFO("start_heap_scanner - Checking the heap with %u%% of a CPU", scanner_budget);
+
+    return 0;
+}
+
+/**
+ * @brief Stops the heap scanner and waits for its thread to end.
+ */
+void stop_heap_scanner(void)
+{
+    pthread_mutex_lock(&scanner_lock);
+    if (!scanner_running)
+    {
+        pthread_mutex_unlock(&scanner_lock);
+        return;
+    }
+
+    scanner_running = 0;
+    pthread_cond_signal(&scanner_wakeup);
+    pthread_mutex_unlock(&scanner_lock);
+
+    pthread_join(scanner_thread, NULL);
+    pthread_cond_destroy(&scanner_wakeup);
+}
+
+/**
+ * @brief Hands a fault out of the guarded pool to the handler installed before ours.
+ * The handler of the guarded pool stays installed, so a fault the application recovers
+ * from doesn't turn the detection off.
+ */
+static void forward_fault(int sig, siginfo_t *info, void *context)
+{
+    if (guard_previous_action.sa_flags & SA_SIGINFO)
+    {
+        guard_previous_action.sa_sigaction(sig, info, context);
+        return;
+    }
+
+    // A fault can't be ignored, the kernel kills the process as with the default action
+    if (guard_previous_action.sa_handler != SIG_DFL && guard_previous_action.sa_handler != SIG_IGN)
+    {
+        guard_previous_action.sa_handler(sig);
+        return;
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = SIG_DFL;
+    sigemptyset(&action.sa_mask);
+    sigaction(sig, &action, NULL);
+
+    // Returning runs the faulting instruction again, a signal sent by a process has to be raised again
+    if (info->si_code <= 0)
+        raise(sig);
+}
+
+/**
+ * @brief Reports a fault in the guarded pool, then gives the fault back to the previous handler.
+ * A fault in a freed page is a use after free, one in a guard page an overflow of the block
+ * before it, or an underflow of the block after it.
+ * The handler may interrupt the allocator or the logging, so the report is written straight
+ * to the log file. Returning runs the faulting instruction again, which now reaches the
+ * previous handler.
+ */
+static void handle_guard_fault(int sig, siginfo_t *info, void *context)
+{
+    uint8_t *addr = info->si_addr;
+    if (!in_guard_range(addr))
+    {
+        forward_fault(sig, info, context);
+        return;
+    }
+
+    int saved_errno = errno;
+
+    size_t page = (size_t)(addr - guard_pool) / PAGE_SIZE;
+    guard_slot_t *slot = page % 2 ? &guard_slots[page / 2] : NULL;
+    const char *fault = "use after free";
+
+    if (slot == NULL && page > 0 && guard_slots[page / 2 - 1].state != GUARD_SLOT_EMPTY)
+    {
+        slot = &guard_slots[page / 2 - 1];
+        fault = "overflow";
+    }
+    else if (slot == NULL && page / 2 < GUARD_SLOT_COUNT && guard_slots[page / 2].state != GUARD_SLOT_EMPTY)
+    {
+        slot = &guard_slots[page / 2];
+        fault = "underflow";
+    }
+
+    if (slot != NULL && slot->state != GUARD_SLOT_EMPTY)
+        log_signal_safe(LOG_TYPE_ERROR, "handle_guard_fault - %s at %p of the block at %p of size %zu", fault, (void *)addr, slot->data, slot->size);
+    else
+        log_signal_safe(LOG_TYPE_ERROR, "handle_guard_fault - access to the unused guarded page at %p", (void *)addr);
+
+    sigaction(SIGSEGV, &guard_previous_action, NULL);
+    errno = saved_errno;
+}
+
+/**
+ * @brief Reserves the guarded pool and installs its fault handler.
+ * Every page of the pool starts protected, a page is only opened for the block it holds.
+ *
+ * @param sample One allocation in @sample is guarded.
+ * @return 0 on success, -1 if the pool can't be reserved or the handler installed.
+ */
+int init_guard_pool(unsigned int sample)
+{
+    size_t size = (2 * GUARD_SLOT_COUNT + 1) * PAGE_SIZE;
+    void *pool = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+    if (pool == MAP_FAILED)
+        return -1;
+    COUNT_HEAP_EVENT(mmap_calls);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = handle_guard_fault;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGSEGV, &action, &guard_previous_action) == -1)
+    {
+        munmap(pool, size);
+        COUNT_HEAP_EVENT(munmap_calls);
+        return -1;
+    }
+
+    memset(guard_slots, 0, sizeof(guard_slots));
+    guard_next = 0;
+    __atomic_store_n(&guard_pool, (uint8_t *)pool, __ATOMIC_RELEASE);
+    __atomic_store_n(&guard_sample, sample, __ATOMIC_RELEASE);
+
+    LOG_INFO("init_guard_pool - Guarding one allocation in %u", sample);
+
+    return 0;
+}
+
+/**
+ * @brief Tells whether an address is in the guarded pool, guard pages included.
+ *
+ * @param ptr The address to check.
+ * @return 1 if the address is in the guarded pool, 0 otherwise.
+ */
+int in_guard_range(const void *ptr)
+{
+    const uint8_t *start = __atomic_load_n(&guard_pool, __ATOMIC_ACQUIRE);
+
+    return start != NULL && (const uint8_t *)ptr >= start && (const uint8_t *)ptr < start + (2 * GUARD_SLOT_COUNT + 1) * PAGE_SIZE;
+}
+
+/**
+ * @brief Returns the slot of a block of the guarded pool.
+ *
+ * @param ptr The address of the block, it must be in the guarded pool.
+ * @return A pointer to the slot, or NULL if @ptr is not in a page of a slot.
+ */
+static guard_slot_t *get_guard_slot(const void *ptr)
+{
+    size_t page = (size_t)((const uint8_t *)ptr - guard_pool) / PAGE_SIZE;
+
+    return page % 2 ? &guard_slots[page / 2] : NULL;
+}
+
+/**
+ * @brief Allocates a block in its own page of the guarded pool.
+ * The block ends at the end of the page, so an overflow past its CHUNK_ALIGNMENT padding
+ * faults on the next guard page. Freed pages are reused last, to catch use after free for longer.
+ *
+ * @param size The size of the block, at most PAGE_SIZE.
+ * @return A pointer to the block, or NULL if every page is in use.
+ */
+void *allocate_guarded(size_t size)
+{
+    pthread_mutex_lock(&guard_lock);
+
+    for (unsigned int n = 0; n < GUARD_SLOT_COUNT; n++)
+    {
+        unsigned int i = (guard_next + n) % GUARD_SLOT_COUNT;
+        guard_slot_t *slot = &guard_slots[i];
+        if (slot->state == GUARD_SLOT_USED)
+            continue;
+
+        uint8_t *page = guard_pool + (2 * i + 1) * PAGE_SIZE;
+        if (mprotect(page, PAGE_SIZE, PROT_READ | PROT_WRITE) == -1)
+            break;
+
+        slot->data = page + PAGE_SIZE - ALIGN_CHUNK_SIZE(size);
+        slot->size = size;
+        slot->state = GUARD_SLOT_USED;
+        guard_next = (i + 1) % GUARD_SLOT_COUNT;
+
+        pthread_mutex_unlock(&guard_lock);
+
+        LOG_INFO("allocate_guarded - Guarded block of size %zu at %p", size, slot->data);
+
+        return slot->data;
+    }
+
+    pthread_mutex_unlock(&guard_lock);
+
+    return NULL;
+}
+
+/**
+ * @brief Frees a block of the guarded pool.
+ * Its page is given back to the system and protected, so any later access faults.
+ *
+ * @param ptr A pointer to the block.
+ * @param size The size of the block given by the caller, 0 if it is unknown.
+ */
+void free_guarded(void *ptr, size_t size)
+{
+    pthread_mutex_lock(&guard_lock);
+
+    guard_slot_t *slot = get_guard_slot(ptr);
+    if (slot == NULL || slot->data != ptr || slot->state != GUARD_SLOT_USED)
+    {
+        pthread_mutex_unlock(&guard_lock);
+        LOG_WARN("free_guarded - double free or invalid pointer %p", ptr);
+        return;
+    }
+
+    if (size > ALIGN_CHUNK_SIZE(slot->size))
+        LOG_ERROR("free_guarded - size %zu is bigger than the block at %p", size, ptr);
+
+    // The page reads as zero when it is reused
+    uint8_t *page = (uint8_t *)((uintptr_t)ptr & ~(uintptr_t)(PAGE_SIZE - 1));
+    madvise(page, PAGE_SIZE, MADV_DONTNEED);
+    mprotect(page, PAGE_SIZE, PROT_NONE);
+    slot->state = GUARD_SLOT_FREED;
+
+    pthread_mutex_unlock(&guard_lock);
+}
+
+/**
+ * @brief Returns the usable size of a block of the guarded pool.
+ *
+ * @param ptr A pointer to the block.
+ * @return The size of the block rounded up to CHUNK_ALIGNMENT, or 0 if it is not a block in use.
+ */
+size_t get_guarded_size(void *ptr)
+{
+    pthread_mutex_lock(&guard_lock);
+
+    guard_slot_t *slot = get_guard_slot(ptr);
+    size_t size = slot != NULL && slot->data == ptr && slot->state == GUARD_SLOT_USED ? ALIGN_CHUNK_SIZE(slot->size) : 0;
+
+    pthread_mutex_unlock(&guard_lock);
+
+    return size;
+}
+
+/**
+ * @brief Moves a block of the guarded pool to a new block of the requested size.
+ *
+ * @param ptr A pointer to the block.
+ * @param size The new size.
+ * @return A pointer to the new block, or NULL if @ptr is not a block in use or allocation fails.
+ */
+void *reallocate_guarded(void *ptr, size_t size)
+{
+    size_t old_size = get_guarded_size(ptr);
+    if (old_size == 0)
+    {
+        trace_event(TRACE_REALLOC, ptr, NULL, size);
+        LOG_WARN("reallocate_guarded - block at %p is not in use", ptr);
+        return NULL;
+    }
+
+    void *new = my_malloc(size);
+    trace_event(TRACE_REALLOC, ptr, new, size);
+    if (new == NULL)
+        return NULL;
+
+    memcpy(new, ptr, size < old_size ? size : old_size);
+    free_guarded(ptr, 0);
+
+    return new;
+}
+
+/**
+ * @brief Maps the quarantine, freed blocks are held in it from now on.
+ *
+ * @param max_size The number of bytes of blocks the quarantine holds at most.
+ * @param max_count The number of blocks the quarantine holds at most, up to QUARANTINE_MAX_COUNT.
+ * @return 0 on success, -1 if the quarantine can't be mapped.
+ */
+int init_quarantine(size_t max_size, size_t max_count)
+{
+    if (max_count > QUARANTINE_MAX_COUNT)
+        max_count = QUARANTINE_MAX_COUNT;
+
+    quarantine_entry_t *ring = init_pool(NULL, max_count * sizeof(quarantine_entry_t));
+    if (ring == NULL)
+        return -1;
+
+    pthread_mutex_lock(&quarantine_lock);
+    quarantine_ring = ring;
+    quarantine_head = 0;
+    quarantine_count = 0;
+    quarantine_size = 0;
+    quarantine_max_size = max_size;
+    __atomic_store_n(&quarantine_max_count, max_count, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&quarantine_lock);
+
+    LOG_INFO("init_quarantine - Holding up to %zu freed blocks and %zu bytes", max_count, max_size);
+
+    return 0;
+}
+
+/**
+ * @brief Checks that a quarantined block still holds the poison it was filled with.
+ * Blocks of 64 bytes are compared without branches, so that the compiler vectorizes
+ * the comparison, and only a block with a difference is searched.
+ *
+ * @param data The address of the block.
+ * @param size The number of poisoned bytes.
+ * @return The offset of the first byte which differs, or @size if the poison is intact.
+ */
+size_t check_poison(const uint8_t *data, size_t size)
+{
+    const uint64_t pattern = 0x0101010101010101ULL * QUARANTINE_POISON;
+
+    size_t i = 0;
+    for (; i + 64 <= size; i += 64)
+    {
+        uint64_t diff = 0;
+        for (unsigned int j = 0; j < 8; j++)
+        {
+            uint64_t word;
+            memcpy(&word, data + i + j * sizeof(uint64_t), sizeof(uint64_t));
+            diff |= word ^ pattern;
+        }
+
+        if (diff != 0)
+            break;
+    }
+
+    for (; i < size; i++)
+        if (data[i] != QUARANTINE_POISON)
+            return i;
+
+    return size;
+}
+
+/**
+ * @brief Gives a block leaving the quarantine back to the heap.
+ * The poison and the canary are checked first: a block written after it was freed is reported.
+ *
+ * @param entry The block leaving the quarantine.
+ */
+static void recycle_quarantined(const quarantine_entry_t *entry)
+{
+    size_t offset = check_poison(entry->data, entry->size);
+    if (offset != entry->size)
+    {
+        COUNT_HEAP_EVENT(poison_failures);
+        LOG_ERROR("recycle_quarantined - block at %p of size %zu written at offset %zu after it was freed", entry->data, entry->size, offset);
+    }
+
+    if (in_slab_range(entry->data))
+    {
+        slab_t *slab = get_slab(entry->data);
+        arena_t *arena = slab->arena;
+        pthread_mutex_lock(&arena->lock);
+
+        unsigned int slot = ((uint8_t *)entry->data - get_slab_data(slab)) / slab->slot_size;
+        check_slot_canary(slab, slot);
+        slab->quarantine_map[slot / 64] &= ~((uint64_t)1 << (slot % 64));
+        release_slot(slab, slot);
+
+        pthread_mutex_unlock(&arena->lock);
+        return;
+    }
+
+    chunk_list_t *chunk = lookup_chunk(entry->data);
+    if (chunk == NULL)
+        chunk = get_chunk(entry->data);
+
+    check_canary_integrity(chunk);
+
+    arena_t *arena = get_chunk_arena(chunk);
+    pthread_mutex_lock(&arena->lock);
+    release_chunk(chunk);
+    pthread_mutex_unlock(&arena->lock);
+}
+
+/**
+ * @brief Puts a freed block in the batch of the calling thread on its way to the quarantine.
+ * The block is checked as it would be on free, then filled with QUARANTINE_POISON.
+ * Blocks with their own mapping are not quarantined, their pages are given back on free.
+ *
+ * @param ptr A pointer to the freed block.
+ * @param size The size of the allocation given by the caller, 0 if it is unknown.
+ * @return 0 if the block was taken care of, -1 if it must be freed right away.
+ */
+int quarantine_block(void *ptr, size_t size)
+{
+    size_t poisoned = 0;
+
+    if (in_slab_range(ptr))
+    {
+        unsigned int slot;
+        slab_t *slab = lock_slot(ptr, &slot);
+        if (slab == NULL)
+        {
+            LOG_WARN("quarantine_block - invalid or double free of %p", ptr);
+            return 0;
+        }
+
+        check_slot_canary(slab, slot);
+        slab->quarantine_map[slot / 64] |= (uint64_t)1 << (slot % 64);
+        poisoned = slab->slot_size - sizeof(canary_t);
+
+        pthread_mutex_unlock(&slab->arena->lock);
+    }
+    else
+    {
+        chunk_list_t *chunk = lookup_chunk(ptr);
+        if (chunk == NULL)
+            chunk = get_chunk(ptr);
+
+        if (chunk == NULL || !in_heap_range(ptr))
+            return -1;
+
+        // Check double free, a cached, pending or quarantined chunk has already been freed too
+        if (!swap_chunk_state(chunk, USED, QUARANTINED))
+        {
+            LOG_WARN("quarantine_block - double free");
+            return 0;
+        }
+
+        check_canary_integrity(chunk);
+        poisoned = get_chunk_size(chunk);
+    }
+
+    if (size > poisoned)
+        LOG_ERROR("quarantine_block - size %zu is bigger than the block at %p", size, ptr);
+
+    memset(ptr, QUARANTINE_POISON, poisoned);
+
+    thread_cache.quarantine[thread_cache.quarantine_count].data = ptr;
+    thread_cache.quarantine[thread_cache.quarantine_count].size = poisoned;
+    if (++thread_cache.quarantine_count == QUARANTINE_BATCH_SIZE)
+        flush_quarantine_batch(&thread_cache);
+
+    // Arm the destructor giving the batch to the quarantine when the thread exits
+    if (!thread_cache.registered)
+    {
+        thread_cache.registered = 1;
+        pthread_setspecific(thread_cache_key, &thread_cache);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Takes the oldest block out of the quarantine.
+ * The quarantine lock must be held and the quarantine must not be empty.
+ *
+ * @return The oldest block.
+ */
+static quarantine_entry_t pop_quarantine(void)
+{
+    quarantine_entry_t entry = quarantine_ring[quarantine_head];
+
+    quarantine_head = (quarantine_head + 1) % quarantine_max_count;
+    quarantine_count--;
+    quarantine_size -= entry.size;
+
+    return entry;
+}
+
+/**
+ * @brief Moves the batch of freed blocks of a thread into the quarantine.
+ * The oldest blocks leave the quarantine while it holds more blocks or bytes than allowed,
+ * they are checked and recycled once the quarantine lock is released.
+ *
+ * @param cache The thread cache holding the batch.
+ */
+void flush_quarantine_batch(thread_cache_t *cache)
+{
+    quarantine_entry_t evicted[2 * QUARANTINE_BATCH_SIZE];
+    unsigned int next = 0;
+    unsigned int count;
+
+    do
+    {
+        count = 0;
+
+        pthread_mutex_lock(&quarantine_lock);
+        for (; next < cache->quarantine_count && count < QUARANTINE_BATCH_SIZE; next++)
+        {
+            if (quarantine_count == quarantine_max_count)
+                evicted[count++] = pop_quarantine();
+
+            quarantine_ring[(quarantine_head + quarantine_count) % quarantine_max_count] = cache->quarantine[next];
+            quarantine_count++;
+            quarantine_size += cache->quarantine[next].size;
+        }
+
+        while (quarantine_size > quarantine_max_size && count < 2 * QUARANTINE_BATCH_SIZE)
+            evicted[count++] = pop_quarantine();
+        pthread_mutex_unlock(&quarantine_lock);
+
+        for (unsigned int i = 0; i < count; i++)
+            recycle_quarantined(&evicted[i]);
+    } while (next < cache->quarantine_count || count == 2 * QUARANTINE_BATCH_SIZE);
+
+    cache->quarantine_count = 0;
+}
+
+/**
+ * @brief Checks and recycles every block of the quarantine and of the batch of the calling thread.
+ */
+void drain_quarantine(void)
+{
+    if (__atomic_load_n(&quarantine_max_count, __ATOMIC_ACQUIRE) == 0)
+        return;
+
+    flush_quarantine_batch(&thread_cache);
+
+    for (;;)
+    {
+        quarantine_entry_t evicted[2 * QUARANTINE_BATCH_SIZE];
+        unsigned int count = 0;
+
+        pthread_mutex_lock(&quarantine_lock);
+        while (quarantine_count > 0 && count < 2 * QUARANTINE_BATCH_SIZE)
+            evicted[count++] = pop_quarantine();
+        pthread_mutex_unlock(&quarantine_lock);
+
+        if (count == 0)
+            return;
+
+        for (unsigned int i = 0; i < count; i++)
+            recycle_quarantined(&evicted[i]);
+    }
+}
+
+/**
+ * @brief Takes a chunk of the requested size from the cache of the calling thread.
+ * No lock is taken: the chunk was owned by this thread since it was freed.
+ *
+ * @param size The requested size.
+ * @return A pointer to the chunk data, or NULL if no chunk of this size is cached.
+ */
+void *get_cached_chunk(size_t size)
+{
+    size = ALIGN_CHUNK_SIZE(size);
+    if (size > THREAD_CACHE_MAX_SIZE)
+        return NULL;
+
+    unsigned int bin = size / CHUNK_ALIGNMENT - 1;
+    chunk_list_t *chunk = thread_cache.bins[bin];
+    if (chunk == NULL)
+        return NULL;
+
+    thread_cache.bins[bin] = chunk->next_free;
+    thread_cache.counts[bin]--;
+    chunk->next_free = NULL;
+
+    // The canary is set before the chunk is seen in use by the heap scanner
+    set_chunk_canary(chunk);
+    set_chunk_state(chunk, USED);
+
+    LOG_INFO("get_cached_chunk - Reusing cached chunk of size %zu at address %p", size, chunk->data);
+
+    return chunk->data;
+}
+
+/**
+ * @brief Puts a freed chunk in the cache of the calling thread.
+ * The chunk is checked the same way as on the locked path: it must be in use
+ * and its canary must be intact.
+ *
+ * @param chunk The chunk being freed.
+ * @return 0 if the chunk was cached, -1 if the locked path must handle it.
+ */
+int put_cached_chunk(chunk_list_t *chunk)
+{
+    size_t size = get_chunk_size(chunk);
+    if (size == 0 || size > THREAD_CACHE_MAX_SIZE || size % CHUNK_ALIGNMENT != 0)
+        return -1;
+
+    unsigned int bin = size / CHUNK_ALIGNMENT - 1;
+    if (thread_cache.counts[bin] >= THREAD_CACHE_BIN_CAPACITY)
+        return -1;
+
+    // Only one of two racing frees of the same chunk can win
+    if (!swap_chunk_state(chunk, USED, CACHED))
+        return -1;
+
+    check_canary_integrity(chunk);
+
+    chunk->next_free = thread_cache.bins[bin];
+    thread_cache.bins[bin] = chunk;
+    thread_cache.counts[bin]++;
+
+    // Arm the destructor giving the chunks back when the thread exits
+    if (!thread_cache.registered)
+    {
+        thread_cache.registered = 1;
+        pthread_setspecific(thread_cache_key, &thread_cache);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Gives every chunk of a thread cache back to the heap.
+ * Used as the destructor of thread_cache_key when a thread exits. Chunks may belong
+ * to any arena, so they go through the remote free queues instead of taking locks.
+ *
+ * @param cache The thread cache to flush.
+ */
+void flush_thread_cache(void *cache)
+{
+    thread_cache_t *thread = cache;
+
+    for (unsigned int bin = 0; bin < THREAD_CACHE_BIN_COUNT; bin++)
+    {
+        chunk_list_t *chunk = thread->bins[bin];
+        while (chunk != NULL)
+        {
+            chunk_list_t *next = chunk->next_free;
+
+            // A cached chunk has already been checked, its canary is gone
+            set_chunk_state(chunk, PENDING);
+            queue_remote_free(chunk);
+
+            chunk = next;
+        }
+
+        thread->bins[bin] = NULL;
+        thread->counts[bin] = 0;
+    }
+
+    if (thread->quarantine_count > 0)
+        flush_quarantine_batch(thread);
+    thread->registered = 0;
+}
+
+/**
+ * @brief Frees a memory block which is not NULL.
+ * When the caller gives the size of the allocation, it is checked against the capacity
+ * recorded for the block: a bigger size means the caller and the heap disagree on the block.
+ *
+ * @param ptr A pointer to the memory block to be freed.
+ * @param size The size of the allocation given by the caller, 0 if it is unknown.
+ */
+static void free_block(void *ptr, size_t size)
+{
+    // Sampled allocations have their own page
+    if (in_guard_range(ptr))
+    {
+        free_guarded(ptr, size);
+        return;
+    }
+
+    // Freed blocks are held back by the quarantine, instead of being handed out again right away
+    if (quarantine_max_count != 0 && quarantine_block(ptr, size) == 0)
+        return;
+
+    // Small allocations are slots of the slabs
+    if (in_slab_range(ptr))
+    {
+        free_slot(ptr, size);
+        return;
+    }
+
+    chunk_list_t *chunk = lookup_chunk(ptr);
+    if (chunk == NULL)
+        chunk = get_chunk(ptr);
+
+    if (chunk == NULL)
+    {
+        LOG_WARN("free_block - chunk not found");
+        return;
+    }
+
+    if (size > get_chunk_size(chunk))
+        LOG_ERROR("free_block - size %zu is bigger than the chunk at %p", size, ptr);
+
+    // Chunks out of the reserved range have their own mapping
+    if (!in_heap_range(ptr))
+    {
+        free_large_chunk(chunk);
+        return;
+    }
+
+    // Fast path: keep the chunk in the thread cache
+    if (put_cached_chunk(chunk) == 0)
+        return;
+
+    // The chunk belongs to another arena, let its owner free it
+    arena_t *arena = get_chunk_arena(chunk);
+    if (arena != get_thread_arena())
+    {
+        if (push_remote_free(chunk) == -1)
+            LOG_WARN("free_block - double free");
+        return;
+    }
+
+    pthread_mutex_lock(&arena->lock);
+
+    // Check double free, a cached or pending chunk has already been freed too
+    if (!swap_chunk_state(chunk, USED, FREE))
+    {
+        pthread_mutex_unlock(&arena->lock);
+        LOG_WARN("free_block - double free");
+        return;
+    }
+
+    // Check canary integrity
+    check_canary_integrity(chunk);
+
+    // Free the chunk
+    release_chunk(chunk);
+    drain_remote_frees(arena);
+    purge_arena(arena, 0, 0);
+
+    pthread_mutex_unlock(&arena->lock);
+}
+
+/**
+ * @brief Frees a previously allocated memory block.
+ *
+ * This function marks the memory block pointed to by `ptr` as free. If the block is already free,
+ * an error message is logged. After marking the block as free, the function may perform block merging
+ * to optimize memory usage.
+ * Small blocks are kept in the cache of the calling thread without taking any lock, and blocks
+ * of another arena are pushed on its remote free queue.
+ *
+ * @param ptr A pointer to the memory block to be freed.
+ */
+void my_free(void *ptr)
+{
+    if (ptr == NULL)
+    {
+        LOG_WARN("my_free - null pointer given");
+        return;
+    }
+
+    free_block(ptr, 0);
+}
+
+/**
+ * @brief Frees a memory block whose size is known, following C23 free_sized.
+ * The size must be the one given to my_malloc, my_calloc or my_realloc.
+ *
+ * @param ptr A pointer to the memory block to be freed.
+ * @param size The size of the memory block.
+ */
+void my_free_sized(void *ptr, size_t size)
+{
+    if (ptr == NULL)
+        return;
+
+    free_block(ptr, size);
+}
+
+/**
+ * @brief Frees an aligned memory block whose size is known, following C23 free_aligned_sized.
+ * The alignment and the size must be the ones given to my_aligned_alloc.
+ *
+ * @param ptr A pointer to the memory block to be freed.
+ * @param alignment The alignment of the memory block.
+ * @param size The size of the memory block.
+ */
+void my_free_aligned_sized(void *ptr, size_t alignment, size_t size)
+{
+    if (ptr == NULL)
+        return;
+
+    if (alignment != 0 && (uintptr_t)ptr % alignment != 0)
+        LOG_ERROR("my_free_aligned_sized - %p is not aligned on %zu", ptr, alignment);
+
+    free_block(ptr, size);
+}
+
+/**
+ * @brief Returns the number of bytes of a memory block which can be used.
+ * It is the size recorded in the descriptor or the slot, rounded up to CHUNK_ALIGNMENT
+ * bytes and without the canary, so it can be bigger than the requested size.
+ *
+ * @param ptr A pointer to the memory block.
+ * @return The usable size of the block, or 0 if @ptr is NULL or not a block in use.
+ */
+size_t my_malloc_usable_size(void *ptr)
+{
+    if (ptr == NULL)
+        return 0;
+
+    if (in_guard_range(ptr))
+        return get_guarded_size(ptr);
+
+    if (in_slab_range(ptr))
+    {
+        unsigned int slot;
+        slab_t *slab = lock_slot(ptr, &slot);
+        if (slab == NULL)
+            return 0;
+
+        size_t size = slab->slot_size - sizeof(canary_t);
+        pthread_mutex_unlock(&slab->arena->lock);
+
+        return size;
+    }
+
+    chunk_list_t *chunk = lookup_chunk(ptr);
+    if (chunk == NULL)
+        chunk = get_chunk(ptr);
+
+    if (chunk == NULL || get_chunk_state(chunk) != USED)
+    {
+        LOG_WARN("my_malloc_usable_size - %p is not a block in use", ptr);
+        return 0;
+    }
+
+    return get_chunk_size(chunk);
+}
+
+/**
+ * @brief Allocates a chunk of the data pool of an arena, initializing the arena first if needed.
+ * The arena lock must be held.
+ *
+ * @param arena The arena to allocate in.
+ * @param size The size of the chunk to allocate.
+ * @param zero_start If not NULL, set to the start of the zero pages of the chunk, see get_free_chunk.
+ * @param zero_end If not NULL, set to the end of the zero pages of the chunk.
+ * @return A pointer to the allocated chunk, or NULL if allocation fails.
+ */
+static void *allocate_arena_chunk(arena_t *arena, size_t size, uint8_t **zero_start, uint8_t **zero_end)
+{
+    if (arena->head == NULL && init_arena(arena) == -1)
+    {
+        LOG_ERROR("allocate_arena_chunk - can't initialize arena");
+        return NULL;
+    }
+
+    // Chunks freed by other threads may fit the request
+    drain_remote_frees(arena);
+
+    // Allocate data block
+    void *ptr_data = get_free_chunk(arena, size, zero_start, zero_end);
+    purge_arena(arena, 0, 0);
+
+    return ptr_data;
+}
+
+/**
+ * @brief Allocates a block of memory of the given size using a secure memory allocation mechanism.
+ *
+ * @param size The size of the memory block to allocate.
+ * @return A pointer to the allocated memory block, or NULL if the
+ * allocation fails.
+ */
+void *my_malloc(size_t size)
+{
+    // Check if the size is less than or equal to 0
+    if (size <= 0)
+        return NULL; // FIXME: should return a freeable chunk
+
+    // One allocation in guard_sample gets its own page, right before a guard page
+    void *ptr_data = NULL;
+    if (guard_sample != 0 && size <= PAGE_SIZE && ++guard_counter >= guard_sample)
+    {
+        guard_counter = 0;
+        if ((ptr_data = allocate_guarded(size)) != NULL)
+            return ptr_data;
+    }
+
+    // Fast path: reuse a chunk recently freed by this thread
+    ptr_data = get_cached_chunk(size);
+    if (ptr_data != NULL)
+        return ptr_data;
+
+    // If the heap is not ready, we must initialize it
+    if (!__atomic_load_n(&heap_initialized, __ATOMIC_ACQUIRE) && init_heap() == NULL)
+    {
+        LOG_ERROR("my_malloc - can't initialize heap");
+        return NULL;
+    }
+
+    // Large allocations get their own mapping
+    if (size >= LARGE_CHUNK_THRESHOLD)
+    {
+        ptr_data = allocate_large_chunk(size, PAGE_SIZE);
+        if (ptr_data == NULL)
+            LOG_ERROR("my_malloc - can't allocate large chunk of size %zu", size);
+
+        return ptr_data;
+    }
+
+    arena_t *arena = get_thread_arena();
+    pthread_mutex_lock(&arena->lock);
+
+    // Small allocations are slots of the slabs, chunks are only used once no slab is left
+    if (size <= SLAB_MAX_SIZE && (ptr_data = allocate_slot(arena, size)) != NULL)
+    {
+        pthread_mutex_unlock(&arena->lock);
+        return ptr_data;
+    }
+
+    ptr_data = allocate_arena_chunk(arena, size, NULL, NULL);
+    pthread_mutex_unlock(&arena->lock);
+
+    if (ptr_data == NULL)
+    {
+        LOG_ERROR("my_malloc - can't allocate chunk of size %zu", size);
+        return NULL;
+    }
+
+    return ptr_data;
+}
+
+/**
+ * @brief Reallocates a memory block with a new size.
+ * The reallocation is traced here rather than in the wrapper: the old block can be handed
+ * out again as soon as it is released, its trace record must come first.
+ *
+ * @param ptr   Pointer to the memory block to be reallocated.
+ * @param size  New size for the memory block.
+ * @return      Pointer to the reallocated memory block, or NULL if the reallocation failed.
+ */
+void *my_realloc(void *ptr, size_t size)
+{
+    // If size is 0, equals to my_free(ptr) and returning NULL
+    if (size == 0)
+    {
+        LOG_INFO("my_realloc - null size given, freeing chunk at %p", ptr);
+
+        trace_event(TRACE_REALLOC, ptr, NULL, size);
+        my_free(ptr);
+        return NULL;
+    }
+
+    // If ptr is NULL, equals to my_malloc(size)
+    if (ptr == NULL)
+    {
+        LOG_INFO("my_realloc - null pointer given, allocating a new chunk");
+        void *new = my_malloc(size);
+        trace_event(TRACE_REALLOC, ptr, new, size);
+        return new;
+    }
+
+    // Sampled allocations move to a new block
+    if (in_guard_range(ptr))
+        return reallocate_guarded(ptr, size);
+
+    // Slots have a fixed size
+    if (in_slab_range(ptr))
+        return reallocate_slot(ptr, size);
+
+    // Retrieve the associated chunk from its address
+    chunk_list_t *chunk = get_chunk(ptr);
+
+    // If the chunk is not found, return NULL
+    if (chunk == NULL)
+    {
+        trace_event(TRACE_REALLOC, ptr, NULL, size);
+        return NULL;
+    }
+
+    // Chunks out of the reserved range have their own mapping
+    if (!in_heap_range(ptr))
+    {
+        if (get_chunk_state(chunk) != USED)
+        {
+            trace_event(TRACE_REALLOC, ptr, NULL, size);
+            LOG_WARN("my_realloc - chunk at %p is not in use", ptr);
+            return NULL;
+        }
+
+        if (size >= LARGE_CHUNK_THRESHOLD)
+            return reallocate_large_chunk(chunk, size);
+
+        // Below the threshold, the data moves back to the arenas
+        void *new = my_malloc(size);
+        trace_event(TRACE_REALLOC, ptr, new, size);
+        if (new == NULL)
+            return NULL;
+
+        memcpy(new, ptr, size < get_chunk_size(chunk) ? size : get_chunk_size(chunk));
+        my_free(ptr);
+        return new;
+    }
+
+    arena_t *arena = get_chunk_arena(chunk);
+    pthread_mutex_lock(&arena->lock);
+
+    if (get_chunk_state(chunk) != USED)
+    {
+        pthread_mutex_unlock(&arena->lock);
+        trace_event(TRACE_REALLOC, ptr, NULL, size);
+        LOG_WARN("my_realloc - chunk at %p is not in use", ptr);
+        return NULL;
+    }
+
+    // Check canary integrity before the chunk is resized
+    check_canary_integrity(chunk);
+
+    size_t aligned_size = ALIGN_CHUNK_SIZE(size);
+    size_t chunk_size = get_chunk_size(chunk);
+
+    // Grow in place into the next chunk if it is free and right after this one in memory
+    chunk_list_t *next = chunk->next;
+    if (aligned_size > chunk_size && next != NULL && get_chunk_state(next) == FREE && (uint8_t *)chunk->data + chunk_size + sizeof(canary_t) == next->data && chunk_size + sizeof(canary_t) + get_chunk_size(next) >= aligned_size)
+    {
+        remove_free_chunk(next);
+        unindex_chunk(next);
+
+        set_chunk_size(chunk, chunk_size + get_chunk_size(next) + sizeof(canary_t));
+        chunk->next = next->next;
+        if (next->next != NULL)
+            next->next->prev = chunk;
+        if (arena->tail == next)
+            arena->tail = chunk;
+
+        release_chunk_metadata(next);
+    }
+
+    // Give the unused tail back, the canary is re-written at the new end
+    if (aligned_size <= get_chunk_size(chunk))
+    {
+        trim_chunk(chunk, aligned_size);
+        set_chunk_canary(chunk);
+
+        pthread_mutex_unlock(&arena->lock);
+        trace_event(TRACE_REALLOC, ptr, ptr, size);
+        return ptr;
+    }
+
+    // The arena lock is released before my_malloc and my_free take it again
+    size_t old_size = get_chunk_size(chunk);
+    pthread_mutex_unlock(&arena->lock);
+
+    // Allocate a new memory block with the new size
+    void *new = my_malloc(size);
+    trace_event(TRACE_REALLOC, ptr, new, size);
+
+    // If the allocation failed, return NULL
+    if (new == NULL)
+    {
+        LOG_WARN("my_realloc - allocation failed");
+        return NULL;
+    }
+
+    // Copy the contents of the original memory block to the new memory block
+    memcpy(new, ptr, old_size);
+
+    // Free the original memory block
+    my_free(ptr);
+
+    // Return the pointer to the new memory block
+    return new;
+}
+
+/**
+ * @brief Allocates memory for an array of elements and initializes them to zero.
+ *
+ * This function allocates memory for an array of `nmemb` elements, each of size `size`,
+ * and initializes all the elements to zero. It is similar to the standard `calloc` function.
+ * Pages known to be zero are not written: large chunks are fresh mappings, and chunks of the
+ * data pools only have their bytes out of the pages never written or purged cleared.
+ *
+ * @param nmemb The number of elements to allocate memory for.
+ * @param size The size of each element in bytes.
+ * @return A pointer to the allocated memory, or `NULL` if the allocation fails.
+ */
+void *my_calloc(size_t nmemb, size_t size)
+{
+    size_t total = 0;
+    if (__builtin_mul_overflow(nmemb, size, &total))
+    {
+        LOG_ERROR("my_calloc - %zu elements of %zu bytes overflow", nmemb, size);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // Small blocks may come from the thread cache or the slabs, and large ones are fresh mappings
+    if (total <= THREAD_CACHE_MAX_SIZE || total >= LARGE_CHUNK_THRESHOLD)
+    {
+        void *ptr = my_malloc(total);
+        if (ptr == NULL)
+        {
+            LOG_ERROR("my_calloc - Can't get a chunk");
+            return NULL;
         }
 
-        return ptr;
+        if (total < LARGE_CHUNK_THRESHOLD)
+            memset(ptr, 0, total);
+
+        return ptr;
+    }
+
+    if (!__atomic_load_n(&heap_initialized, __ATOMIC_ACQUIRE) && init_heap() == NULL)
+    {
+        LOG_ERROR("my_calloc - can't initialize heap");
+        return NULL;
+    }
+
+    arena_t *arena = get_thread_arena();
+    uint8_t *zero_start = NULL;
+    uint8_t *zero_end = NULL;
+
+    pthread_mutex_lock(&arena->lock);
+    uint8_t *ptr = allocate_arena_chunk(arena, total, &zero_start, &zero_end);
+    pthread_mutex_unlock(&arena->lock);
+
+    if (ptr == NULL)
+    {
+        LOG_ERROR("my_calloc - Can't get a chunk");
+        return NULL;
+    }
+
+    // Only the part of the chunk out of its zero pages is cleared
+    uint8_t *end = ptr + total;
+    if (zero_start < ptr)
+        zero_start = ptr;
+    if (zero_end > end)
+        zero_end = end;
+
+    if (zero_start >= zero_end)
+        memset(ptr, 0, total);
+    else
+    {
+        memset(ptr, 0, zero_start - ptr);
+        memset(zero_end, 0, end - zero_end);
+    }
+
+    return ptr;
+}
+
+/**
+ * @brief Allocates a block of memory whose address is a multiple of the given alignment.
+ * As with glibc, an alignment which is not a power of two is rounded up to the next one.
+ * Small blocks are slots whose size is a multiple of the alignment, medium blocks are cut
+ * at an aligned address of a free chunk, and large blocks get an aligned mapping.
+ *
+ * @param alignment The alignment of the block.
+ * @param size The size of the memory block to allocate.
+ * @return A pointer to the allocated memory block, or NULL if the allocation fails.
+ */
+void *my_memalign(size_t alignment, size_t size)
+{
+    if (size == 0)
+        return NULL;
+
+    if (alignment > ((size_t)1 << (sizeof(size_t) * 8 - 2)))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    if (alignment < CHUNK_ALIGNMENT)
+        alignment = CHUNK_ALIGNMENT;
+    if ((alignment & (alignment - 1)) != 0)
+        alignment = (size_t)1 << (sizeof(size_t) * 8 - __builtin_clzl(alignment));
+
+    // If the heap is not ready, we must initialize it
+    if (!__atomic_load_n(&heap_initialized, __ATOMIC_ACQUIRE) && init_heap() == NULL)
+    {
+        LOG_ERROR("my_memalign - can't initialize heap");
+        return NULL;
+    }
+
+    // Large blocks, or blocks the alignment would make large, get their own mapping
+    if (size > SIZE_MAX - alignment || size + alignment >= LARGE_CHUNK_THRESHOLD)
+    {
+        void *ptr_data = allocate_large_chunk(size, alignment);
+        if (ptr_data == NULL)
+            LOG_ERROR("my_memalign - can't allocate large chunk of size %zu", size);
+
+        return ptr_data;
+    }
+
+    arena_t *arena = get_thread_arena();
+    pthread_mutex_lock(&arena->lock);
+
+    // Slabs are page aligned, so slots whose size is a multiple of the alignment are aligned
+    void *ptr_data = NULL;
+    size_t slot_size = (size + sizeof(canary_t) + alignment - 1) & ~(alignment - 1);
+    if (slot_size - sizeof(canary_t) <= SLAB_MAX_SIZE && (ptr_data = allocate_slot(arena, slot_size - sizeof(canary_t))) != NULL)
+    {
+        pthread_mutex_unlock(&arena->lock);
+        return ptr_data;
+    }
+
+    if (arena->head == NULL && init_arena(arena) == -1)
+    {
+        pthread_mutex_unlock(&arena->lock);
+        LOG_ERROR("my_memalign - can't initialize arena");
+        return NULL;
+    }
+
+    drain_remote_frees(arena);
+    ptr_data = get_aligned_free_chunk(arena, size, alignment);
+    purge_arena(arena, 0, 0);
+    pthread_mutex_unlock(&arena->lock);
+
+    if (ptr_data == NULL)
+        LOG_ERROR("my_memalign - can't allocate chunk of size %zu aligned on %zu", size, alignment);
+
+    return ptr_data;
+}
+
+/**
+ * @brief Allocates an aligned block of memory, following posix_memalign.
+ *
+ * @param memptr Set to the allocated block, or to NULL when @size is 0.
+ * @param alignment The alignment, a power of two multiple of sizeof(void *).
+ * @param size The size of the memory block to allocate.
+ * @return 0 on success, EINVAL if the alignment is invalid, ENOMEM if the allocation fails.
+ */
+int my_posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    if (alignment < sizeof(void *) || (alignment & (alignment - 1)) != 0)
+        return EINVAL;
+
+    if (size == 0)
+    {
+        *memptr = NULL;
+        return 0;
+    }
+
+    void *ptr = my_memalign(alignment, size);
+    if (ptr == NULL)
+        return ENOMEM;
+
+    *memptr = ptr;
+
+    return 0;
+}
+
+/**
+ * @brief Allocates an aligned block of memory, following C11 aligned_alloc.
+ *
+ * @param alignment The alignment, a power of two.
+ * @param size The size of the memory block to allocate.
+ * @return A pointer to the allocated memory block, or NULL with errno set to EINVAL
+ * if the alignment is invalid.
+ */
+void *my_aligned_alloc(size_t alignment, size_t size)
+{
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    return my_memalign(alignment, size);
+}
+
+/**
+ * @brief Allocates a page aligned block of memory.
+ *
+ * @param size The size of the memory block to allocate.
+ * @return A pointer to the allocated memory block, or NULL if the allocation fails.
+ */
+void *my_valloc(size_t size)
+{
+    return my_memalign(PAGE_SIZE, size);
+}
+
+/**
+ * @brief Allocates a page aligned block of memory, its size rounded up to whole pages.
+ *
+ * @param size The size of the memory block to allocate, 0 gives one page.
+ * @return A pointer to the allocated memory block, or NULL if the allocation fails.
+ */
+void *my_pvalloc(size_t size)
+{
+    if (size > SIZE_MAX - PAGE_SIZE)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    size_t pages_size = size == 0 ? PAGE_SIZE : (size + PAGE_SIZE - 1) & ~((size_t)PAGE_SIZE - 1);
 
-        // Ensure the next chunk is on the same page
-        // if ((uint8_t *)chunk->data + chunk->size + sizeof(canary_t) == chunk->next->data)
+    return my_memalign(PAGE_SIZE, pages_size);
+}
+
+/**
+ * @brief Gives the free pages of the heap back to the system right away.
+ * The cache of the calling thread is flushed first, and the decay time of the
+ * arenas is ignored. As with glibc, @pad bytes are kept at the end of the data pools.
+ *
+ * @param pad The number of free bytes kept committed at the end of each arena.
+ * @return 1 if memory was given back to the system, 0 otherwise.
+ */
+int my_malloc_trim(size_t pad)
+{
+    if (!__atomic_load_n(&heap_initialized, __ATOMIC_ACQUIRE))
+        return 0;
+
+    if (thread_cache.registered)
+        flush_thread_cache(&thread_cache);
+
+    size_t purged = 0;
+    for (unsigned int i = 0; i < arena_count; i++)
+    {
+        pthread_mutex_lock(&arenas[i].lock);
+        drain_remote_frees(&arenas[i]);
+        purged += purge_arena(&arenas[i], 1, pad);
+        pthread_mutex_unlock(&arenas[i].lock);
     }
 
-    // Allocate a new memory block with the new size
-    void *new = my_malloc(size);
+    LOG_INFO("my_malloc_trim - %zu bytes given back to the system", purged);
 
-    // If the allocation failed, return NULL
-    if (new == NULL)
+    return purged > 0;
+}
+
+/**
+ * @brief Takes a snapshot of the counters of the heap.
+ * Arenas are locked one after the other, so the snapshot of each arena is consistent
+ * but the arenas are not taken at the same time. The free bytes of each size class
+ * are summed from the dense bins. Chunks held by the thread caches or waiting in the
+ * remote free queues are counted as in use, as glibc does with its tcache.
+ *
+ * @param stats Set to the snapshot.
+ */
+void get_heap_stats(heap_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->arena_count = __atomic_load_n(&arena_count, __ATOMIC_ACQUIRE);
+
+    for (unsigned int i = 0; i < stats->arena_count; i++)
     {
-        LOG_WARN("my_realloc - allocation failed");
-        return NULL;
+        arena_t *arena = &arenas[i];
+        arena_stats_t *arena_stats = &stats->arenas[i];
+        pthread_mutex_lock(&arena->lock);
+
+        arena_stats->data_size = arena->data_end - arena->data_start;
+        for (uint64_t bins = arena->free_bins_map; bins != 0; bins &= bins - 1)
+        {
+            unsigned int class = __builtin_ctzll(bins);
+            const uint32_t *sizes = arena->free_sizes[class];
+            chunk_list_t **chunks = arena->free_chunks[class];
+
+            for (uint32_t slot = 0; slot < arena->free_counts[class]; slot++)
+            {
+                size_t size = sizes[slot] == UINT32_MAX ? get_chunk_size(chunks[slot]) : sizes[slot];
+                arena_stats->free_sizes[class] += size + sizeof(canary_t);
+            }
+            arena_stats->free_counts[class] = arena->free_counts[class];
+            arena_stats->free_count += arena->free_counts[class];
+            arena_stats->free_size += arena_stats->free_sizes[class];
+        }
+
+        for (metadata_block_t *block = arena->metadata; block != NULL; block = block->next)
+            arena_stats->metadata_size += block->size;
+
+        if (arena->tail != NULL && get_chunk_state(arena->tail) == FREE)
+            arena_stats->keep_size = get_chunk_size(arena->tail) + sizeof(canary_t);
+
+        arena_stats->slabs_size = arena->slabs_size;
+        arena_stats->slots_size = arena->slots_size;
+        arena_stats->large_count = arena->large_count;
+        arena_stats->large_size = arena->large_size;
+
+        pthread_mutex_unlock(&arena->lock);
     }
 
-    // Copy the contents of the original memory block to the new memory block
-    memcpy(new, ptr, chunk->size);
+    stats->counters.mmap_calls = __atomic_load_n(&heap_counters.mmap_calls, __ATOMIC_RELAXED);
+    stats->counters.munmap_calls = __atomic_load_n(&heap_counters.munmap_calls, __ATOMIC_RELAXED);
+    stats->counters.mremap_calls = __atomic_load_n(&heap_counters.mremap_calls, __ATOMIC_RELAXED);
+    stats->counters.canary_failures = __atomic_load_n(&heap_counters.canary_failures, __ATOMIC_RELAXED);
+    stats->counters.poison_failures = __atomic_load_n(&heap_counters.poison_failures, __ATOMIC_RELAXED);
+}
 
-    // Free the original memory block
-    my_free(ptr);
+/**
+ * @brief Computes the bytes in use in the data pool and the slabs of an arena, canaries included.
+ * Chunks with their own mapping are not counted.
+ *
+ * @param stats The snapshot of the arena.
+ * @return The number of bytes in use.
+ */
+size_t get_arena_used_size(const arena_stats_t *stats)
+{
+    return stats->data_size - stats->free_size + stats->slots_size;
+}
 
-    // Return the pointer to the new memory block
-    return new;
+/**
+ * @brief Computes the bounds of the sizes of a size class.
+ *
+ * @param class The size class.
+ * @param from Set to the smallest size of the class.
+ * @param to Set to the biggest size of the class.
+ */
+static void get_size_class_bounds(unsigned int class, size_t *from, size_t *to)
+{
+    if (class == 0)
+    {
+        *from = 0;
+        *to = ((size_t)1 << BIN_MIN_SHIFT) - 1;
+        return;
+    }
+
+    unsigned int msb = BIN_MIN_SHIFT + (class - 1) / BIN_SUBDIVISIONS;
+    unsigned int sub = (class - 1) % BIN_SUBDIVISIONS;
+    *from = ((size_t)1 << msb) + ((size_t)sub << (msb - BIN_SUBDIVISION_BITS));
+    *to = class == BIN_COUNT - 1 ? SIZE_MAX : *from + ((size_t)1 << (msb - BIN_SUBDIVISION_BITS)) - 1;
 }
 
 /**
- * @brief Allocates memory for an array of elements and initializes them to zero.
+ * @brief Returns the statistics of the heap in the layout of glibc's mallinfo2.
+ * arena is the committed size of the data pools and the slabs, ordblks the number of
+ * free chunks, hblks and hblkhd the chunks with their own mapping, uordblks and fordblks
+ * the bytes in use and free in the data pools and the slabs, keepcost the free bytes at
+ * the end of the data pools. The fastbin fields are always 0.
  *
- * This function allocates memory for an array of `nmemb` elements, each of size `size`,
- * and initializes all the elements to zero. It is similar to the standard `calloc` function.
+ * @return The statistics of the heap.
+ */
+struct mallinfo2 my_mallinfo2(void)
+{
+    struct mallinfo2 info;
+    memset(&info, 0, sizeof(info));
+
+    if (!__atomic_load_n(&heap_initialized, __ATOMIC_ACQUIRE))
+        return info;
+
+    heap_stats_t stats;
+    get_heap_stats(&stats);
+
+    for (unsigned int i = 0; i < stats.arena_count; i++)
+    {
+        const arena_stats_t *arena_stats = &stats.arenas[i];
+
+        info.arena += arena_stats->data_size + arena_stats->slabs_size;
+        info.ordblks += arena_stats->free_count;
+        info.hblks += arena_stats->large_count;
+        info.hblkhd += arena_stats->large_size;
+        info.uordblks += get_arena_used_size(arena_stats);
+        info.fordblks += arena_stats->free_size + arena_stats->slabs_size - arena_stats->slots_size;
+        info.keepcost += arena_stats->keep_size;
+    }
+
+    return info;
+}
+
+/**
+ * @brief Prints the statistics of the heap on the standard error, in the format of glibc's
+ * malloc_stats, followed by the syscall and canary failure counters.
+ * The output is written with dprintf so that no buffer is allocated.
+ */
+void my_malloc_stats(void)
+{
+    heap_stats_t stats;
+    memset(&stats, 0, sizeof(stats));
+
+    if (__atomic_load_n(&heap_initialized, __ATOMIC_ACQUIRE))
+        get_heap_stats(&stats);
+
+    size_t system_size = 0;
+    size_t used_size = 0;
+    size_t large_count = 0;
+    size_t large_size = 0;
+
+    for (unsigned int i = 0; i < stats.arena_count; i++)
+    {
+        const arena_stats_t *arena_stats = &stats.arenas[i];
+        size_t arena_system_size = arena_stats->data_size + arena_stats->slabs_size;
+        size_t arena_used_size = get_arena_used_size(arena_stats);
+
+        dprintf(STDERR_FILENO, "Arena %u:\n", i);
+        dprintf(STDERR_FILENO, "system bytes     = %10zu\n", arena_system_size);
+        dprintf(STDERR_FILENO, "in use bytes     = %10zu\n", arena_used_size);
+
+        system_size += arena_system_size;
+        used_size += arena_used_size;
+        large_count += arena_stats->large_count;
+        large_size += arena_stats->large_size;
+    }
+
+    dprintf(STDERR_FILENO, "Total (incl. mmap):\n");
+    dprintf(STDERR_FILENO, "system bytes     = %10zu\n", system_size + large_size);
+    dprintf(STDERR_FILENO, "in use bytes     = %10zu\n", used_size + large_size);
+    dprintf(STDERR_FILENO, "mmap regions     = %10zu\n", large_count);
+    dprintf(STDERR_FILENO, "mmap bytes       = %10zu\n", large_size);
+    dprintf(STDERR_FILENO, "mmap calls       = %10zu\n", stats.counters.mmap_calls);
+    dprintf(STDERR_FILENO, "munmap calls     = %10zu\n", stats.counters.munmap_calls);
+    dprintf(STDERR_FILENO, "mremap calls     = %10zu\n", stats.counters.mremap_calls);
+    dprintf(STDERR_FILENO, "canary failures  = %10zu\n", stats.counters.canary_failures);
+    dprintf(STDERR_FILENO, "poison failures  = %10zu\n", stats.counters.poison_failures);
+}
+
+/**
+ * @brief Writes the statistics of an arena as XML, in the layout of glibc's malloc_info.
  *
- * @param nmemb The number of elements to allocate memory for.
- * @param size The size of each element in bytes.
- * @return A pointer to the allocated memory, or `NULL` if the allocation fails.
+ * @param fp The stream to write to.
+ * @param nr The number of the arena.
+ * @param stats The snapshot of the arena.
  */
-void *my_calloc(size_t nmemb, size_t size)
+static void write_arena_xml(FILE *fp, unsigned int nr, const arena_stats_t *stats)
 {
-    void *ptr = my_malloc(nmemb * size);
-    if (ptr == NULL)
+    fprintf(fp, "<heap nr=\"%u\">\n<sizes>\n", nr);
+    for (unsigned int class = 0; class < BIN_COUNT; class++)
     {
-        LOG_ERROR("my_calloc - Can't get a chunk");
-        return NULL;
+        if (stats->free_counts[class] == 0)
+            continue;
+
+        size_t from, to;
+        get_size_class_bounds(class, &from, &to);
+        fprintf(fp, "  <size from=\"%zu\" to=\"%zu\" total=\"%zu\" count=\"%zu\"/>\n",
+                from, to, stats->free_sizes[class], stats->free_counts[class]);
     }
-    memset(ptr, 0, nmemb * size);
+    fprintf(fp, "</sizes>\n");
+    fprintf(fp, "<total type=\"rest\" count=\"%zu\" size=\"%zu\"/>\n", stats->free_count, stats->free_size);
+    fprintf(fp, "<total type=\"slabs\" size=\"%zu\" used=\"%zu\"/>\n", stats->slabs_size, stats->slots_size);
+    fprintf(fp, "<total type=\"mmap\" count=\"%zu\" size=\"%zu\"/>\n", stats->large_count, stats->large_size);
+    fprintf(fp, "<system type=\"current\" size=\"%zu\"/>\n", stats->data_size + stats->slabs_size);
+    fprintf(fp, "<system type=\"used\" size=\"%zu\"/>\n", get_arena_used_size(stats));
+    fprintf(fp, "<aspace type=\"metadata\" size=\"%zu\"/>\n", stats->metadata_size);
+    fprintf(fp, "</heap>\n");
+}
 
-    return ptr;
+/**
+ * @brief Writes the statistics of an arena as a JSON object.
+ *
+ * @param fp The stream to write to.
+ * @param nr The number of the arena.
+ * @param stats The snapshot of the arena.
+ */
+static void write_arena_json(FILE *fp, unsigned int nr, const arena_stats_t *stats)
+{
+    fprintf(fp, "{\"nr\":%u,\"sizes\":[", nr);
+    const char *separator = "";
+    for (unsigned int class = 0; class < BIN_COUNT; class++)
+    {
+        if (stats->free_counts[class] == 0)
+            continue;
+
+        size_t from, to;
+        get_size_class_bounds(class, &from, &to);
+        fprintf(fp, "%s{\"from\":%zu,\"to\":%zu,\"total\":%zu,\"count\":%zu}",
+                separator, from, to, stats->free_sizes[class], stats->free_counts[class]);
+        separator = ",";
+    }
+    fprintf(fp, "],\"free\":{\"count\":%zu,\"size\":%zu}", stats->free_count, stats->free_size);
+    fprintf(fp, ",\"slabs\":{\"size\":%zu,\"used\":%zu}", stats->slabs_size, stats->slots_size);
+    fprintf(fp, ",\"mmap\":{\"count\":%zu,\"size\":%zu}", stats->large_count, stats->large_size);
+    fprintf(fp, ",\"system\":%zu,\"used\":%zu,\"metadata\":%zu}",
+            stats->data_size + stats->slabs_size, get_arena_used_size(stats), stats->metadata_size);
 }
 
 /**
- * @brief Verifies if all allocated memory blocks have been freed and logs any leaks.
+ * @brief Writes the statistics of the heap to a stream.
+ * With options 0 the output is XML in the layout of glibc's malloc_info: the free chunks
+ * of each arena by size class, then the totals. With MALLOC_INFO_JSON the same statistics
+ * are written as a JSON object. The heap is snapshot first, so no lock is held while writing.
  *
- * Free any lasting allocated chunk.
+ * @param options 0 for XML, MALLOC_INFO_JSON for JSON.
+ * @param fp The stream to write to.
+ * @return 0 on success, -1 with errno set to EINVAL if @options is unknown.
  */
-void check_memory_leaks()
+int my_malloc_info(int options, FILE *fp)
 {
-    chunk_list_t *current = cl_metadata_head;
-    while (current != NULL)
+    if ((options != 0 && options != MALLOC_INFO_JSON) || fp == NULL)
     {
-        if (current->state == FREE)
+        errno = EINVAL;
+        return -1;
+    }
+
+    heap_stats_t stats;
+    memset(&stats, 0, sizeof(stats));
+
+    if (__atomic_load_n(&heap_initialized, __ATOMIC_ACQUIRE))
+        get_heap_stats(&stats);
+
+    arena_stats_t total;
+    memset(&total, 0, sizeof(total));
+    for (unsigned int i = 0; i < stats.arena_count; i++)
+    {
+        total.free_count += stats.arenas[i].free_count;
+        total.free_size += stats.arenas[i].free_size;
+        total.data_size += stats.arenas[i].data_size;
+        total.slabs_size += stats.arenas[i].slabs_size;
+        total.slots_size += stats.arenas[i].slots_size;
+        total.large_count += stats.arenas[i].large_count;
+        total.large_size += stats.arenas[i].large_size;
+        total.metadata_size += stats.arenas[i].metadata_size;
+    }
+
+    if (options == MALLOC_INFO_JSON)
+    {
+        fprintf(fp, "{\"version\":1,\"heaps\":[");
+        for (unsigned int i = 0; i < stats.arena_count; i++)
         {
-            my_free(current);
-            LOG_WARN("Freed non-freed chunk at %p with size %zu", current->data, current->size);
+            fputs(i > 0 ? "," : "", fp);
+            write_arena_json(fp, i, &stats.arenas[i]);
         }
-        current = current->next;
+        fprintf(fp, "],\"total\":{\"free\":{\"count\":%zu,\"size\":%zu}", total.free_count, total.free_size);
+        fprintf(fp, ",\"mmap\":{\"count\":%zu,\"size\":%zu}", total.large_count, total.large_size);
+        fprintf(fp, ",\"system\":%zu,\"used\":%zu,\"metadata\":%zu}",
+                total.data_size + total.slabs_size + total.large_size,
+                get_arena_used_size(&total) + total.large_size, total.metadata_size);
+        fprintf(fp, ",\"counters\":{\"mmap\":%zu,\"munmap\":%zu,\"mremap\":%zu,\"canary_failures\":%zu,\"poison_failures\":%zu}}\n",
+                stats.counters.mmap_calls, stats.counters.munmap_calls,
+                stats.counters.mremap_calls, stats.counters.canary_failures, stats.counters.poison_failures);
+        return 0;
+    }
+
+    fprintf(fp, "<malloc version=\"1\">\n");
+    for (unsigned int i = 0; i < stats.arena_count; i++)
+        write_arena_xml(fp, i, &stats.arenas[i]);
+    fprintf(fp, "<total type=\"rest\" count=\"%zu\" size=\"%zu\"/>\n", total.free_count, total.free_size);
+    fprintf(fp, "<total type=\"mmap\" count=\"%zu\" size=\"%zu\"/>\n", total.large_count, total.large_size);
+    fprintf(fp, "<system type=\"current\" size=\"%zu\"/>\n", total.data_size + total.slabs_size + total.large_size);
+    fprintf(fp, "<system type=\"used\" size=\"%zu\"/>\n", get_arena_used_size(&total) + total.large_size);
+    fprintf(fp, "<aspace type=\"metadata\" size=\"%zu\"/>\n", total.metadata_size);
+    fprintf(fp, "<count type=\"mmap\" value=\"%zu\"/>\n", stats.counters.mmap_calls);
+    fprintf(fp, "<count type=\"munmap\" value=\"%zu\"/>\n", stats.counters.munmap_calls);
+    fprintf(fp, "<count type=\"mremap\" value=\"%zu\"/>\n", stats.counters.mremap_calls);
+    fprintf(fp, "<count type=\"canary_failures\" value=\"%zu\"/>\n", stats.counters.canary_failures);
+    fprintf(fp, "<count type=\"poison_failures\" value=\"%zu\"/>\n", stats.counters.poison_failures);
+    fprintf(fp, "</malloc>\n");
+
+    return 0;
+}
+
+/**
+ * @brief Verifies if all allocated memory blocks have been freed and logs any leaks.
+ * Chunks still in use are only reported: other threads may still be running at exit,
+ * so each arena is walked under its lock and nothing is freed.
+ */
+void check_memory_leaks()
+{
+    unsigned int count = __atomic_load_n(&arena_count, __ATOMIC_ACQUIRE);
+    for (unsigned int i = 0; i < count; i++)
+    {
+        arena_t *arena = &arenas[i];
+        pthread_mutex_lock(&arena->lock);
+
+        for (chunk_list_t *current = arena->head; current != NULL; current = current->next)
+            if (get_chunk_state(current) == USED)
+                LOG_WARN("check_memory_leaks - chunk at %p of size %zu was not freed", current->data, get_chunk_size(current));
+
+        for (chunk_list_t *large = arena->large_chunks; large != NULL; large = large->next)
+            LOG_WARN("check_memory_leaks - chunk at %p of size %zu was not freed", large->data, get_chunk_size(large));
+
+        pthread_mutex_unlock(&arena->lock);
     }
 }
 
@@ -544,20 +4062,125 @@ void check_memory_leaks()
  */
 void clean()
 {
-    // Get total size of the data pool
-    chunk_list_t *current = cl_metadata_head;
-    while (current != NULL)
+    stop_heap_scanner();
+
+    pthread_mutex_lock(&heap_lock);
+
+    for (unsigned int i = 0; i < arena_count; i++)
+    {
+        arena_t *arena = &arenas[i];
+        pthread_mutex_lock(&arena->lock);
+
+        // Free the large chunks, their descriptors are in the metadata pool
+        chunk_list_t *large = arena->large_chunks;
+        while (large != NULL)
+        {
+            munmap(large->data, get_large_mapping_size(get_chunk_size(large)));
+            large = large->next;
+        }
+
+        // Free the metadata pool
+        metadata_block_t *block = arena->metadata;
+        while (block != NULL)
+        {
+            metadata_block_t *next = block->next;
+            munmap(block, block->size);
+            block = next;
+        }
+
+        // Reset the arena
+        arena->metadata = NULL;
+        arena->metadata_size = 0;
+        arena->free_metadata = NULL;
+        arena->large_chunks = NULL;
+        memset(arena->slabs, 0, sizeof(arena->slabs));
+        arena->empty_slabs = NULL;
+        arena->slab_batch = NULL;
+        arena->slab_batch_end = NULL;
+        arena->data_start = NULL;
+        arena->data_end = NULL;
+        arena->data_limit = NULL;
+        arena->extent_size = 0;
+        arena->head = NULL;
+        arena->tail = NULL;
+        for (unsigned int class = 0; class < BIN_COUNT; class++)
+        {
+            if (arena->free_capacities[class] == 0)
+                continue;
+
+            munmap(arena->free_sizes[class], arena->free_capacities[class] * sizeof(uint32_t));
+            munmap(arena->free_chunks[class], arena->free_capacities[class] * sizeof(chunk_list_t *));
+        }
+        memset(arena->free_sizes, 0, sizeof(arena->free_sizes));
+        memset(arena->free_chunks, 0, sizeof(arena->free_chunks));
+        memset(arena->free_capacities, 0, sizeof(arena->free_capacities));
+        memset(arena->free_counts, 0, sizeof(arena->free_counts));
+        arena->free_bins_map = 0;
+        arena->remote_frees = NULL;
+        arena->slabs_size = 0;
+        arena->slots_size = 0;
+        arena->large_count = 0;
+        arena->large_size = 0;
+
+        pthread_mutex_unlock(&arena->lock);
+    }
+
+    // Free the data pools
+    if (heap_start != NULL)
+        munmap(heap_start, heap_reserve_size);
+
+    if (slab_headers != NULL)
+        munmap(slab_headers, (slab_reserve_size >> SLAB_SHIFT) * sizeof(slab_t));
+
+    __atomic_store_n(&heap_start, NULL, __ATOMIC_RELEASE);
+    heap_reserve_size = 0;
+    slab_headers = NULL;
+    slab_reserve_size = 0;
+    slab_next = 0;
+
+    // Free the guarded pool and give faults back to the previous handler
+    pthread_mutex_lock(&guard_lock);
+    if (guard_pool != NULL)
     {
-        munmap(current->data, current->size + sizeof(canary_t));
-        current = current->next;
+        sigaction(SIGSEGV, &guard_previous_action, NULL);
+        munmap(guard_pool, (2 * GUARD_SLOT_COUNT + 1) * PAGE_SIZE);
     }
 
-    // Free the metadata pool
-    munmap(cl_metadata_head, metadata_offset * sizeof(chunk_list_t));
+    __atomic_store_n(&guard_sample, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&guard_pool, NULL, __ATOMIC_RELEASE);
+    memset(guard_slots, 0, sizeof(guard_slots));
+    pthread_mutex_unlock(&guard_lock);
+
+    // Free the quarantine, the blocks it holds go with the pools
+    pthread_mutex_lock(&quarantine_lock);
+    if (quarantine_ring != NULL)
+        munmap(quarantine_ring, quarantine_max_count * sizeof(quarantine_entry_t));
+
+    quarantine_ring = NULL;
+    quarantine_head = 0;
+    quarantine_count = 0;
+    quarantine_size = 0;
+    quarantine_max_size = 0;
+    __atomic_store_n(&quarantine_max_count, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&quarantine_lock);
+
+    // Free the index
+    pthread_mutex_lock(&chunk_index_lock);
+    if (chunk_index_area != NULL)
+        munmap(chunk_index_area, 2 * CHUNK_INDEX_MAX_CAPACITY * sizeof(chunk_index_slot_t));
+
+    chunk_index_area = NULL;
+    chunk_index = NULL;
+    chunk_index_capacity = 0;
+    chunk_index_used = 0;
+    chunk_index_count = 0;
+    pthread_mutex_unlock(&chunk_index_lock);
+
+    memset(&thread_cache, 0, sizeof(thread_cache));
+    memset(&heap_counters, 0, sizeof(heap_counters));
+    __atomic_store_n(&heap_initialized, 0, __ATOMIC_RELEASE);
 
-    // Reset the global variables
-    cl_metadata_head = NULL;
-    metadata_size = 0;
+    pthread_mutex_unlock(&heap_lock);
 
     LOG_INFO("clean - Memory pool cleaned");
 }
@@ -573,7 +4196,10 @@ void clean()
  */
 void *malloc(size_t size)
 {
-    return my_malloc(size);
+    void *ptr = my_malloc(size);
+    trace_event(TRACE_MALLOC, NULL, ptr, size);
+
+    return ptr;
 }
 
 /**
@@ -584,9 +4210,50 @@ void *malloc(size_t size)
  */
 void free(void *ptr)
 {
+    // Traced first, the chunk may be handed out again as soon as it is freed
+    trace_event(TRACE_FREE, ptr, NULL, 0);
     my_free(ptr);
 }
 
+/**
+ * Custom implementation of the C23 free_sized function.
+ * Frees the memory block pointed to by the given pointer, whose size is known.
+ *
+ * @param ptr A pointer to the memory block to free.
+ * @param size The size given when the memory block was allocated.
+ */
+void free_sized(void *ptr, size_t size)
+{
+    trace_event(TRACE_FREE, ptr, NULL, size);
+    my_free_sized(ptr, size);
+}
+
+/**
+ * Custom implementation of the C23 free_aligned_sized function.
+ * Frees the aligned memory block pointed to by the given pointer, whose size is known.
+ *
+ * @param ptr A pointer to the memory block to free.
+ * @param alignment The alignment given when the memory block was allocated.
+ * @param size The size given when the memory block was allocated.
+ */
+void free_aligned_sized(void *ptr, size_t alignment, size_t size)
+{
+    trace_event(TRACE_FREE, ptr, NULL, size);
+    my_free_aligned_sized(ptr, alignment, size);
+}
+
+/**
+ * Custom implementation of the malloc_usable_size function.
+ * Returns the number of bytes of the memory block which can be used.
+ *
+ * @param ptr A pointer to the memory block.
+ * @return The usable size of the memory block, 0 if the pointer is NULL.
+ */
+size_t malloc_usable_size(void *ptr)
+{
+    return my_malloc_usable_size(ptr);
+}
+
 /**
  * Custom implementation of the calloc function.
  * Allocates a block of memory for an array of nmemb elements, each of size bytes,
@@ -598,7 +4265,15 @@ void free(void *ptr)
  */
 void *calloc(size_t nmemb, size_t size)
 {
-    return my_calloc(nmemb, size);
+    void *ptr = my_calloc(nmemb, size);
+
+    // The size of an overflowing request is traced as 0, like the failed allocation
+    size_t total;
+    if (__builtin_mul_overflow(nmemb, size, &total))
+        total = 0;
+    trace_event(TRACE_CALLOC, NULL, ptr, total);
+
+    return ptr;
 }
 
 /**
@@ -611,7 +4286,132 @@ void *calloc(size_t nmemb, size_t size)
  */
 void *realloc(void *ptr, size_t size)
 {
+    // Traced by my_realloc before the old block is released
     return my_realloc(ptr, size);
 }
 
+/**
+ * Custom implementation of the posix_memalign function.
+ * Allocates a block of memory aligned on the given alignment.
+ *
+ * @param memptr Set to the allocated memory block.
+ * @param alignment The alignment, a power of two multiple of sizeof(void *).
+ * @param size The size of the memory block to allocate.
+ * @return 0 on success, EINVAL or ENOMEM otherwise.
+ */
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    int ret = my_posix_memalign(memptr, alignment, size);
+    trace_event(TRACE_MEMALIGN, (void *)alignment, ret == 0 ? *memptr : NULL, size);
+
+    return ret;
+}
+
+/**
+ * Custom implementation of the aligned_alloc function.
+ * Allocates a block of memory aligned on the given alignment.
+ *
+ * @param alignment The alignment, a power of two.
+ * @param size The size of the memory block to allocate.
+ * @return A pointer to the allocated memory block, or NULL if the allocation fails.
+ */
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    void *ptr = my_aligned_alloc(alignment, size);
+    trace_event(TRACE_MEMALIGN, (void *)alignment, ptr, size);
+
+    return ptr;
+}
+
+/**
+ * Custom implementation of the memalign function.
+ * Allocates a block of memory aligned on the given alignment.
+ *
+ * @param alignment The alignment, rounded up to a power of two.
+ * @param size The size of the memory block to allocate.
+ * @return A pointer to the allocated memory block, or NULL if the allocation fails.
+ */
+void *memalign(size_t alignment, size_t size)
+{
+    void *ptr = my_memalign(alignment, size);
+    trace_event(TRACE_MEMALIGN, (void *)alignment, ptr, size);
+
+    return ptr;
+}
+
+/**
+ * Custom implementation of the valloc function.
+ * Allocates a page aligned block of memory.
+ *
+ * @param size The size of the memory block to allocate.
+ * @return A pointer to the allocated memory block, or NULL if the allocation fails.
+ */
+void *valloc(size_t size)
+{
+    void *ptr = my_valloc(size);
+    trace_event(TRACE_MEMALIGN, (void *)PAGE_SIZE, ptr, size);
+
+    return ptr;
+}
+
+/**
+ * Custom implementation of the pvalloc function.
+ * Allocates a page aligned block of memory, its size rounded up to whole pages.
+ *
+ * @param size The size of the memory block to allocate.
+ * @return A pointer to the allocated memory block, or NULL if the allocation fails.
+ */
+void *pvalloc(size_t size)
+{
+    void *ptr = my_pvalloc(size);
+    trace_event(TRACE_MEMALIGN, (void *)PAGE_SIZE, ptr, size);
+
+    return ptr;
+}
+
+/**
+ * Custom implementation of the malloc_trim function.
+ * Gives the free memory of the heap back to the system.
+ *
+ * @param pad The number of free bytes to keep at the end of the heap.
+ * @return 1 if memory was given back to the system, 0 otherwise.
+ */
+int malloc_trim(size_t pad)
+{
+    return my_malloc_trim(pad);
+}
+
+/**
+ * Custom implementation of the mallinfo2 function.
+ * Returns the statistics of the heap.
+ *
+ * @return The statistics of the heap.
+ */
+struct mallinfo2 mallinfo2(void)
+{
+    return my_mallinfo2();
+}
+
+/**
+ * Custom implementation of the malloc_stats function.
+ * Prints the statistics of the heap on the standard error.
+ */
+void malloc_stats(void)
+{
+    my_malloc_stats();
+}
+
+/**
+ * Custom implementation of the malloc_info function.
+ * Writes the statistics of the heap to a stream, as XML or JSON.
+ *
+ * @param options 0 for XML, 1 for JSON.
+ * @param fp The stream to write to.
+ * @return 0 on success, -1 if the options are unknown.
+ */
+int malloc_info(int options, FILE *fp)
+{
+    return my_malloc_info(options, fp);
+}
+
 #endif
@@ -6,10 +6,86 @@
 #include <alloca.h>
 #include <string.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/syscall.h>
 
 #include "utils.h"
 
-int log_fd = -1; // Default log file descriptor
+int log_fd = -1;   // Default log file descriptor
+int trace_fd = -1; // Binary allocation trace, -1 while tracing is off
+
+/**
+ * @struct ring_slot_t
+ * @brief Represents a slot of a record ring buffer.
+ *
+ * A ring is a bounded multiple-producer queue: the sequence of a slot tells
+ * whether the producer reserving position pos may write it (sequence == pos) or
+ * whether the flusher may write it out (sequence == pos + 1).
+ */
+typedef struct ring_slot_t
+{
+    size_t sequence;                                    // Position of the slot in the ring, plus 1 once its record is written
+    unsigned int length;                                // Length of the record
+    unsigned char record[] __attribute__((aligned(8))); // Record, written out as is
+} ring_slot_t;
+
+/**
+ * @struct record_ring_t
+ * @brief Represents a ring buffer of records written out to a file in batches.
+ */
+typedef struct record_ring_t
+{
+    uint8_t *slots;                                       // Slots of the ring, NULL until the ring is set up
+    size_t slot_size;                                     // Size of a slot, record included
+    size_t capacity;                                      // Number of slots, a power of two
+    size_t head;                                          // Next position reserved by a producer
+    size_t tail;                                          // Next position written out by the flusher
+    size_t dropped;                                       // Records dropped because the ring was full
+    int fd;                                               // File the records are written to
+    pthread_mutex_t flush_lock;                           // Serializes the flushers
+    char *batch;                                          // RING_BATCH_SIZE bytes being written out, protected by flush_lock
+    size_t (*report_drops)(char *buffer, size_t dropped); // Writes the record counting dropped records
+} record_ring_t;
+
+static size_t report_log_drops(char *buffer, size_t dropped);
+static size_t report_trace_drops(char *buffer, size_t dropped);
+
+static record_ring_t log_ring = {.flush_lock = PTHREAD_MUTEX_INITIALIZER, .report_drops = report_log_drops};     // Text records of the log file
+static record_ring_t trace_ring = {.flush_lock = PTHREAD_MUTEX_INITIALIZER, .report_drops = report_trace_drops}; // Records of the allocation trace
+static pid_t log_pid = 0;                                                                                          // Process identifier put in front of the log records
+static __thread uint32_t trace_thread __attribute__((tls_model("initial-exec")));                                 // Thread identifier of the trace records, 0 until known
+
+/**
+ * @struct canary_rng_t
+ * @brief Represents the per-thread ChaCha20 generator used for canaries.
+ */
+typedef struct canary_rng_t
+{
+    uint32_t state[16];                      // ChaCha20 input block: constants, key, counter and nonce
+    uint32_t buffer[CANARY_BUFFER_WORDS];    // Keystream not handed out yet
+    unsigned int index;                      // Next word of the buffer to hand out
+    unsigned int refills;                    // Refills since the last reseed
+    int seeded;                              // Set once the key comes from getrandom()
+} canary_rng_t;
+
+static __thread canary_rng_t canary_rng __attribute__((tls_model("initial-exec")));
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define QUARTER_ROUND(a, b, c, d) \
+    a += b, d ^= a, d = ROTL32(d, 16), \
+    c += d, b ^= c, b = ROTL32(b, 12), \
+    a += b, d ^= a, d = ROTL32(d, 8),  \
+    c += d, b ^= c, b = ROTL32(b, 7)
+#define ROTL64(v, n) (((v) << (n)) | ((v) >> (64 - (n))))
+#define SIP_ROUND(v0, v1, v2, v3) \
+    v0 += v1, v1 = ROTL64(v1, 13), v1 ^= v0, v0 = ROTL64(v0, 32), \
+    v2 += v3, v3 = ROTL64(v3, 16), v3 ^= v2,                      \
+    v0 += v3, v3 = ROTL64(v3, 21), v3 ^= v0,                      \
+    v2 += v1, v1 = ROTL64(v1, 17), v1 ^= v2, v2 = ROTL64(v2, 32)
 
 /** Usage example
  * init_logging();
@@ -31,9 +107,227 @@ struct tm *get_current_time()
     return timeinfo;
 }
 
+/**
+ * @brief Writes a buffer entirely to a file descriptor.
+ *
+ * @param fd file descriptor identifier
+ * @param buffer pointer to the bytes to write
+ * @param size number of bytes to write
+ */
+static void write_all(const int fd, const void *buffer, size_t size)
+{
+    const char *bytes = buffer;
+
+    while (size > 0)
+    {
+        ssize_t written = write(fd, bytes, size);
+        if (written == -1 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return;
+
+        bytes += written;
+        size -= (size_t)written;
+    }
+}
+
+/**
+ * @brief Returns the slot of a ring holding a position.
+ *
+ * @param ring pointer to the ring
+ * @param pos position in the ring
+ * @return pointer to the slot
+ */
+static ring_slot_t *get_ring_slot(const record_ring_t *ring, size_t pos)
+{
+    return (ring_slot_t *)(ring->slots + (pos & (ring->capacity - 1)) * ring->slot_size);
+}
+
+/**
+ * @brief Maps the slots of a ring and its batch buffer.
+ *
+ * @param ring pointer to the ring
+ * @param fd file descriptor the records are written to
+ * @param capacity number of slots, a power of two
+ * @param record_size biggest size of a record
+ * @return 0 on success, -1 if the ring can't be mapped
+ */
+static int init_ring(record_ring_t *ring, const int fd, size_t capacity, size_t record_size)
+{
+    if (ring->slots != NULL)
+        return 0;
+
+    ring->slot_size = (sizeof(ring_slot_t) + record_size + 7) & ~(size_t)7;
+    uint8_t *slots = mmap(NULL, capacity * ring->slot_size + RING_BATCH_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (slots == MAP_FAILED)
+        return -1;
+
+    ring->capacity = capacity;
+    ring->fd = fd;
+    ring->batch = (char *)slots + capacity * ring->slot_size;
+    for (size_t pos = 0; pos < capacity; pos++)
+        ((ring_slot_t *)(slots + pos * ring->slot_size))->sequence = pos;
+
+    __atomic_store_n(&ring->slots, slots, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/**
+ * @brief Writes out the records of a ring in batches of RING_BATCH_SIZE bytes.
+ * Records are written in order, up to the first one still being written by its producer.
+ * The flush lock of the ring must be held.
+ *
+ * @param ring pointer to the ring
+ */
+static void flush_ring(record_ring_t *ring)
+{
+    size_t used = 0;
+    size_t pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+
+    for (;;)
+    {
+        ring_slot_t *slot = get_ring_slot(ring, pos);
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != pos + 1)
+            break;
+
+        if (used + slot->length > RING_BATCH_SIZE)
+        {
+            write_all(ring->fd, ring->batch, used);
+            used = 0;
+        }
+        memcpy(ring->batch + used, slot->record, slot->length);
+        used += slot->length;
+
+        // Give the slot back to the producers of the next round
+        __atomic_store_n(&slot->sequence, pos + ring->capacity, __ATOMIC_RELEASE);
+        pos++;
+    }
+    __atomic_store_n(&ring->tail, pos, __ATOMIC_RELAXED);
+
+    size_t dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+    if (dropped > 0)
+    {
+        if (used + ring->slot_size > RING_BATCH_SIZE)
+        {
+            write_all(ring->fd, ring->batch, used);
+            used = 0;
+        }
+        used += ring->report_drops(ring->batch + used, dropped);
+    }
+
+    write_all(ring->fd, ring->batch, used);
+}
+
+/**
+ * @brief Reserves a slot of a ring without waiting for the flusher.
+ * When the ring is full, it is flushed if no other thread is flushing it,
+ * otherwise the record is dropped and counted.
+ *
+ * @param ring pointer to the ring
+ * @param pos set to the position of the slot
+ * @return pointer to the slot, or NULL if the record is dropped
+ */
+static ring_slot_t *reserve_ring_slot(record_ring_t *ring, size_t *pos)
+{
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        *pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+
+        for (;;)
+        {
+            ring_slot_t *slot = get_ring_slot(ring, *pos);
+            size_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+
+            if (sequence == *pos)
+            {
+                if (__atomic_compare_exchange_n(&ring->head, pos, *pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                    return slot;
+            }
+            else if ((ptrdiff_t)(sequence - *pos) < 0)
+                break; // The record of the previous round has not been written out yet
+            else
+                *pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        }
+
+        if (attempt > 0 || pthread_mutex_trylock(&ring->flush_lock) != 0)
+            break;
+
+        flush_ring(ring);
+        pthread_mutex_unlock(&ring->flush_lock);
+    }
+
+    __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+
+    return NULL;
+}
+
+/**
+ * @brief Hands a written record over to the flusher.
+ * The producer of the last record of each half of the ring flushes it, unless
+ * another thread is already flushing.
+ *
+ * @param ring pointer to the ring
+ * @param slot pointer to the slot of the record
+ * @param pos position of the slot
+ * @param length length of the record
+ * @param flush 1 to flush the ring right away
+ */
+static void commit_ring_slot(record_ring_t *ring, ring_slot_t *slot, size_t pos, unsigned int length, int flush)
+{
+    slot->length = length;
+    __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+
+    if (flush)
+    {
+        pthread_mutex_lock(&ring->flush_lock);
+        flush_ring(ring);
+        pthread_mutex_unlock(&ring->flush_lock);
+    }
+    else if ((pos & (ring->capacity / 2 - 1)) == ring->capacity / 2 - 1 && pthread_mutex_trylock(&ring->flush_lock) == 0)
+    {
+        flush_ring(ring);
+        pthread_mutex_unlock(&ring->flush_lock);
+    }
+}
+
+/**
+ * @brief Writes out the records waiting in a ring.
+ * Waits for the flusher in progress, if any.
+ *
+ * @param ring pointer to the ring
+ */
+static void drain_ring(record_ring_t *ring)
+{
+    if (__atomic_load_n(&ring->slots, __ATOMIC_ACQUIRE) == NULL)
+        return;
+
+    pthread_mutex_lock(&ring->flush_lock);
+    flush_ring(ring);
+    pthread_mutex_unlock(&ring->flush_lock);
+}
+
+/**
+ * @brief Writes the log record counting the records dropped by the log ring.
+ *
+ * @param buffer pointer to at least LOG_RECORD_SIZE bytes
+ * @param dropped number of dropped records
+ * @return length of the record
+ */
+static size_t report_log_drops(char *buffer, size_t dropped)
+{
+    int length = snprintf(buffer, LOG_RECORD_SIZE, "%d [%s] %zu log records dropped\n", log_pid, LOG_TYPE_WARN, dropped);
+
+    return (length < LOG_RECORD_SIZE) ? (size_t)length : LOG_RECORD_SIZE - 1;
+}
+
 /**
  * @brief Generic logging function that puts the log message in
  * the specified file descriptor
+ * Messages to log_fd are formatted in a record of the log ring, which is written out
+ * in batches: by the producer of the last record of each half of the ring, when the ring
+ * is full, on errors and when logging is closed. A record that doesn't fit in the ring
+ * is dropped and counted, producers never wait for the flusher.
  *
  * @param fd file descriptor identifier
  * @param name pointer to the name of the log message
@@ -46,41 +340,119 @@ void log_general(const int fd, const char *log_name, const char *format, ...)
     if (log_fd == DEACTIVATE_LOGGING)
         return;
 
-    // Deactivated time logging because of mystery infinite loop, will fix later
-    // const struct tm *timeinfo = get_current_time();
-    const pid_t pid = getpid();
+    size_t pos = 0;
+    ring_slot_t *slot = NULL;
+    char direct[LOG_RECORD_SIZE];
+
+    if (fd == log_fd && __atomic_load_n(&log_ring.slots, __ATOMIC_ACQUIRE) != NULL && (slot = reserve_ring_slot(&log_ring, &pos)) == NULL)
+        return;
+
+    // Format the log message with its header, truncated to a record
+    char *text = (slot != NULL) ? (char *)slot->record : direct;
+    int length = snprintf(text, LOG_RECORD_SIZE, "%d [%s] ", log_pid != 0 ? log_pid : getpid(), log_name);
+
+    va_list args;
+    va_start(args, format);
+    length += vsnprintf(text + length, LOG_RECORD_SIZE - (size_t)length, format, args);
+    va_end(args);
+
+    if (length > LOG_RECORD_SIZE - 2)
+        length = LOG_RECORD_SIZE - 2;
+    text[length++] = '\n';
+
+    if (slot == NULL)
+    {
+        write_all(fd, text, (size_t)length);
+        return;
+    }
+
+    // Errors are written out right away, they may be the last words of the process
+    commit_ring_slot(&log_ring, slot, pos, (unsigned int)length, strcmp(log_name, LOG_TYPE_ERROR) == 0);
+}
 
-    // char time_buffer[20] = {0};
-    // char prefix[34] = {0};
-    char prefix[15] = {0};
+/**
+ * @brief Appends a number to a record being formatted by log_signal_safe.
+ *
+ * @param text pointer to the record
+ * @param length length of the record, updated
+ * @param value number to append
+ * @param base 10, or 16 to write it in hexadecimal after 0x
+ */
+static void append_number(char *text, size_t *length, uintptr_t value, unsigned int base)
+{
+    char digits[24]; // 20 decimal digits, or 0x and 16 hexadecimal digits
+    size_t count = 0;
+
+    do
+    {
+        digits[count++] = "0123456789abcdef"[value % base];
+        value /= base;
+    } while (value != 0);
 
-    // Buffer for our time string
-    // strftime(time_buffer, sizeof(time_buffer), "%Y-%m-%d %H:%M:%S", timeinfo);
+    if (base == 16)
+    {
+        digits[count++] = 'x';
+        digits[count++] = '0';
+    }
 
-    // Buffer for our header
-    // snprintf(prefix, sizeof(prefix), "%s %d [%s] ", time_buffer, pid, log_name);
-    snprintf(prefix, sizeof(prefix), "%d [%s] ", pid, log_name);
+    while (count > 0 && *length < LOG_RECORD_SIZE - 1)
+        text[(*length)++] = digits[--count];
+}
 
-    // Calculate the required size for the log message
-    va_list args_copy;
-    va_start(args_copy, format);
-    int len = vsnprintf(NULL, 0, format, args_copy) + 1; // +1 for null terminator
-    va_end(args_copy);
+/**
+ * @brief Logs a message from a signal handler
+ * Only async-signal-safe functions are used: the record is formatted by hand, with
+ * %s, %p and %zu as the only conversions, and written straight to log_fd without
+ * going through the ring, whose flush lock may be held by the interrupted thread.
+ *
+ * @param log_name pointer to the name of the log message
+ * @param format pointer to the format string
+ */
+void log_signal_safe(const char *log_name, const char *format, ...)
+{
+    if (log_fd == DEACTIVATE_LOGGING || log_fd == -1)
+        return;
 
-    // Allocate memory for the log message
-    char *buffer = alloca(len);
+    char text[LOG_RECORD_SIZE];
+    size_t length = 0;
 
-    // Format the log message with header
-    va_start(args_copy, format);
-    vsnprintf(buffer, len, format, args_copy); // -1 to leave space for the null terminator
-    va_end(args_copy);
+    append_number(text, &length, (uintptr_t)(log_pid != 0 ? log_pid : getpid()), 10);
+    for (const char *c = " ["; *c != '\0'; c++)
+        text[length++] = *c;
+    for (const char *c = log_name; *c != '\0' && length < LOG_RECORD_SIZE - 1; c++)
+        text[length++] = *c;
+    for (const char *c = "] "; *c != '\0' && length < LOG_RECORD_SIZE - 1; c++)
+        text[length++] = *c;
 
-    // Concatenate log prefix and message
-    char log_message[len + sizeof(prefix)];
-    snprintf(log_message, sizeof(log_message), "%s%s\n", prefix, buffer);
+    va_list args;
+    va_start(args, format);
+    for (const char *c = format; *c != '\0' && length < LOG_RECORD_SIZE - 1; c++)
+    {
+        if (*c != '%')
+            text[length++] = *c;
+        else if (c[1] == 's')
+        {
+            for (const char *arg = va_arg(args, const char *); *arg != '\0' && length < LOG_RECORD_SIZE - 1; arg++)
+                text[length++] = *arg;
+            c++;
+        }
+        else if (c[1] == 'p')
+        {
+            append_number(text, &length, (uintptr_t)va_arg(args, void *), 16);
+            c++;
+        }
+        else if (c[1] == 'z' && c[2] == 'u')
+        {
+            append_number(text, &length, va_arg(args, size_t), 10);
+            c += 2;
+        }
+        else
+            text[length++] = *c;
+    }
+    va_end(args);
 
-    // Write to file descriptor
-    write(fd, log_message, sizeof(log_message));
+    text[length++] = '\n';
+    write_all(log_fd, text, length);
 }
 
 /**
@@ -117,24 +489,98 @@ void init_logging()
         return;
     }
 
+    log_pid = getpid();
+
     // If stdout, set the file descriptor to stdout
     if (strcmp(path, "stdout") == 0)
-    {
         log_fd = STDOUT_FILENO;
-        return;
+    else if (log_fd == -1)
+    {
+        log_fd = create_log_file(path);
+        if (log_fd == -1)
+        {
+            log_fd = STDERR_FILENO;
+            LOG_ERROR("Failed to create log file");
+            return;
+        }
     }
+    else
+        return; // If already opened, return
 
-    // If already opened, return
-    if (log_fd != -1)
-        return;
+    // Records are kept in memory and written out in batches
+    init_ring(&log_ring, log_fd, LOG_RING_RECORDS, LOG_RECORD_SIZE);
+}
 
-    log_fd = create_log_file(path);
-    if (log_fd == -1)
-    {
-        log_fd = STDERR_FILENO;
-        LOG_ERROR("Failed to create log file");
+/**
+ * @brief Write out the log records waiting in the ring buffer.
+ * Waits for the flusher in progress, if any.
+ *
+ */
+void flush_logging()
+{
+    drain_ring(&log_ring);
+}
+
+/**
+ * @brief Gives a ring back to a child process with no record in it.
+ * The records waiting in the parent's ring are written out by the parent.
+ *
+ * @param ring pointer to the ring
+ */
+static void reset_ring(record_ring_t *ring)
+{
+    if (ring->slots == NULL)
         return;
-    }
+
+    for (size_t pos = 0; pos < ring->capacity; pos++)
+        get_ring_slot(ring, pos)->sequence = pos;
+
+    ring->head = 0;
+    ring->tail = 0;
+    ring->dropped = 0;
+}
+
+/**
+ * @brief Takes the flush locks of the rings before the process forks.
+ * The records waiting in the rings are written out first, so the child doesn't write them again.
+ *
+ */
+void prepare_fork_logging()
+{
+    pthread_mutex_lock(&log_ring.flush_lock);
+    if (log_ring.slots != NULL)
+        flush_ring(&log_ring);
+
+    pthread_mutex_lock(&trace_ring.flush_lock);
+    if (trace_ring.slots != NULL)
+        flush_ring(&trace_ring);
+}
+
+/**
+ * @brief Releases the flush locks of the rings in the parent once the process forked.
+ *
+ */
+void parent_fork_logging()
+{
+    pthread_mutex_unlock(&trace_ring.flush_lock);
+    pthread_mutex_unlock(&log_ring.flush_lock);
+}
+
+/**
+ * @brief Empties the rings of the child once the process forked, then releases their flush locks.
+ * Records of the threads which were not copied would otherwise block the rings.
+ *
+ */
+void child_fork_logging()
+{
+    reset_ring(&log_ring);
+    reset_ring(&trace_ring);
+
+    if (log_pid != 0)
+        log_pid = getpid();
+    trace_thread = 0;
+
+    parent_fork_logging();
 }
 
 /**
@@ -147,34 +593,299 @@ void close_logging()
         return;
 
     LOG_INFO("Closing log file");
+    flush_logging();
 
     close(log_fd);
+    log_fd = DEACTIVATE_LOGGING;
 }
 
 /**
- * @brief Get a random 4 bytes canary value
+ * @brief Writes the trace record counting the records dropped by the trace ring.
  *
- * @return random canary value
+ * @param buffer pointer to at least sizeof(trace_record_t) bytes
+ * @param dropped number of dropped records
+ * @return length of the record
  */
-canary_t get_random_canary()
+static size_t report_trace_drops(char *buffer, size_t dropped)
 {
-    // Open /dev/urandom
-    uint32_t fd = open("/dev/urandom", O_RDONLY);
-    if (fd == (uint32_t)-1)
-        return 0;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
 
-    // Read 4 bytes from /dev/urandom
-    uint32_t random = 0;
-    if (lseek(fd, -4, SEEK_END) == -1)
-        return 0;
+    trace_record_t record = {
+        .timestamp = (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec,
+        .size = dropped,
+        .op = TRACE_DROPPED,
+    };
+    memcpy(buffer, &record, sizeof(record));
 
-    // Put the random value in the canary
-    if (read(fd, &random, sizeof(random)) == -1)
-        return 0;
+    return sizeof(record);
+}
 
-    random &= 0x00FFFFFF; // Create a null byte at the beginning
+/**
+ * @brief Initialize the binary allocation trace.
+ * Handles the presence of the MSM_TRACE environment variable: the trace file
+ * starts with a trace_header_t, followed by the records in the order they were taken.
+ *
+ */
+void init_trace()
+{
+    const char *path = getenv("MSM_TRACE");
+    if (path == NULL || trace_fd != -1)
+        return;
 
+    int fd = create_log_file(path);
+    if (fd == -1)
+    {
+        LOG_ERROR("init_trace - Failed to create trace file");
+        return;
+    }
+
+    trace_header_t header = {.version = TRACE_VERSION, .record_size = sizeof(trace_record_t)};
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    write_all(fd, &header, sizeof(header));
+
+    if (init_ring(&trace_ring, fd, TRACE_RING_RECORDS, sizeof(trace_record_t)) == -1)
+    {
+        LOG_ERROR("init_trace - Failed to map trace ring");
+        close(fd);
+        return;
+    }
+
+    __atomic_store_n(&trace_fd, fd, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Records an allocation event in the binary trace.
+ * Like log records, trace records go through a ring buffer and are dropped when
+ * it is full.
+ *
+ * @param op operation of the event
+ * @param ptr pointer given to free or realloc
+ * @param address pointer returned by the call
+ * @param size requested size
+ */
+void trace_event(trace_op_t op, const void *ptr, const void *address, size_t size)
+{
+    if (__atomic_load_n(&trace_fd, __ATOMIC_ACQUIRE) == -1)
+        return;
+
+    size_t pos = 0;
+    ring_slot_t *slot = reserve_ring_slot(&trace_ring, &pos);
+    if (slot == NULL)
+        return;
+
+    if (trace_thread == 0)
+        trace_thread = (uint32_t)syscall(SYS_gettid);
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    trace_record_t *record = (trace_record_t *)slot->record;
+    record->timestamp = (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+    record->address = (uintptr_t)address;
+    record->ptr = (uintptr_t)ptr;
+    record->size = size;
+    record->thread = trace_thread;
+    record->op = op;
+
+    commit_ring_slot(&trace_ring, slot, pos, sizeof(trace_record_t), 0);
+}
+
+/**
+ * @brief Write out the trace records waiting in the ring buffer and close the trace file.
+ *
+ */
+void close_trace()
+{
+    int fd = __atomic_exchange_n(&trace_fd, -1, __ATOMIC_ACQ_REL);
+    if (fd == -1)
+        return;
+
+    drain_ring(&trace_ring);
     close(fd);
+}
+
+/**
+ * @brief Compute a ChaCha20 block (RFC 8439)
+ *
+ * @param input pointer to the input block
+ * @param output pointer to the 16 words of keystream
+ */
+static void chacha20_block(const uint32_t input[16], uint32_t output[16])
+{
+    uint32_t x[16];
+    memcpy(x, input, sizeof(x));
+
+    for (int i = 0; i < 10; i++)
+    {
+        // Column rounds
+        QUARTER_ROUND(x[0], x[4], x[8], x[12]);
+        QUARTER_ROUND(x[1], x[5], x[9], x[13]);
+        QUARTER_ROUND(x[2], x[6], x[10], x[14]);
+        QUARTER_ROUND(x[3], x[7], x[11], x[15]);
+
+        // Diagonal rounds
+        QUARTER_ROUND(x[0], x[5], x[10], x[15]);
+        QUARTER_ROUND(x[1], x[6], x[11], x[12]);
+        QUARTER_ROUND(x[2], x[7], x[8], x[13]);
+        QUARTER_ROUND(x[3], x[4], x[9], x[14]);
+    }
+
+    for (int i = 0; i < 16; i++)
+        output[i] = x[i] + input[i];
+}
+
+/**
+ * @brief Fill a buffer with bytes from getrandom()
+ *
+ * @param buffer pointer to the bytes to fill
+ * @param size number of bytes to fill
+ * @return 0 on success, -1 if no entropy could be read
+ */
+int get_random_bytes(void *buffer, size_t size)
+{
+    size_t done = 0;
+
+    while (done < size)
+    {
+        ssize_t len = getrandom((uint8_t *)buffer + done, size - done, 0);
+        if (len == -1 && errno == EINTR)
+            continue;
+        if (len == -1)
+            return -1;
+
+        done += len;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Seed the canary generator of the calling thread
+ * Key and nonce come from getrandom(), the block counter starts at 0.
+ *
+ * @return 0 on success, -1 if no entropy could be read
+ */
+static int seed_canary_rng(void)
+{
+    uint32_t seed[10] = {0}; // 256-bit key and 64-bit nonce
+
+    if (get_random_bytes(seed, sizeof(seed)) == -1)
+        return -1;
+
+    // "expand 32-byte k"
+    canary_rng.state[0] = 0x61707865;
+    canary_rng.state[1] = 0x3320646e;
+    canary_rng.state[2] = 0x79622d32;
+    canary_rng.state[3] = 0x6b206574;
+    memcpy(&canary_rng.state[4], seed, 8 * sizeof(uint32_t));
+    canary_rng.state[12] = 0;
+    canary_rng.state[13] = 0;
+    memcpy(&canary_rng.state[14], &seed[8], 2 * sizeof(uint32_t));
+
+    memset(seed, 0, sizeof(seed));
+    canary_rng.refills = 0;
+    canary_rng.seeded = 1;
+
+    return 0;
+}
+
+/**
+ * @brief Refill the canary buffer of the calling thread
+ * The first 8 words of keystream replace the key and are never handed out,
+ * so earlier canaries can't be recovered from the generator state.
+ *
+ * @return 0 on success, -1 if the generator can't be seeded
+ */
+static int refill_canary_buffer(void)
+{
+    if ((!canary_rng.seeded || canary_rng.refills >= CANARY_RESEED_INTERVAL) && seed_canary_rng() == -1)
+        return -1;
+
+    for (int block = 0; block < CANARY_BUFFER_BLOCKS; block++)
+    {
+        chacha20_block(canary_rng.state, &canary_rng.buffer[block * 16]);
+
+        // 64-bit block counter
+        if (++canary_rng.state[12] == 0)
+            canary_rng.state[13]++;
+    }
+
+    // Fast key erasure
+    memcpy(&canary_rng.state[4], canary_rng.buffer, 8 * sizeof(uint32_t));
+    memset(canary_rng.buffer, 0, 8 * sizeof(uint32_t));
+
+    canary_rng.index = 8;
+    canary_rng.refills++;
+
+    return 0;
+}
+
+/**
+ * @brief Derive a canary from a secret key and two words with SipHash-1-3
+ * SipHash is a keyed pseudorandom function: knowing canaries derived with a key
+ * tells nothing about the canaries of other words.
+ *
+ * @param key 128-bit secret key
+ * @param first first word of the message
+ * @param second second word of the message
+ * @return canary value, with a null byte at the beginning
+ */
+canary_t get_keyed_canary(const uint64_t key[2], uint64_t first, uint64_t second)
+{
+    uint64_t v0 = key[0] ^ 0x736f6d6570736575ULL;
+    uint64_t v1 = key[1] ^ 0x646f72616e646f6dULL;
+    uint64_t v2 = key[0] ^ 0x6c7967656e657261ULL;
+    uint64_t v3 = key[1] ^ 0x7465646279746573ULL;
+    const uint64_t message[3] = {first, second, (uint64_t)16 << 56}; // The last block holds the length
+
+    for (int i = 0; i < 3; i++)
+    {
+        v3 ^= message[i];
+        SIP_ROUND(v0, v1, v2, v3);
+        v0 ^= message[i];
+    }
+
+    v2 ^= 0xff;
+    for (int i = 0; i < 3; i++)
+        SIP_ROUND(v0, v1, v2, v3);
+
+    return (canary_t)(v0 ^ v1 ^ v2 ^ v3) & 0x00FFFFFF; // Create a null byte at the beginning
+}
+
+/**
+ * @brief Forget the key and the buffered keystream of the canary generator of the calling thread.
+ * Used in a forked child, which would otherwise hand out the same canaries as its parent:
+ * the next canary reseeds the generator with getrandom().
+ *
+ */
+void reset_canary_rng()
+{
+    memset(&canary_rng, 0, sizeof(canary_rng));
+    canary_rng.index = CANARY_BUFFER_WORDS;
+}
+
+/**
+ * @brief Get a random 4 bytes canary value
+ * Values come from a per-thread ChaCha20 keystream seeded with getrandom(),
+ * so no system call is made outside of the periodic reseeds.
+ *
+ * @return random canary value, or 0 if no entropy is available
+ */
+canary_t get_random_canary()
+{
+    canary_t canary = 0;
+
+    while (canary == 0)
+    {
+        if (canary_rng.index >= CANARY_BUFFER_WORDS && refill_canary_buffer() == -1)
+            return 0;
+
+        canary = canary_rng.buffer[canary_rng.index];
+        canary_rng.buffer[canary_rng.index++] = 0;
+
+        canary &= 0x00FFFFFF; // Create a null byte at the beginning
+    }
 
-    return random;
+    return canary;
 }
@@ -1,6 +1,14 @@
 #include <string.h>   // strcpy, strncpy
 #include <sys/mman.h> // mmap, munmap
 #include <time.h>     // time
+#include <pthread.h>  // pthread_create, pthread_join
+#include <stdio.h>    // fopen, fgets
+#include <stdlib.h>   // mkstemp, setenv
+#include <unistd.h>   // close, unlink
+#include <errno.h>    // errno, EINVAL
+#include <signal.h>   // SIGSEGV, sigaction
+#include <setjmp.h>   // sigsetjmp, siglongjmp
+#include <sys/wait.h> // waitpid
 
 #include <criterion/criterion.h>
 
@@ -10,6 +18,10 @@
 
 extern int log_fd;
 extern chunk_list_t *cl_metadata_head;
+extern unsigned int arena_count;
+extern long decay_ms;
+extern size_t quarantine_count;
+extern size_t quarantine_size;
 
 void setup(void)
 {
@@ -44,6 +56,88 @@ Test(initialization, initialize)
     cr_expect(ptr != NULL);
 }
 
+/* LOGGING */
+
+Test(logging, ring_buffer)
+{
+    char path[] = "/tmp/msm_logging_XXXXXX";
+    int fd = mkstemp(path);
+    cr_assert(fd != -1);
+    close(fd);
+
+    setenv("MSM_OUTPUT", path, 1);
+    log_fd = -1;
+    init_logging();
+
+    // The ring is flushed as it fills up, so no record is dropped
+    for (int i = 0; i < 3 * LOG_RING_RECORDS; i++)
+        LOG_INFO("record %d", i);
+    close_logging();
+
+    FILE *file = fopen(path, "r");
+    cr_assert(file != NULL);
+
+    char line[LOG_RECORD_SIZE];
+    int count = 0;
+    while (fgets(line, sizeof(line), file) != NULL)
+    {
+        char expected[32];
+        snprintf(expected, sizeof(expected), "record %d\n", count);
+        if (count < 3 * LOG_RING_RECORDS)
+            cr_expect(strstr(line, expected) != NULL);
+        count++;
+    }
+    cr_expect(count == 3 * LOG_RING_RECORDS + 1); // "Closing log file" ends the log
+
+    fclose(file);
+    unlink(path);
+}
+
+Test(logging, binary_trace)
+{
+    char path[] = "/tmp/msm_trace_XXXXXX";
+    int fd = mkstemp(path);
+    cr_assert(fd != -1);
+    close(fd);
+
+    setenv("MSM_TRACE", path, 1);
+    init_trace();
+
+    for (int i = 0; i < 2 * TRACE_RING_RECORDS; i++)
+        trace_event(i % 2 ? TRACE_FREE : TRACE_MALLOC, i % 2 ? (void *)(uintptr_t)(i * 16) : NULL, i % 2 ? NULL : (void *)(uintptr_t)(i * 16 + 16), i);
+    close_trace();
+
+    // Nothing is recorded once the trace is closed
+    trace_event(TRACE_MALLOC, NULL, NULL, 0);
+
+    FILE *file = fopen(path, "rb");
+    cr_assert(file != NULL);
+
+    trace_header_t header;
+    cr_assert(fread(&header, sizeof(header), 1, file) == 1);
+    cr_expect(memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) == 0);
+    cr_expect(header.version == TRACE_VERSION);
+    cr_expect(header.record_size == sizeof(trace_record_t));
+
+    trace_record_t record;
+    uint64_t timestamp = 0;
+    int count = 0;
+    while (fread(&record, sizeof(record), 1, file) == 1)
+    {
+        cr_expect(record.op == (count % 2 ? TRACE_FREE : TRACE_MALLOC));
+        cr_expect(record.size == (uint64_t)count);
+        cr_expect((count % 2 ? record.ptr : record.address) == (uint64_t)(count * 16 + (count % 2 ? 0 : 16)));
+        cr_expect(record.thread != 0);
+        cr_expect(record.timestamp >= timestamp);
+        timestamp = record.timestamp;
+        count++;
+    }
+    cr_expect(count == 2 * TRACE_RING_RECORDS);
+
+    fclose(file);
+    unlink(path);
+}
+
 /* ALLOCATION */
 
 Test(allocation, basic_allocation)
@@ -131,6 +225,51 @@ Test(allocation, reallocate_memory_optimization)
     my_free(new_ptr);
 }
 
+Test(allocation, reallocate_shrink_returns_tail)
+{
+    char *ptr = my_malloc(2000);
+    cr_assert(ptr != NULL);
+    strcpy(ptr, "Hello");
+
+    char *new_ptr = my_realloc(ptr, 100);
+    cr_expect(new_ptr == ptr);
+    cr_expect(strcmp(new_ptr, "Hello") == 0);
+
+    // The tail is a free chunk right after the canary
+    chunk_list_t *chunk = get_chunk(ptr);
+    cr_expect(get_chunk_size(chunk) == 112);
+    cr_expect(get_chunk_state(chunk->next) == FREE);
+    cr_expect(chunk->next->data == ptr + 112 + sizeof(canary_t));
+
+    my_free(new_ptr);
+}
+
+Test(allocation, reallocate_grow_in_place)
+{
+    // Bigger than THREAD_CACHE_MAX_SIZE so the chunks are really freed
+    char *ptr = my_malloc(1100);
+    void *next = my_malloc(1100);
+    void *guard = my_malloc(1100);
+    strcpy(ptr, "Hello");
+
+    my_free(next);
+
+    // The freed neighbour is absorbed instead of copying the chunk
+    char *new_ptr = my_realloc(ptr, 2000);
+    cr_expect(new_ptr == ptr);
+    cr_expect(strcmp(new_ptr, "Hello") == 0);
+    cr_expect(get_chunk_size(get_chunk(ptr)) >= 2000);
+    cr_expect(get_chunk(next) == NULL);
+
+    // The neighbour is used, growing further has to copy
+    new_ptr = my_realloc(ptr, 4000);
+    cr_expect(new_ptr != ptr);
+    cr_expect(strcmp(new_ptr, "Hello") == 0);
+
+    my_free(new_ptr);
+    my_free(guard);
+}
+
 Test(allocation, calloc)
 {
     void *ptr = my_calloc(10, 20);
@@ -142,6 +281,34 @@ Test(allocation, calloc)
     my_free(ptr);
 }
 
+Test(allocation, calloc_overflow)
+{
+    errno = 0;
+    cr_expect(my_calloc(SIZE_MAX / 2, 3) == NULL);
+    cr_expect(errno == ENOMEM);
+    cr_expect(my_calloc((size_t)1 << 33, (size_t)1 << 33) == NULL);
+}
+
+Test(allocation, calloc_reused_chunk)
+{
+    // Chunks freed with content are cleared, whatever their size
+    size_t sizes[] = {700, 5000, 100 * 1024, LARGE_CHUNK_THRESHOLD};
+    char *guard = my_malloc(600);
+    for (int i = 0; i < 4; i++)
+    {
+        char *ptr = my_malloc(sizes[i]);
+        memset(ptr, 0xAA, sizes[i]);
+        my_free(ptr);
+
+        char *zeroed = my_calloc(1, sizes[i] - CHUNK_ALIGNMENT);
+        cr_assert(zeroed != NULL);
+        for (size_t j = 0; j < sizes[i] - CHUNK_ALIGNMENT; j++)
+            cr_assert(zeroed[j] == 0, "byte %zu of %zu is not zero", j, sizes[i]);
+        my_free(zeroed);
+    }
+    my_free(guard);
+}
+
 // Stress tests
 Test(allocation, random_allocations)
 {
@@ -252,9 +419,311 @@ Test(security, memory_leak_detection)
     void *ptr = my_malloc(100);
     cr_expect(ptr != NULL);
 
+    // Leaks are only reported, the chunks are left alone
+    char *leak = my_malloc(2000);
+    char *freed = my_malloc(2000);
+    my_free(freed);
+    check_memory_leaks();
+    cr_expect(get_chunk_state(get_chunk(leak)) == USED);
+    cr_expect(get_chunk_state(get_chunk(freed)) == FREE);
+
     // Memory leak
 }
 
+Test(security, random_canaries)
+{
+    canary_t first = get_random_canary();
+    int distinct = 0;
+
+    // Cross several refills of the canary buffer
+    for (int i = 0; i < 10 * CANARY_BUFFER_WORDS; i++)
+    {
+        canary_t canary = get_random_canary();
+        cr_assert(canary != 0);
+        cr_expect((canary & 0xFF000000) == 0);
+        if (canary != first)
+            distinct++;
+    }
+
+    cr_expect(distinct > 0);
+}
+
+Test(security, fork_canaries)
+{
+    // Seed the generator of this thread, then fork with keystream left in its buffer
+    cr_assert(my_malloc(16) != NULL);
+
+    int fds[2];
+    cr_assert(pipe(fds) == 0);
+
+    pid_t pid = fork();
+    cr_assert(pid != -1);
+    if (pid == 0)
+    {
+        canary_t canaries[4];
+        for (int i = 0; i < 4; i++)
+            canaries[i] = get_random_canary();
+        _exit(write(fds[1], canaries, sizeof(canaries)) == sizeof(canaries) ? 0 : 1);
+    }
+
+    canary_t child[4];
+    cr_assert(read(fds[0], child, sizeof(child)) == sizeof(child));
+    waitpid(pid, NULL, 0);
+    close(fds[0]);
+    close(fds[1]);
+
+    // The child draws from its own key, not from the parent's
+    int same = 0;
+    for (int i = 0; i < 4; i++)
+        same += get_random_canary() == child[i];
+    cr_expect(same < 4);
+}
+
+Test(security, heap_scanner)
+{
+    uint8_t *chunk = my_malloc(4000);
+    uint8_t *slot = my_malloc(100);
+    cr_assert(chunk != NULL && slot != NULL);
+
+    scan_cursor_t cursor;
+    memset(&cursor, 0, sizeof(cursor));
+    cr_expect(scan_heap(&cursor) == 0);
+
+    heap_stats_t stats;
+    get_heap_stats(&stats);
+    size_t failures = stats.counters.canary_failures;
+
+    // Overflows are found while the blocks are still in use
+    chunk[4000] = ~chunk[4000];
+    slot[get_slab(slot)->slot_size - sizeof(canary_t)] ^= 1;
+    cr_expect(scan_heap(&cursor) == 2);
+    get_heap_stats(&stats);
+    cr_expect(stats.counters.canary_failures == failures + 2);
+
+    // A block is only reported once
+    cr_expect(scan_heap(&cursor) == 2);
+    get_heap_stats(&stats);
+    cr_expect(stats.counters.canary_failures == failures + 2);
+
+    chunk[4000] = ~chunk[4000];
+    slot[get_slab(slot)->slot_size - sizeof(canary_t)] ^= 1;
+    cr_expect(scan_heap(&cursor) == 0);
+
+    // The background thread starts and stops on demand
+    cr_expect(start_heap_scanner(100) == 0);
+    cr_expect(start_heap_scanner(100) == 0);
+    stop_heap_scanner();
+
+    my_free(chunk);
+    my_free(slot);
+}
+
+Test(security, guarded_allocations)
+{
+    setenv("MSM_GUARD_SAMPLE", "2", 1);
+    cr_assert(init_heap() != NULL);
+
+    // One allocation in two ends right before a guard page
+    uint8_t *first = my_malloc(100);
+    uint8_t *guarded = my_malloc(100);
+    cr_assert(first != NULL && guarded != NULL);
+    cr_expect(!in_guard_range(first));
+    cr_expect(in_guard_range(guarded));
+    cr_expect((uintptr_t)(guarded + 112) % 4096 == 0);
+    cr_expect(my_malloc_usable_size(guarded) == 112);
+
+    memset(guarded, 0x5a, 100);
+    uint8_t *moved = my_realloc(guarded, 200);
+    cr_assert(moved != NULL);
+    cr_expect(moved != guarded);
+    cr_expect(moved[99] == 0x5a);
+    cr_expect(my_malloc_usable_size(guarded) == 0);
+
+    // A freed page reads as zero when it is reused
+    uint8_t *zeroed = NULL;
+    for (int i = 0; i < 2 * GUARD_SLOT_COUNT && zeroed == NULL; i++)
+    {
+        uint8_t *ptr = my_malloc(100);
+        if (ptr == guarded)
+            zeroed = ptr;
+    }
+    cr_assert(zeroed != NULL);
+    cr_expect(zeroed[99] == 0);
+
+    my_free(first);
+    my_free(moved);
+}
+
+Test(security, guard_page_fault)
+{
+    char path[] = "/tmp/msm_guard_XXXXXX";
+    int fd = mkstemp(path);
+    cr_assert(fd != -1);
+    close(fd);
+
+    setenv("MSM_OUTPUT", path, 1);
+    setenv("MSM_GUARD_SAMPLE", "1", 1);
+
+    pid_t pid = fork();
+    cr_assert(pid != -1);
+    if (pid == 0)
+    {
+        // Writing past the end of the block faults on the guard page
+        init_heap();
+        volatile uint8_t *ptr = my_malloc(64);
+        ptr[64] = 1;
+        _exit(0);
+    }
+
+    int status = 0;
+    waitpid(pid, &status, 0);
+    cr_expect(WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV);
+
+    FILE *file = fopen(path, "r");
+    cr_assert(file != NULL);
+
+    char line[LOG_RECORD_SIZE];
+    int reported = 0;
+    while (fgets(line, sizeof(line), file) != NULL)
+        if (strstr(line, "overflow") != NULL && strstr(line, "of size 64") != NULL)
+            reported = 1;
+    cr_expect(reported);
+
+    fclose(file);
+    unlink(path);
+}
+
+Test(security, quarantine)
+{
+    setenv("MSM_QUARANTINE_SIZE", "16384", 1);
+    setenv("MSM_QUARANTINE_COUNT", "64", 1);
+    cr_assert(init_heap() != NULL);
+
+    // A freed block is poisoned and not handed out again right away
+    uint8_t *chunk = my_malloc(2000);
+    uint8_t *slot = my_malloc(100);
+    cr_assert(chunk != NULL && slot != NULL);
+    my_free(chunk);
+    my_free(slot);
+    cr_expect(chunk[0] == QUARANTINE_POISON && chunk[1999] == QUARANTINE_POISON);
+    cr_expect(slot[0] == QUARANTINE_POISON);
+    cr_expect(my_malloc_usable_size(chunk) == 0);
+    cr_expect(my_malloc_usable_size(slot) == 0);
+
+    uint8_t *again = my_malloc(2000);
+    cr_expect(again != chunk);
+    my_free(again);
+
+    // Double frees are still caught while the block is quarantined
+    my_free(slot);
+    my_free(chunk);
+
+    // A write after free is found when the block leaves the quarantine
+    heap_stats_t stats;
+    get_heap_stats(&stats);
+    size_t failures = stats.counters.poison_failures;
+    chunk[1000] = 0;
+    slot[50] = 0;
+    drain_quarantine();
+    get_heap_stats(&stats);
+    cr_expect(stats.counters.poison_failures == failures + 2);
+    cr_expect(quarantine_count == 0);
+
+    // The quarantine is bounded by both its number of blocks and its bytes
+    for (int i = 0; i < 200; i++)
+    {
+        my_free(my_malloc(100));
+        cr_expect(quarantine_count <= 64);
+    }
+    for (int i = 0; i < 200; i++)
+    {
+        my_free(my_malloc(1000));
+        cr_expect(quarantine_size <= 16384);
+    }
+    drain_quarantine();
+    get_heap_stats(&stats);
+    cr_expect(stats.counters.poison_failures == failures + 2);
+}
+
+Test(security, check_poison)
+{
+    uint8_t buffer[300];
+    memset(buffer, QUARANTINE_POISON, sizeof(buffer));
+    cr_expect(check_poison(buffer, sizeof(buffer)) == sizeof(buffer));
+
+    buffer[130] = 0;
+    cr_expect(check_poison(buffer, sizeof(buffer)) == 130);
+    buffer[130] = QUARANTINE_POISON;
+
+    buffer[299] = 0;
+    cr_expect(check_poison(buffer, sizeof(buffer)) == 299);
+}
+
+static sigjmp_buf fault_recovery;
+
+static void recover_from_fault(int sig)
+{
+    (void)sig;
+    siglongjmp(fault_recovery, 1);
+}
+
+Test(security, guard_fault_forwarding)
+{
+    char path[] = "/tmp/msm_forward_XXXXXX";
+    int fd = mkstemp(path);
+    cr_assert(fd != -1);
+    close(fd);
+
+    // The application handler is installed before the one of the guarded pool
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = recover_from_fault;
+    sigemptyset(&action.sa_mask);
+    cr_assert(sigaction(SIGSEGV, &action, NULL) == 0);
+
+    setenv("MSM_OUTPUT", path, 1);
+    setenv("MSM_GUARD_SAMPLE", "1", 1);
+    cr_assert(init_heap() != NULL);
+
+    // A fault out of the guarded pool reaches the application, which recovers from it
+    volatile uint8_t *page = mmap(NULL, 4096, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    cr_assert(page != MAP_FAILED);
+    int recovered = 0;
+    if (sigsetjmp(fault_recovery, 1) == 0)
+        page[0] = 1;
+    else
+        recovered = 1;
+    cr_expect(recovered);
+
+    struct sigaction current;
+    sigaction(SIGSEGV, NULL, &current);
+    cr_expect((current.sa_flags & SA_SIGINFO) != 0);
+
+    // A fault in the guarded pool is still reported, then forwarded to the application
+    volatile uint8_t *ptr = my_malloc(64);
+    cr_assert(in_guard_range((void *)ptr));
+    recovered = 0;
+    if (sigsetjmp(fault_recovery, 1) == 0)
+        ptr[64] = 1;
+    else
+        recovered = 1;
+    cr_expect(recovered);
+
+    FILE *file = fopen(path, "r");
+    cr_assert(file != NULL);
+
+    char line[LOG_RECORD_SIZE];
+    int reported = 0;
+    while (fgets(line, sizeof(line), file) != NULL)
+        if (strstr(line, "[ERROR] handle_guard_fault - overflow at 0x") != NULL && strstr(line, "of size 64\n") != NULL)
+            reported = 1;
+    cr_expect(reported);
+
+    fclose(file);
+    unlink(path);
+    munmap((void *)page, 4096);
+}
+
 /* CHUNK LIST */
 
 Test(chunk_list, find_free_block)
@@ -266,11 +735,889 @@ Test(chunk_list, find_free_block)
 
     my_free(ptr1);
 
-    chunk_list_t *empty_block = find_free_chunk(100);
+    chunk_list_t *empty_block = find_free_chunk(get_thread_arena(), 100);
+
+    cr_expect(empty_block != NULL);
+    cr_expect(get_chunk_state(empty_block) == FREE);
+    cr_expect(get_chunk_size(empty_block) >= 100);
+
+    my_free(ptr2);
+}
+
+Test(chunk_list, size_classes)
+{
+    // Size classes must be monotonic so bigger bins always hold bigger chunks
+    for (size_t size = 1; size < (1 << 22); size += 13)
+        cr_expect(get_size_class(size) <= get_size_class(size + 13));
+
+    cr_expect(get_size_class(0) == 0);
+    cr_expect(get_size_class((size_t)-1) == BIN_COUNT - 1);
+}
 
+Test(chunk_list, find_free_block_in_bigger_class)
+{
+    void *small = my_malloc(32);
+    void *big = my_malloc(2000);
+    void *guard = my_malloc(32);
+
+    my_free(big);
+
+    chunk_list_t *empty_block = find_free_chunk(get_thread_arena(), 1500);
     cr_expect(empty_block != NULL);
-    cr_expect(empty_block->state == FREE);
-    cr_expect(empty_block->size >= 100);
+    cr_expect(get_chunk_state(empty_block) == FREE);
+    cr_expect(get_chunk_size(empty_block) >= 1500 + sizeof(canary_t));
+
+    my_free(small);
+    my_free(guard);
+}
+
+Test(chunk_list, free_bins_grow)
+{
+    // Every other chunk is freed, so none of them can merge with a neighbour
+    size_t count = 2 * (FREE_BIN_MIN_CAPACITY + 8);
+    void **ptrs = my_malloc(count * sizeof(void *));
+    for (size_t i = 0; i < count; i++)
+        ptrs[i] = my_malloc(2000);
+
+    arena_t *arena = get_thread_arena();
+    unsigned int class = get_size_class(get_chunk_size(get_chunk(ptrs[0])));
+    uint32_t binned = arena->free_counts[class];
+
+    for (size_t i = 0; i < count; i += 2)
+        my_free(ptrs[i]);
+
+    // A full bin is grown instead of dropping the chunks
+    cr_expect(arena->free_counts[class] == binned + count / 2);
+    cr_expect(arena->free_capacities[class] > FREE_BIN_MIN_CAPACITY);
+    cr_expect(find_free_chunk(arena, 2000) != NULL);
+
+    for (size_t i = 1; i < count; i += 2)
+        my_free(ptrs[i]);
+    my_free(ptrs);
+}
+
+Test(chunk_list, get_chunk_rejects_foreign_and_interior_pointers)
+{
+    int on_stack = 0;
+    char *ptr = my_malloc(600);
+    cr_expect(ptr != NULL);
+
+    chunk_list_t *chunk = get_chunk(ptr);
+    cr_expect(chunk != NULL);
+    cr_expect(chunk->data == ptr);
+    cr_expect(get_chunk_state(chunk) == USED);
+
+    cr_expect(get_chunk(ptr + 16) == NULL);
+    cr_expect(get_chunk(&on_stack) == NULL);
+
+    my_free(ptr);
+}
+
+Test(chunk_list, get_chunk_many_chunks)
+{
+    void *ptrs[2000];
+    for (int i = 0; i < 2000; i++)
+        ptrs[i] = my_malloc(600);
+
+    // Every chunk must still be found after the index has grown
+    for (int i = 0; i < 2000; i++)
+    {
+        cr_expect(ptrs[i] != NULL);
+        cr_expect(get_chunk(ptrs[i]) != NULL);
+    }
+
+    for (int i = 0; i < 2000; i++)
+        my_free(ptrs[i]);
+}
+
+Test(chunk_list, packed_descriptor)
+{
+    // The size, the state and the arena share a word, the canary shares one with the free links
+    cr_expect(sizeof(chunk_list_t) == 40);
+
+    char *ptr = my_malloc(600);
+    chunk_list_t *chunk = get_chunk(ptr);
+    cr_expect(get_chunk_size(chunk) == ALIGN_CHUNK_SIZE(600));
+    cr_expect(get_chunk_state(chunk) == USED);
+    cr_expect(get_chunk_arena(chunk) == get_thread_arena());
+
+    set_chunk_size(chunk, 608);
+    cr_expect(get_chunk_state(chunk) == USED);
+    cr_expect(get_chunk_arena(chunk) == get_thread_arena());
+    cr_expect(swap_chunk_state(chunk, FREE, USED) == 0);
+    cr_expect(get_chunk_size(chunk) == 608);
+    my_free(ptr);
+
+    // A free chunk reused whole gets a canary again
+    char *before = my_malloc(2000);
+    char *whole = my_malloc(2000);
+    char *after = my_malloc(2000);
+    my_free(whole);
+
+    heap_stats_t stats;
+    get_heap_stats(&stats);
+    size_t failures = stats.counters.canary_failures;
+
+    cr_expect(my_malloc(1984) == whole);
+    my_free(whole);
+
+    get_heap_stats(&stats);
+    cr_expect(stats.counters.canary_failures == failures);
+
+    my_free(before);
+    my_free(after);
+}
+
+Test(chunk_list, merge_chunk_neighbours)
+{
+    // Bigger than THREAD_CACHE_MAX_SIZE so the chunks are really freed
+    void *ptr1 = my_malloc(1100);
+    void *ptr2 = my_malloc(1100);
+    void *ptr3 = my_malloc(1100);
+
+    my_free(ptr1);
+    my_free(ptr3);
+
+    // Freeing the middle chunk merges it with both of its neighbours
+    my_free(ptr2);
+
+    chunk_list_t *chunk = get_chunk(ptr1);
+    cr_expect(chunk != NULL);
+    cr_expect(get_chunk_state(chunk) == FREE);
+    cr_expect(get_chunk_size(chunk) == DATA_EXTENT_MIN_SIZE - sizeof(canary_t));
+    cr_expect(get_chunk(ptr2) == NULL);
+    cr_expect(get_chunk(ptr3) == NULL);
+}
+
+Test(chunk_list, data_pool_grows_in_extents)
+{
+    init_heap();
+    arena_t *arena = get_thread_arena();
+    size_t extent_size = arena->extent_size;
+
+    // Allocations are carved from the first extent while they fit in it
+    for (int i = 0; i < 5; i++)
+        cr_assert(my_malloc(200 * 1024) != NULL);
+    cr_expect(arena->extent_size == extent_size);
+
+    // A miss commits the next extent, twice as big, right after the previous one
+    void *ptr = my_malloc(200 * 1024);
+    cr_assert(ptr != NULL);
+    cr_expect(arena->extent_size == extent_size * 2);
+    cr_expect(arena->data_end == arena->data_start + DATA_EXTENT_MIN_SIZE + extent_size);
+    cr_expect((uint8_t *)ptr >= arena->data_start && (uint8_t *)ptr < arena->data_end);
+
+    // The rest of the extent is a free chunk ending the data pool
+    chunk_list_t *rest = arena->tail;
+    cr_expect(rest == get_chunk(ptr)->next);
+    cr_expect(get_chunk_state(rest) == FREE);
+    cr_expect((uint8_t *)rest->data + get_chunk_size(rest) + sizeof(canary_t) == arena->data_end);
+}
+
+Test(chunk_list, large_allocation)
+{
+    size_t size = 4 * LARGE_CHUNK_THRESHOLD;
+    uint8_t *ptr = my_malloc(size);
+    cr_assert(ptr != NULL);
+
+    // Large chunks have their own mapping, out of the arenas
+    cr_expect(!in_heap_range(ptr));
+    chunk_list_t *chunk = get_chunk(ptr);
+    cr_assert(chunk != NULL);
+    cr_expect(get_chunk_state(chunk) == USED);
+    cr_expect(get_chunk_size(chunk) >= size);
+
+    for (size_t i = 0; i < size; i += 4096)
+        ptr[i] = (uint8_t)(i / 4096);
+
+    // Growing and shrinking keeps the content
+    ptr = my_realloc(ptr, 64 * size);
+    cr_assert(ptr != NULL);
+    cr_expect(get_chunk_size(get_chunk(ptr)) >= 64 * size);
+    for (size_t i = 0; i < size; i += 4096)
+        cr_expect(ptr[i] == (uint8_t)(i / 4096));
+
+    ptr = my_realloc(ptr, size);
+    cr_assert(ptr != NULL);
+    for (size_t i = 0; i < size; i += 4096)
+        cr_expect(ptr[i] == (uint8_t)(i / 4096));
+
+    // Below the threshold, the data moves back to the arenas
+    ptr = my_realloc(ptr, 4096);
+    cr_assert(ptr != NULL);
+    cr_expect(in_heap_range(ptr));
+    cr_expect(ptr[0] == 0);
+
+    my_free(ptr);
+}
+
+Test(chunk_list, large_double_free)
+{
+    void *ptr = my_malloc(LARGE_CHUNK_THRESHOLD);
+    cr_assert(ptr != NULL);
+
+    my_free(ptr);
+    cr_expect(get_chunk(ptr) == NULL);
+
+    // The mapping is gone, the second free must not touch it
+    my_free(ptr);
+}
+
+Test(chunk_list, heap_range)
+{
+    int on_stack = 0;
+    void *ptr = my_malloc(100);
+    void *foreign = malloc(100);
+
+    cr_expect(in_heap_range(ptr));
+    cr_expect(!in_heap_range(&on_stack));
+    cr_expect(!in_heap_range(foreign));
+
+    // Freeing a foreign pointer is rejected without touching it
+    my_free(foreign);
+    free(foreign);
+    my_free(ptr);
+}
+
+Test(chunk_list, recycled_descriptors)
+{
+    void *ptr1 = my_malloc(1100);
+    void *ptr2 = my_malloc(1100);
+    chunk_list_t *chunk2 = get_chunk(ptr2);
+
+    // Freeing the second chunk merges it into the first one
+    my_free(ptr1);
+    my_free(ptr2);
+
+    arena_t *arena = get_thread_arena();
+    cr_expect(arena->free_metadata != NULL);
+
+    // The next split takes its descriptor back from the free list
+    my_malloc(1100);
+    void *ptr3 = my_malloc(1100);
+    cr_expect(get_chunk(ptr3) == chunk2);
+}
+
+Test(chunk_list, metadata_pool_tracks_live_heap)
+{
+    // Many more allocations than the first metadata block can describe
+    for (int i = 0; i < 100000; i++)
+    {
+        void *ptr = my_malloc(2000);
+        cr_assert(ptr != NULL);
+        my_free(ptr);
+    }
+
+    arena_t *arena = get_thread_arena();
+    cr_expect(arena->metadata != NULL);
+    cr_expect(arena->metadata->next == NULL);
+}
+
+/* SLABS */
+
+Test(slabs, slab_allocation)
+{
+    char *ptr1 = my_malloc(100);
+    char *ptr2 = my_malloc(100);
+    cr_assert(ptr1 != NULL && ptr2 != NULL);
+
+    // Slots are aligned and have no descriptor
+    cr_expect(in_slab_range(ptr1));
+    cr_expect((uintptr_t)ptr1 % CHUNK_ALIGNMENT == 0);
+    cr_expect(get_chunk(ptr1) == NULL);
+
+    slab_t *slab = get_slab(ptr1);
+    cr_expect(slab->slot_size == 112);
+    cr_expect(ptr2 == ptr1 + slab->slot_size);
+    cr_expect(slab->free_count == slab->slot_count - 2);
+
+    my_free(ptr1);
+    my_free(ptr2);
+    cr_expect(slab->free_count == slab->slot_count);
+}
+
+Test(slabs, slot_canaries)
+{
+    uint8_t *slots[8];
+    canary_t canaries[8];
+    for (int i = 0; i < 8; i++)
+    {
+        slots[i] = my_malloc(16);
+        cr_assert(slots[i] != NULL);
+        memcpy(&canaries[i], slots[i] + get_slab(slots[i])->slot_size - sizeof(canary_t), sizeof(canary_t));
+    }
+    cr_assert(get_slab(slots[0]) == get_slab(slots[7]));
+
+    // Canaries are not a linear function of the slab secret: it can't be recovered from one of them
+    int distinct = 0;
+    unsigned int slot_size = get_slab(slots[0])->slot_size;
+    canary_t first = (uintptr_t)slots[0] % SLAB_SIZE / slot_size;
+    for (unsigned int i = 1; i < 8; i++)
+    {
+        canary_t slot = (uintptr_t)slots[i] % SLAB_SIZE / slot_size;
+        distinct += (canaries[i] ^ canaries[0]) != (((slot * 0x9E3779B1u) ^ (first * 0x9E3779B1u)) & 0x00FFFFFF);
+    }
+    cr_expect(distinct > 0);
+
+    for (int i = 0; i < 8; i++)
+        my_free(slots[i]);
+}
+
+Test(slabs, slab_bitmap_reuse)
+{
+    void *first = my_malloc(500);
+    slab_t *slab = get_slab(first);
+
+    // Fill the slab, the next slot comes from another one
+    for (unsigned int i = 1; i < slab->slot_count; i++)
+        my_malloc(500);
+    void *other = my_malloc(500);
+    cr_expect(get_slab(other) != slab);
+
+    // The freed slot is the first one found by the bit scan
+    my_free(first);
+    cr_expect(my_malloc(500) == first);
+}
+
+Test(slabs, slab_double_free_detection)
+{
+    void *ptr = my_malloc(32);
+    slab_t *slab = get_slab(ptr);
+    unsigned int free_count = slab->free_count;
+
+    my_free(ptr);
+    my_free(ptr);
+    cr_expect(slab->free_count == free_count + 1);
+
+    // Interior pointers are rejected too
+    void *ptr1 = my_malloc(32);
+    my_free((char *)ptr1 + 8);
+    cr_expect(slab->free_count == free_count);
+
+    void *ptr2 = my_malloc(32);
+    cr_expect(ptr1 != ptr2);
+}
+
+Test(slabs, slab_reallocation)
+{
+    char *ptr = my_malloc(10);
+    strcpy(ptr, "Hello");
+
+    // The slot is kept while the new size fits in it
+    cr_expect(my_realloc(ptr, 20) == ptr);
+
+    char *new_ptr = my_realloc(ptr, 400);
+    cr_expect(new_ptr != ptr);
+    cr_expect(strcmp(new_ptr, "Hello") == 0);
+    cr_expect(get_slab(new_ptr)->slot_size == 416);
+
+    my_free(new_ptr);
+}
+
+/* ALIGNED ALLOCATION */
+
+Test(aligned, aligned_allocation)
+{
+    size_t sizes[] = {1, 100, 600, 5000, 100 * 1024, LARGE_CHUNK_THRESHOLD};
+    void *ptrs[14][6];
+
+    for (int shift = 4; shift < 18; shift++)
+    {
+        size_t alignment = (size_t)1 << shift;
+        for (int i = 0; i < 6; i++)
+        {
+            uint8_t *ptr = my_memalign(alignment, sizes[i]);
+            cr_assert(ptr != NULL);
+            cr_expect((uintptr_t)ptr % alignment == 0, "%p is not aligned on %zu", (void *)ptr, alignment);
+            memset(ptr, shift, sizes[i]);
+            ptrs[shift - 4][i] = ptr;
+        }
+    }
+
+    // Blocks don't overlap and their canaries are intact
+    for (int shift = 4; shift < 18; shift++)
+        for (int i = 0; i < 6; i++)
+        {
+            uint8_t *ptr = ptrs[shift - 4][i];
+            cr_expect(ptr[0] == shift && ptr[sizes[i] - 1] == shift);
+            my_free(ptr);
+        }
+
+    heap_stats_t stats;
+    get_heap_stats(&stats);
+    cr_expect(stats.counters.canary_failures == 0);
+}
+
+Test(aligned, aligned_chunk_carving)
+{
+    // The space before the aligned address is given back as a free chunk
+    char *before = my_malloc(600);
+    char *ptr = my_memalign(4096, 8192);
+    cr_assert(ptr != NULL);
+    cr_expect((uintptr_t)ptr % 4096 == 0);
+    cr_expect(in_heap_range(ptr));
+
+    chunk_list_t *chunk = get_chunk(ptr);
+    cr_assert(chunk != NULL);
+    cr_expect(get_chunk_size(chunk) == 8192);
+    cr_expect(chunk->prev != NULL && get_chunk_state(chunk->prev) == FREE);
+
+    // Overflows of aligned chunks are detected
+    heap_stats_t stats;
+    get_heap_stats(&stats);
+    size_t failures = stats.counters.canary_failures;
+    ptr[8192] = 'X';
+    my_free(ptr);
+    get_heap_stats(&stats);
+    cr_expect(stats.counters.canary_failures == failures + 1);
+
+    my_free(before);
+}
+
+Test(aligned, aligned_entry_points)
+{
+    void *ptr = NULL;
+    cr_expect(my_posix_memalign(&ptr, 3, 64) == EINVAL);
+    cr_expect(my_posix_memalign(&ptr, sizeof(void *) / 2, 64) == EINVAL);
+    cr_expect(my_posix_memalign(&ptr, 64, 0) == 0 && ptr == NULL);
+    cr_expect(my_posix_memalign(&ptr, 64, 100) == 0);
+    cr_expect((uintptr_t)ptr % 64 == 0);
+    my_free(ptr);
+
+    errno = 0;
+    cr_expect(my_aligned_alloc(24, 64) == NULL);
+    cr_expect(errno == EINVAL);
+
+    // memalign rounds the alignment up to a power of two
+    ptr = my_memalign(24, 100);
+    cr_expect((uintptr_t)ptr % 32 == 0);
+    my_free(ptr);
+
+    ptr = my_valloc(10);
+    cr_expect((uintptr_t)ptr % 4096 == 0);
+    my_free(ptr);
+
+    uint8_t *pages = my_pvalloc(5000);
+    cr_assert(pages != NULL);
+    cr_expect((uintptr_t)pages % 4096 == 0);
+    memset(pages, 1, 8192);
+    my_free(pages);
+
+    // Aligned large blocks can be reallocated back into the arenas
+    uint8_t *large = my_memalign(1 << 20, 100);
+    cr_assert(large != NULL);
+    cr_expect((uintptr_t)large % (1 << 20) == 0);
+    memset(large, 7, 100);
+    large = my_realloc(large, 200);
+    cr_assert(large != NULL);
+    cr_expect(large[99] == 7);
+    my_free(large);
+}
+
+Test(aligned, usable_size_and_sized_free)
+{
+    cr_expect(my_malloc_usable_size(NULL) == 0);
+
+    // Slots, chunks and large chunks report their capacity without the canary
+    size_t sizes[] = {10, 100, 600, 5000, LARGE_CHUNK_THRESHOLD + 1};
+    for (int i = 0; i < 5; i++)
+    {
+        uint8_t *ptr = my_malloc(sizes[i]);
+        size_t usable = my_malloc_usable_size(ptr);
+        cr_expect(usable >= sizes[i]);
+
+        // The whole capacity can be written without touching the canary
+        memset(ptr, 0xAA, usable);
+        my_free_sized(ptr, sizes[i]);
+    }
+
+    heap_stats_t stats;
+    get_heap_stats(&stats);
+    cr_expect(stats.counters.canary_failures == 0);
+
+    uint8_t *aligned = my_aligned_alloc(256, 3000);
+    cr_expect(my_malloc_usable_size(aligned) >= 3000);
+    my_free_aligned_sized(aligned, 256, 3000);
+
+    my_free_sized(NULL, 10);
+}
+
+/* DECAY */
+
+/**
+ * @brief Counts the pages of a range which are backed by memory.
+ */
+static size_t count_resident_pages(void *ptr, size_t size)
+{
+    uintptr_t first = ((uintptr_t)ptr + 4095) & ~(uintptr_t)4095;
+    uintptr_t last = ((uintptr_t)ptr + size) & ~(uintptr_t)4095;
+    unsigned char pages[256];
+    size_t resident = 0;
+
+    cr_assert((last - first) / 4096 <= sizeof(pages));
+    cr_assert(mincore((void *)first, last - first, pages) == 0);
+    for (size_t i = 0; i < (last - first) / 4096; i++)
+        resident += pages[i] & 1;
+
+    return resident;
+}
+
+Test(decay, free_pages_decay)
+{
+    init_heap();
+
+    // Free pages stay committed for the decay time
+    void *ptr = my_malloc(200 * 1024);
+    memset(ptr, 0xAA, 200 * 1024);
+    my_free(ptr);
+    cr_expect(count_resident_pages(ptr, 200 * 1024) > 0);
+
+    // Once it is over, the next operation of the arena purges them
+    decay_ms = 20;
+    nanosleep(&(struct timespec){.tv_nsec = 50 * 1000 * 1000}, NULL);
+    my_free(my_malloc(2000));
+    cr_expect(count_resident_pages((char *)ptr + 8192, 190 * 1024) == 0);
+
+    // Without decay time, they are purged as soon as they are freed
+    decay_ms = 0;
+    ptr = my_malloc(200 * 1024);
+    memset(ptr, 0xAA, 200 * 1024);
+    my_free(ptr);
+    cr_expect(count_resident_pages(ptr, 200 * 1024) == 0);
+}
+
+Test(decay, malloc_trim)
+{
+    char *ptr = my_malloc(200 * 1024);
+    char *guard = my_malloc(600);
+    memset(ptr, 0xAA, 200 * 1024);
+    my_free(ptr);
+
+    cr_expect(my_malloc_trim(0) == 1);
+    cr_expect(count_resident_pages(ptr, 200 * 1024) == 0);
+
+    // Purged pages read as zeros and can be used again
+    char *new_ptr = my_malloc(200 * 1024 - CHUNK_ALIGNMENT);
+    cr_expect(new_ptr == ptr);
+    cr_expect(new_ptr[4096] == 0);
+    memset(new_ptr, 0xBB, 200 * 1024 - CHUNK_ALIGNMENT);
+    my_free(new_ptr);
+    my_free(guard);
+}
+
+Test(decay, calloc_zero_pages)
+{
+    init_heap();
+
+    // Fresh pages of the data pool are not written
+    char *ptr = my_calloc(1, 200 * 1024);
+    cr_assert(ptr != NULL);
+    cr_expect(count_resident_pages(ptr, 200 * 1024) == 0);
+    for (size_t i = 0; i < 200 * 1024; i += 512)
+        cr_expect(ptr[i] == 0);
+    memset(ptr, 0xAA, 200 * 1024);
+    char *guard = my_malloc(600);
+    my_free(ptr);
+
+    // Neither are purged pages
+    cr_expect(my_malloc_trim(0) == 1);
+    ptr = my_calloc(1, 150 * 1024);
+    cr_assert(ptr != NULL);
+    cr_expect(count_resident_pages(ptr, 150 * 1024) == 0);
+    for (size_t i = 0; i < 150 * 1024; i++)
+        cr_assert(ptr[i] == 0);
+
+    my_free(ptr);
+    my_free(guard);
+}
+
+/* STATISTICS */
+
+Test(statistics, mallinfo2)
+{
+    char *small = my_malloc(100);
+    char *chunk = my_malloc(4000);
+    char *guard = my_malloc(4000);
+    char *large = my_malloc(LARGE_CHUNK_THRESHOLD);
+
+    struct mallinfo2 before = my_mallinfo2();
+    cr_expect(before.arena > 0);
+    cr_expect(before.hblks == 1);
+    cr_expect(before.hblkhd >= LARGE_CHUNK_THRESHOLD);
+    cr_expect(before.uordblks >= 100 + 2 * 4000);
+    cr_expect(before.uordblks + before.fordblks == before.arena);
+
+    my_free(chunk);
+    my_free(large);
+
+    struct mallinfo2 after = my_mallinfo2();
+    cr_expect(after.hblks == 0);
+    cr_expect(after.hblkhd == 0);
+    cr_expect(after.ordblks == before.ordblks + 1);
+    cr_expect(after.uordblks == before.uordblks - 4000 - sizeof(canary_t));
+    cr_expect(after.uordblks + after.fordblks == after.arena);
+
+    heap_stats_t stats;
+    get_heap_stats(&stats);
+    cr_expect(stats.counters.munmap_calls >= 1);
+    cr_expect(stats.arenas[0].free_counts[get_size_class(4000)] >= 1);
+
+    my_free(small);
+    my_free(guard);
+}
+
+Test(statistics, canary_failures)
+{
+    char *ptr = my_malloc(4000);
+    heap_stats_t stats;
+    get_heap_stats(&stats);
+    size_t failures = stats.counters.canary_failures;
+
+    ptr[4000] = 'X';
+    my_free(ptr);
+
+    get_heap_stats(&stats);
+    cr_expect(stats.counters.canary_failures == failures + 1);
+}
+
+Test(statistics, malloc_info)
+{
+    char *ptr = my_malloc(4000);
+    char *guard = my_malloc(4000);
+    my_free(ptr);
+
+    char buffer[16384];
+    FILE *fp = fmemopen(buffer, sizeof(buffer), "w");
+    cr_assert(fp != NULL);
+    cr_expect(my_malloc_info(0, fp) == 0);
+    fclose(fp);
+    cr_expect(strncmp(buffer, "<malloc version=\"1\">", 20) == 0);
+    cr_expect(strstr(buffer, "<heap nr=\"0\">") != NULL);
+    cr_expect(strstr(buffer, "<size from=\"3584\" to=\"4095\"") != NULL);
+    cr_expect(strstr(buffer, "</malloc>") != NULL);
+
+    fp = fmemopen(buffer, sizeof(buffer), "w");
+    cr_assert(fp != NULL);
+    cr_expect(my_malloc_info(MALLOC_INFO_JSON, fp) == 0);
+    fclose(fp);
+    cr_expect(strncmp(buffer, "{\"version\":1,\"heaps\":[{\"nr\":0,", 30) == 0);
+    cr_expect(strstr(buffer, "\"canary_failures\":0") != NULL);
+
+    errno = 0;
+    cr_expect(my_malloc_info(2, stdout) == -1);
+    cr_expect(errno == EINVAL);
+
+    my_free(guard);
+}
+
+/* THREADS */
+
+Test(threads, thread_cache_reuse)
+{
+    void *ptr = my_malloc(600);
+    cr_expect(ptr != NULL);
+
+    my_free(ptr);
+    chunk_list_t *chunk = get_chunk(ptr);
+    cr_expect(chunk != NULL);
+    cr_expect(get_chunk_state(chunk) == CACHED);
+
+    // The cached chunk is handed back to the same thread
+    void *new_ptr = my_malloc(596);
+    cr_expect(new_ptr == ptr);
+    cr_expect(get_chunk_state(chunk) == USED);
+
+    my_free(new_ptr);
+}
+
+Test(threads, cached_double_free_detection)
+{
+    void *ptr = my_malloc(600);
+    cr_expect(ptr != NULL);
 
+    my_free(ptr);
+    my_free(ptr);
+
+    // The second free must not have put the chunk twice in the cache
+    void *ptr1 = my_malloc(600);
+    void *ptr2 = my_malloc(600);
+    cr_expect(ptr1 != ptr2);
+
+    my_free(ptr1);
     my_free(ptr2);
 }
+
+static void *allocation_worker(void *arg)
+{
+    unsigned int seed = (unsigned int)(uintptr_t)arg;
+    void *ptrs[64] = {NULL};
+
+    for (int i = 0; i < 20000; i++)
+    {
+        int slot = rand_r(&seed) % 64;
+        if (ptrs[slot] != NULL)
+        {
+            cr_expect(((unsigned char *)ptrs[slot])[0] == (unsigned char)slot);
+            my_free(ptrs[slot]);
+        }
+
+        size_t size = rand_r(&seed) % 2048 + 1;
+        ptrs[slot] = my_malloc(size);
+        cr_assert(ptrs[slot] != NULL);
+        memset(ptrs[slot], slot, size);
+    }
+
+    for (int slot = 0; slot < 64; slot++)
+        my_free(ptrs[slot]);
+
+    return NULL;
+}
+
+Test(threads, concurrent_allocations)
+{
+    pthread_t threads[8];
+
+    for (uintptr_t i = 0; i < 8; i++)
+        cr_assert(pthread_create(&threads[i], NULL, allocation_worker, (void *)(i + 1)) == 0);
+
+    for (int i = 0; i < 8; i++)
+        pthread_join(threads[i], NULL);
+}
+
+static void *remote_free_worker(void *arg)
+{
+    my_free(arg);
+    return NULL;
+}
+
+Test(threads, remote_free)
+{
+    // Two arenas: the main thread gets the first one, the worker the second one
+    setenv("MSM_ARENAS", "2", 1);
+
+    // Bigger than THREAD_CACHE_MAX_SIZE so the chunk skips the thread cache
+    void *ptr = my_malloc(2000);
+    cr_expect(ptr != NULL);
+    cr_expect(arena_count == 2);
+
+    chunk_list_t *chunk = get_chunk(ptr);
+    pthread_t thread;
+    cr_assert(pthread_create(&thread, NULL, remote_free_worker, ptr) == 0);
+    pthread_join(thread, NULL);
+
+    cr_expect(get_chunk_state(chunk) == PENDING);
+
+    // The owner drains its remote free queue on its next allocation
+    void *new_ptr = my_malloc(2000);
+    cr_expect(new_ptr == ptr);
+    my_free(new_ptr);
+}
+
+Test(threads, concurrent_allocations_many_arenas)
+{
+    setenv("MSM_ARENAS", "4", 1);
+
+    pthread_t threads[8];
+    for (uintptr_t i = 0; i < 8; i++)
+        cr_assert(pthread_create(&threads[i], NULL, allocation_worker, (void *)(i + 1)) == 0);
+
+    for (int i = 0; i < 8; i++)
+        pthread_join(threads[i], NULL);
+}
+
+static void *large_realloc_worker(void *arg)
+{
+    unsigned int seed = (unsigned int)(uintptr_t)arg;
+    unsigned char *ptrs[8] = {NULL};
+    size_t sizes[8] = {0};
+
+    for (int i = 0; i < 2000; i++)
+    {
+        int slot = rand_r(&seed) % 8;
+        size_t size = LARGE_CHUNK_THRESHOLD + rand_r(&seed) % (4 * LARGE_CHUNK_THRESHOLD);
+
+        // Only the ends are written, a block moved or unmapped by another thread is still seen
+        if (ptrs[slot] != NULL)
+        {
+            cr_expect(ptrs[slot][0] == (unsigned char)slot);
+            cr_expect(ptrs[slot][sizes[slot] - 1] == (unsigned char)slot);
+        }
+
+        if (ptrs[slot] != NULL && rand_r(&seed) % 4 == 0)
+        {
+            my_free(ptrs[slot]);
+            ptrs[slot] = my_malloc(size);
+        }
+        else
+        {
+            unsigned char *ptr = my_realloc(ptrs[slot], size);
+            cr_assert(ptr != NULL);
+            if (ptrs[slot] != NULL)
+                cr_expect(ptr[0] == (unsigned char)slot);
+            ptrs[slot] = ptr;
+        }
+
+        cr_assert(ptrs[slot] != NULL);
+        cr_expect(my_malloc_usable_size(ptrs[slot]) >= size);
+        sizes[slot] = size;
+        ptrs[slot][0] = (unsigned char)slot;
+        ptrs[slot][size - 1] = (unsigned char)slot;
+    }
+
+    for (int slot = 0; slot < 8; slot++)
+        my_free(ptrs[slot]);
+
+    return NULL;
+}
+
+Test(threads, large_reallocations_many_arenas)
+{
+    // Mappings moved by mremap in one arena are taken by mmap in the others
+    setenv("MSM_ARENAS", "4", 1);
+
+    pthread_t threads[8];
+    for (uintptr_t i = 0; i < 8; i++)
+        cr_assert(pthread_create(&threads[i], NULL, large_realloc_worker, (void *)(i + 1)) == 0);
+
+    for (int i = 0; i < 8; i++)
+        pthread_join(threads[i], NULL);
+}
+
+Test(threads, fork_during_allocations)
+{
+    setenv("MSM_ARENAS", "2", 1);
+
+    uint8_t *inherited = my_malloc(2000);
+    cr_assert(inherited != NULL);
+    memset(inherited, 0x5a, 2000);
+    cr_expect(start_heap_scanner(100) == 0);
+
+    pthread_t thread;
+    cr_assert(pthread_create(&thread, NULL, allocation_worker, (void *)1) == 0);
+
+    for (int i = 0; i < 20; i++)
+    {
+        pid_t pid = fork();
+        cr_assert(pid != -1);
+        if (pid == 0)
+        {
+            // A held lock would block the child until the alarm kills it
+            alarm(10);
+            for (int j = 0; j < 1000; j++)
+                my_free(my_malloc(j % 3000 + 1));
+
+            int intact = inherited[1999] == 0x5a;
+            my_free(inherited);
+            stop_heap_scanner();
+            _exit(intact ? 0 : 1);
+        }
+
+        int status = 0;
+        waitpid(pid, &status, 0);
+        cr_expect(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+
+    pthread_join(thread, NULL);
+    stop_heap_scanner();
+    my_free(inherited);
+}
@@ -0,0 +1,311 @@
+#include <stdio.h>        // printf, fopen, fread
+#include <stdlib.h>       // malloc, qsort
+#include <string.h>       // memcmp, memset
+#include <time.h>         // clock_gettime
+#include <sys/resource.h> // getrusage
+
+#include "my_secmalloc.private.h"
+#include "utils.h"
+
+extern int log_fd;
+
+/** @brief Number of operations of the trace format, TRACE_DROPPED included. */
+#define REPLAY_OP_COUNT (TRACE_DROPPED + 1)
+
+/**
+ * @struct replay_slot_t
+ * @brief Represents a slot of the table mapping the addresses of the trace to the replayed ones.
+ */
+typedef struct replay_slot_t
+{
+    uint64_t address; // Address in the trace, 0 if the slot is empty
+    void *ptr;        // Replayed allocation, NULL once it is freed
+} replay_slot_t;
+
+/**
+ * @struct replay_t
+ * @brief Represents the state of a replay.
+ */
+typedef struct replay_t
+{
+    replay_slot_t *slots;                // Open-addressing table, keyed by trace address
+    size_t capacity;                     // Number of slots, a power of two
+    uint64_t *latencies[REPLAY_OP_COUNT]; // Latency of each replayed call in nanoseconds, by operation
+    size_t counts[REPLAY_OP_COUNT];       // Number of replayed calls by operation
+    size_t missing;                      // Frees and reallocs of addresses the trace never returned
+    size_t dropped;                      // Records dropped while the trace was taken
+} replay_t;
+
+static const char *op_names[REPLAY_OP_COUNT] = {"?", "malloc", "free", "calloc", "realloc", "memalign", "dropped"};
+
+/**
+ * @brief Returns a monotonic timestamp in nanoseconds.
+ */
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * @brief Returns the peak resident size of the process in KiB.
+ */
+static long get_peak_rss(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    return usage.ru_maxrss;
+}
+
+/**
+ * @brief Finds the slot of a trace address, or the empty slot where it belongs.
+ *
+ * @param replay The state of the replay.
+ * @param address An address of the trace, not 0.
+ * @return The slot of the address.
+ */
+static replay_slot_t *find_replay_slot(replay_t *replay, uint64_t address)
+{
+    size_t index = (size_t)((address >> 4) * 0x9E3779B97F4A7C15ULL) & (replay->capacity - 1);
+
+    while (replay->slots[index].address != 0 && replay->slots[index].address != address)
+        index = (index + 1) & (replay->capacity - 1);
+
+    return &replay->slots[index];
+}
+
+/**
+ * @brief Takes the replayed allocation of a trace address out of the table.
+ *
+ * @param replay The state of the replay.
+ * @param address An address given to free or realloc in the trace.
+ * @return The replayed allocation, or NULL if the address is unknown.
+ */
+static void *take_replay_ptr(replay_t *replay, uint64_t address)
+{
+    if (address == 0)
+        return NULL;
+
+    replay_slot_t *slot = find_replay_slot(replay, address);
+    void *ptr = slot->ptr;
+    if (ptr == NULL)
+        replay->missing++;
+
+    slot->ptr = NULL;
+
+    return ptr;
+}
+
+/**
+ * @brief Records the replayed allocation of a trace address.
+ * A live allocation already at this address is freed: its free was recorded after
+ * the allocation reusing its address, which happens when they race in the traced process.
+ *
+ * @param replay The state of the replay.
+ * @param address An address returned in the trace.
+ * @param ptr The replayed allocation.
+ */
+static void put_replay_ptr(replay_t *replay, uint64_t address, void *ptr)
+{
+    if (address == 0)
+    {
+        my_free(ptr);
+        return;
+    }
+
+    replay_slot_t *slot = find_replay_slot(replay, address);
+    if (slot->ptr != NULL)
+        my_free(slot->ptr);
+
+    slot->address = address;
+    slot->ptr = ptr;
+}
+
+/**
+ * @brief Replays a record of the trace.
+ *
+ * @param replay The state of the replay.
+ * @param record The record to replay.
+ */
+static void replay_record(replay_t *replay, const trace_record_t *record)
+{
+    uint64_t start = 0;
+    void *ptr = NULL;
+
+    switch (record->op)
+    {
+    case TRACE_MALLOC:
+        start = now_ns();
+        ptr = my_malloc(record->size);
+        break;
+    case TRACE_CALLOC:
+        start = now_ns();
+        ptr = my_calloc(1, record->size);
+        break;
+    case TRACE_MEMALIGN:
+        start = now_ns();
+        ptr = my_memalign(record->ptr, record->size);
+        break;
+    case TRACE_FREE:
+        ptr = take_replay_ptr(replay, record->ptr);
+        if (ptr == NULL)
+            return;
+        start = now_ns();
+        my_free(ptr);
+        break;
+    case TRACE_REALLOC:
+        ptr = take_replay_ptr(replay, record->ptr);
+        start = now_ns();
+        ptr = my_realloc(ptr, record->size);
+        break;
+    case TRACE_DROPPED:
+        replay->dropped += record->size;
+        return;
+    default:
+        return;
+    }
+
+    uint64_t latency = now_ns() - start;
+    replay->latencies[record->op][replay->counts[record->op]++] = latency;
+
+    if (record->op != TRACE_FREE && ptr != NULL)
+        put_replay_ptr(replay, record->address, ptr);
+}
+
+/**
+ * @brief Compares two latencies for qsort.
+ */
+static int compare_latencies(const void *first, const void *second)
+{
+    uint64_t a = *(const uint64_t *)first;
+    uint64_t b = *(const uint64_t *)second;
+
+    return (a > b) - (a < b);
+}
+
+/**
+ * @brief Prints the latency percentiles of the calls of an operation.
+ *
+ * @param name The name of the operation.
+ * @param latencies The latencies of its calls, sorted in place.
+ * @param count The number of calls.
+ */
+static void print_latencies(const char *name, uint64_t *latencies, size_t count)
+{
+    if (count == 0)
+        return;
+
+    qsort(latencies, count, sizeof(uint64_t), compare_latencies);
+
+    printf("%-8s %10zu %8lu %8lu %8lu %8lu %10lu\n", name, count,
+           (unsigned long)latencies[count / 2],
+           (unsigned long)latencies[count * 90 / 100],
+           (unsigned long)latencies[count * 99 / 100],
+           (unsigned long)latencies[count * 999 / 1000],
+           (unsigned long)latencies[count - 1]);
+}
+
+/**
+ * @brief Loads a trace file in memory and checks its header.
+ *
+ * @param path The path of the trace file.
+ * @param count Set to the number of records.
+ * @return The records, or NULL if the file is not a trace.
+ */
+static trace_record_t *load_trace(const char *path, size_t *count)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        perror(path);
+        return NULL;
+    }
+
+    trace_header_t header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 || header.version != TRACE_VERSION || header.record_size != sizeof(trace_record_t))
+    {
+        fprintf(stderr, "%s: not a version %d trace\n", path, TRACE_VERSION);
+        fclose(file);
+        return NULL;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, sizeof(header), SEEK_SET);
+
+    *count = (size_t)(size - (long)sizeof(header)) / sizeof(trace_record_t);
+    trace_record_t *records = malloc(*count * sizeof(trace_record_t) + 1);
+    if (records == NULL || fread(records, sizeof(trace_record_t), *count, file) != *count)
+    {
+        fprintf(stderr, "%s: can't read the records\n", path);
+        free(records);
+        records = NULL;
+    }
+
+    fclose(file);
+
+    return records;
+}
+
+/**
+ * @brief Replays an allocation trace against my_malloc, my_calloc, my_realloc, my_memalign and my_free.
+ * Records are replayed in the order they were taken, on a single thread, and the
+ * throughput, the latency percentiles and the peak resident size are reported.
+ * The bookkeeping of the replay uses the allocator of the C library.
+ *
+ * Usage: replay <trace file>
+ */
+int main(int argc, char **argv)
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "usage: %s <trace file>\n", argv[0]);
+        return 1;
+    }
+
+    size_t count = 0;
+    trace_record_t *records = load_trace(argv[1], &count);
+    if (records == NULL)
+        return 1;
+
+    // Everything the replay needs is allocated and touched before it starts
+    replay_t replay = {0};
+    for (replay.capacity = 1024; replay.capacity < 2 * count; replay.capacity *= 2)
+        ;
+    replay.slots = calloc(replay.capacity, sizeof(replay_slot_t));
+    for (int op = 0; op < REPLAY_OP_COUNT; op++)
+    {
+        replay.latencies[op] = malloc((count + 1) * sizeof(uint64_t));
+        if (replay.latencies[op] == NULL)
+            return 1;
+        memset(replay.latencies[op], 0, (count + 1) * sizeof(uint64_t));
+    }
+    if (replay.slots == NULL)
+        return 1;
+
+    init_heap();
+    log_fd = DEACTIVATE_LOGGING;
+    long base_rss = get_peak_rss();
+
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < count; i++)
+        replay_record(&replay, &records[i]);
+    uint64_t elapsed = now_ns() - start;
+
+    long peak_rss = get_peak_rss();
+    size_t calls = 0;
+    for (int op = TRACE_MALLOC; op < TRACE_DROPPED; op++)
+        calls += replay.counts[op];
+
+    printf("records:    %zu (%zu dropped while tracing, %zu unknown addresses)\n", count, replay.dropped, replay.missing);
+    printf("throughput: %.2f Mcalls/s (%zu calls in %.3f ms)\n", calls / (elapsed / 1e3), calls, elapsed / 1e6);
+    printf("peak RSS:   %ld KiB (%ld KiB above the replay bookkeeping)\n\n", peak_rss, peak_rss - base_rss);
+    printf("%-8s %10s %8s %8s %8s %8s %10s\n", "op", "calls", "p50 ns", "p90 ns", "p99 ns", "p99.9 ns", "max ns");
+    for (int op = TRACE_MALLOC; op < TRACE_DROPPED; op++)
+        print_latencies(op_names[op], replay.latencies[op], replay.counts[op]);
+
+    return 0;
+}